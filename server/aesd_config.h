@@ -17,12 +17,149 @@
 #define RECV_BUF_SZ 4096
 #endif
 
+/* Smallest receive buffer the event loop sizes a connection down to */
+#ifndef RECV_BUF_MIN
+#define RECV_BUF_MIN 512
+#endif
+
+/* Largest single sendfile/splice call when streaming a reply */
 #ifndef WRITE_CHUNK_SZ
-#define WRITE_CHUNK_SZ 1024
+#define WRITE_CHUNK_SZ (1<<20)
+#endif
+
+/*
+ * Upper bounds for --recv-buf, --max-packet and --write-chunk. A packet
+ * index block must span less than 4 GiB (see pktidx.h), which caps the
+ * packet size at 4 MiB.
+ */
+#ifndef RECV_BUF_MAX
+#define RECV_BUF_MAX (16 * 1024 * 1024)
+#endif
+
+#ifndef MAX_PACKET_MAX
+#define MAX_PACKET_MAX (4 * 1024 * 1024)
+#endif
+
+#ifndef WRITE_CHUNK_MAX
+#define WRITE_CHUNK_MAX (64 * 1024 * 1024)
 #endif
 
 #ifndef AESD_DATA_PATH
 #define AESD_DATA_PATH "/var/tmp/aesdsocketdata"
 #endif
 
+#ifndef WORKER_THREADS
+#define WORKER_THREADS 8
+#endif
+
+#ifndef WORK_QUEUE_DEPTH
+#define WORK_QUEUE_DEPTH 64
+#endif
+
+#ifndef HC_STEP_RECV_BUDGET
+#define HC_STEP_RECV_BUDGET 16
+#endif
+
+#ifndef EV_MAX_EVENTS
+#define EV_MAX_EVENTS 64
+#endif
+
+#ifndef URING_ENTRIES
+#define URING_ENTRIES 64
+#endif
+
+#ifndef URING_REPLY_BUF
+#define URING_REPLY_BUF (64 * 1024)
+#endif
+
+/* In-memory mirror of the data file: ceiling (0 disables) and chunk size */
+#ifndef MIRROR_MAX_BYTES
+#define MIRROR_MAX_BYTES (64 * 1024 * 1024)
+#endif
+
+#ifndef MIRROR_CHUNK_SZ
+#define MIRROR_CHUNK_SZ (1<<20)
+#endif
+
+/* Largest -m: the chunk table for it is allocated up front */
+#ifndef MIRROR_CEILING_MAX
+#define MIRROR_CEILING_MAX ((size_t)1 << (sizeof(size_t) > 4 ? 36 : 31))
+#endif
+
+/* Most iovecs gathered into one group-commit writev */
+#ifndef GC_MAX_IOV
+#define GC_MAX_IOV 1024
+#endif
+
+/* Newline offsets indexed per nl_scan() call in the framing loop */
+#ifndef NL_BATCH
+#define NL_BATCH 64
+#endif
+
+/* Connection buffer pool: bytes kept on its free lists */
+#ifndef BUFPOOL_MAX_CACHED
+#define BUFPOOL_MAX_CACHED (16 * 1024 * 1024)
+#endif
+
+/* Line builder capacity, and how big it may stay after a large line */
+#ifndef SB_BASE_CAP
+#define SB_BASE_CAP 4096
+#endif
+
+#ifndef SB_TRIM_ABOVE
+#define SB_TRIM_ABOVE (64 * 1024)
+#endif
+
+/*
+ * Connection buffer bytes (all shards) past which the event loop stops
+ * reading from its heaviest connections, 0: no limit; and how often it
+ * looks again while some are paused, ms
+ */
+#ifndef MEM_BUDGET
+#define MEM_BUDGET (64 * 1024 * 1024)
+#endif
+
+#ifndef EV_THROTTLE_POLL_MS
+#define EV_THROTTLE_POLL_MS 10
+#endif
+
+/* Seconds between "timestamp:" lines in the data, 0 disables */
+#ifndef TIMESTAMP_INTERVAL_S
+#define TIMESTAMP_INTERVAL_S 10
+#endif
+
+/* First allocation of a line builder that starts out empty */
+#ifndef SB_MIN_CAP
+#define SB_MIN_CAP 256
+#endif
+
+/* Segment size when retention is set without one */
+#ifndef STORE_SEG_BYTES
+#define STORE_SEG_BYTES (16 * 1024 * 1024)
+#endif
+
+/* Packets per block of the packet offset index */
+#ifndef PKTIDX_BLOCK
+#define PKTIDX_BLOCK 1024
+#endif
+
+/* "AESDCHAR_IOCSEEKTO:X,Y\n" replies from byte Y of write command X */
+#ifndef SEEKTO_CMD
+#define SEEKTO_CMD "AESDCHAR_IOCSEEKTO:"
+#endif
+
+/* Async logger: ring slots (a power of two) and records sent to syslog per second */
+#ifndef ALOG_RING_SLOTS
+#define ALOG_RING_SLOTS 4096
+#endif
+
+#ifndef ALOG_RATE
+#define ALOG_RATE 1000
+#endif
+
+/* Upper bound for -P, the SO_REUSEPORT shard count */
+#ifndef SHARDS_MAX
+#define SHARDS_MAX 1024
+#endif
+
 #endif
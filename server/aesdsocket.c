@@ -1,54 +1,398 @@
+#define _GNU_SOURCE /* CPU_SET, pthread_setaffinity_np */
 #include "aesdsocket.h"
 
 static void print_usage(void) {
-	fprintf(stderr, "Usage: no arg || -d || -p <PORT>\n"
-			"Port must be 4 digits!");
+	fprintf(stderr, "Usage: aesdsocket [OPTION]...\n"
+			"  -f, --config=FILE         read options from FILE, one\n"
+			"                            \"name = value\" per line (long\n"
+			"                            names); the command line wins\n"
+			"  -d, --daemon              run as a daemon\n"
+			"  -e, --event-loop          serve all clients from one epoll\n"
+			"                            event loop\n"
+			"  -u, --uring               use io_uring in the workers when\n"
+			"                            available; ignored with a\n"
+			"                            --durability other than none\n"
+			"      --durability=MODE     when appended data is fdatasync'd:\n"
+			"                            none (default), strict (every\n"
+			"                            batch, before its replies),\n"
+			"                            interval:MS, packets:N or bytes:N\n"
+			"                            (in the background, replies do\n"
+			"                            not wait)\n"
+			"  -S, --sync                same as --durability=strict\n"
+			"      --timestamp-interval=SECS\n"
+			"                            append a \"timestamp:<RFC 2822\n"
+			"                            time>\" line every SECS (default\n"
+			"                            10), 0 disables\n"
+			"  -m, --mirror-max=BYTES    memory mirror ceiling, 0 disables\n"
+			"  -p, --port=PORT           listen port, must be 4 digits!\n"
+			"  -c, --coalesce-port=PORT  extra port whose clients get one\n"
+			"                            reply per recv batch instead of\n"
+			"                            one per line, also 4 digits\n"
+			"  -D, --data-path=PATH      data file (default "
+			AESD_DATA_PATH ")\n"
+			"  -s, --segment-bytes=BYTES roll the data over to a new segment\n"
+			"                            file every BYTES (default: one\n"
+			"                            unbounded file)\n"
+			"  -R, --retain-bytes=BYTES  keep only the newest BYTES of data\n"
+			"  -N, --retain-packets=N    keep only the newest N packets\n"
+			"  -r, --ring=N              keep only the newest N packets, in\n"
+			"                            memory and without any file (not\n"
+			"                            with -s, -R or -N)\n"
+			"  -M, --stats=PORT|PATH     serve counters in Prometheus text\n"
+			"                            format on this localhost port, or\n"
+			"                            Unix socket if PATH has a '/';\n"
+			"                            SIGUSR1 logs them to syslog either way\n"
+			"  -P, --shards=N            N SO_REUSEPORT listeners, each with\n"
+			"                            its own accept loop (or event loop\n"
+			"                            with -e) pinned to a CPU; 0 means\n"
+			"                            one per online CPU\n"
+			"      --recv-buf=BYTES      per-connection receive buffer; with\n"
+			"                            -e, the most one grows to\n"
+			"      --max-packet=BYTES    longest packet kept, newline included\n"
+			"      --write-chunk=BYTES   most bytes per sendfile/splice call\n"
+			"      --mem-budget=BYTES    connection buffer memory before -e\n"
+			"                            stops reading from the heaviest\n"
+			"                            clients, 0 disables; -e only, the\n"
+			"                            worker threads are not throttled\n"
+			"      --backlog=N           listen backlog\n"
+			"      --tcp-nodelay=on|off  disable Nagle on client sockets\n"
+			"                            (default on)\n"
+			"      --rcvbuf=BYTES        SO_RCVBUF for clients, 0: kernel\n"
+			"      --sndbuf=BYTES        SO_SNDBUF for clients, 0: kernel\n"
+			"      --defer-accept=SECS   TCP_DEFER_ACCEPT, 0 disables\n"
+			"Sizes take a K, M or G suffix.\n");
 }
 
-static int parse_args(ServerContext *ctx, int argc, char **argv) {
-	if (argc > 4) {
-		print_usage();
+/* Long-only options */
+enum {
+	OPT_RECV_BUF = 256,
+	OPT_MAX_PACKET,
+	OPT_WRITE_CHUNK,
+	OPT_BACKLOG,
+	OPT_TCP_NODELAY,
+	OPT_RCVBUF,
+	OPT_SNDBUF,
+	OPT_DEFER_ACCEPT,
+	OPT_MEM_BUDGET,
+	OPT_DURABILITY,
+	OPT_TIMESTAMP_INTERVAL,
+};
+
+#define SHORT_OPTS "f:deuSm:p:c:D:s:R:N:r:M:P:h"
+
+static const struct option long_opts[] = {
+	{ "config",         required_argument, NULL, 'f' },
+	{ "daemon",         no_argument,       NULL, 'd' },
+	{ "event-loop",     no_argument,       NULL, 'e' },
+	{ "uring",          no_argument,       NULL, 'u' },
+	{ "sync",           no_argument,       NULL, 'S' },
+	{ "durability",     required_argument, NULL, OPT_DURABILITY },
+	{ "timestamp-interval", required_argument, NULL, OPT_TIMESTAMP_INTERVAL },
+	{ "mirror-max",     required_argument, NULL, 'm' },
+	{ "port",           required_argument, NULL, 'p' },
+	{ "coalesce-port",  required_argument, NULL, 'c' },
+	{ "data-path",      required_argument, NULL, 'D' },
+	{ "segment-bytes",  required_argument, NULL, 's' },
+	{ "retain-bytes",   required_argument, NULL, 'R' },
+	{ "retain-packets", required_argument, NULL, 'N' },
+	{ "ring",           required_argument, NULL, 'r' },
+	{ "stats",          required_argument, NULL, 'M' },
+	{ "shards",         required_argument, NULL, 'P' },
+	{ "recv-buf",       required_argument, NULL, OPT_RECV_BUF },
+	{ "max-packet",     required_argument, NULL, OPT_MAX_PACKET },
+	{ "write-chunk",    required_argument, NULL, OPT_WRITE_CHUNK },
+	{ "backlog",        required_argument, NULL, OPT_BACKLOG },
+	{ "tcp-nodelay",    required_argument, NULL, OPT_TCP_NODELAY },
+	{ "rcvbuf",         required_argument, NULL, OPT_RCVBUF },
+	{ "sndbuf",         required_argument, NULL, OPT_SNDBUF },
+	{ "defer-accept",   required_argument, NULL, OPT_DEFER_ACCEPT },
+	{ "mem-budget",     required_argument, NULL, OPT_MEM_BUDGET },
+	{ "help",           no_argument,       NULL, 'h' },
+	{ NULL, 0, NULL, 0 },
+};
+
+/* Accepted range of every numeric option */
+static const struct {
+	int opt;
+	unsigned long long min, max;
+} opt_ranges[] = {
+	{ 'm',              0,    MIRROR_CEILING_MAX },
+	{ 's',              0,    INT64_MAX },
+	{ 'R',              0,    INT64_MAX },
+	{ 'N',              0,    UINT64_MAX },
+	{ 'r',              0,    SIZE_MAX },
+	{ 'P',              0,    SHARDS_MAX },
+	{ OPT_RECV_BUF,     512,  RECV_BUF_MAX },
+	{ OPT_MAX_PACKET,   2,    MAX_PACKET_MAX },
+	{ OPT_WRITE_CHUNK,  4096, WRITE_CHUNK_MAX },
+	{ OPT_BACKLOG,      1,    65535 },
+	{ OPT_RCVBUF,       0,    INT_MAX / 2 },
+	{ OPT_SNDBUF,       0,    INT_MAX / 2 },
+	{ OPT_DEFER_ACCEPT, 0,    3600 },
+	{ OPT_MEM_BUDGET,   0,    SIZE_MAX },
+	{ OPT_TIMESTAMP_INTERVAL, 0, 86400 },
+};
+
+static const char *opt_name(int opt) {
+	for (const struct option *o = long_opts; o->name; o++) {
+		if (o->val == opt)
+			return o->name;
+	}
+	return "?";
+}
+
+/* Unsigned decimal option argument, with an optional K, M or G */
+static int parse_count(const char *arg, unsigned long long *out) {
+	char *endp;
+	errno = 0;
+	unsigned long long v = strtoull(arg, &endp, 10);
+	if (errno || endp == arg || arg[0] == '-')
+		return -1;
+
+	unsigned shift = 0;
+	switch (*endp) {
+	case 'K': case 'k': shift = 10; endp++; break;
+	case 'M': case 'm': shift = 20; endp++; break;
+	case 'G': case 'g': shift = 30; endp++; break;
+	}
+	if (*endp || v > (ULLONG_MAX >> shift))
 		return -1;
-	} 
+	*out = v << shift;
+	return 0;
+}
+
+static int parse_bool(const char *arg, bool *out) {
+	static const char *const yes[] = { "1", "on", "yes", "true" };
+	static const char *const no[] = { "0", "off", "no", "false" };
 
-	switch (argc) {
-	case 1:
-		/* run default port, no daemon */
+	for (size_t i = 0; i < sizeof yes / sizeof yes[0]; i++) {
+		if (!strcasecmp(arg, yes[i])) { *out = true; return 0; }
+		if (!strcasecmp(arg, no[i])) { *out = false; return 0; }
+	}
+	return -1;
+}
+
+static int parse_ranged(int opt, const char *arg, unsigned long long *v) {
+	for (size_t i = 0; i < sizeof opt_ranges / sizeof opt_ranges[0]; i++) {
+		if (opt_ranges[i].opt != opt)
+			continue;
+		if (parse_count(arg, v) == -1 || *v < opt_ranges[i].min
+				|| *v > opt_ranges[i].max) {
+			fprintf(stderr, "aesdsocket: --%s=%s: want %llu..%llu\n",
+				opt_name(opt), arg, opt_ranges[i].min,
+				opt_ranges[i].max);
+			return -1;
+		}
 		return 0;
-	case 2:
-		/* Must be -d or invalid */
-		if (!memcmp(argv[1], "-d", 2)) {
-			ctx->daemonize = true;
-			return 0;
-		} else {
-			print_usage();
+	}
+	return -1;
+}
+
+/*
+ * Apply one option from the command line or the config file. Flags take
+ * NULL (set) or a boolean; everything else is validated here.
+ */
+static int apply_opt(ServerContext *ctx, int opt, char *arg) {
+	unsigned long long v = 0;
+	bool on = true;
+
+	switch (opt) {
+	case 'd': case 'e': case 'u': case 'S':
+		if (arg && parse_bool(arg, &on) == -1) {
+			fprintf(stderr, "aesdsocket: --%s=%s: want on or off\n",
+				opt_name(opt), arg);
 			return -1;
 		}
-	case 3:
-		/* Must be -p <PORT> */
-		if (!memcmp(argv[1], "-p", 2)) {
-			if ((strlen(argv[2]) == 4)) {
-				ctx->port = argv[2];
-			}
+		if (opt == 'd') ctx->daemonize = on;
+		else if (opt == 'e') ctx->event_loop = on;
+		else if (opt == 'u') ctx->use_uring = on;
+		else if (on) ctx->durability = (fl_opts_t){ .mode = FL_STRICT };
+		else if (ctx->durability.mode == FL_STRICT)
+			ctx->durability = (fl_opts_t){ .mode = FL_NONE };
+		return 0;
+	case OPT_DURABILITY:
+		if (fl_parse(arg, &ctx->durability) == -1) {
+			fprintf(stderr, "aesdsocket: --durability=%s: want none, "
+				"strict, interval:MS, packets:N or bytes:N\n",
+				arg);
+			return -1;
 		}
+		return 0;
+	case OPT_TCP_NODELAY:
+		if (parse_bool(arg, &ctx->tcp_nodelay) == -1) {
+			fprintf(stderr, "aesdsocket: --%s=%s: want on or off\n",
+				opt_name(opt), arg);
+			return -1;
+		}
+		return 0;
+	case 'p':
+	case 'c':
+		if (strlen(arg) != 4) {
+			fprintf(stderr, "aesdsocket: --%s=%s: port must be "
+				"4 digits\n", opt_name(opt), arg);
+			return -1;
+		}
+		if (opt == 'p') ctx->port = arg;
+		else ctx->coalesce_port = arg;
+		return 0;
+	case 'D':
+		if (!*arg) {
+			fprintf(stderr, "aesdsocket: --data-path: empty path\n");
+			return -1;
+		}
+		ctx->data_path = arg;
+		return 0;
+	case 'M':
+		ctx->stats_addr = arg;
+		return 0;
+	}
+
+	if (parse_ranged(opt, arg, &v) == -1)
+		return -1;
+
+	switch (opt) {
+	case 'm': ctx->mirror_max = (size_t)v; break;
+	case 's': ctx->store_opts.seg_bytes = (off_t)v; break;
+	case 'R': ctx->store_opts.keep_bytes = (off_t)v; break;
+	case 'N': ctx->store_opts.keep_packets = v; break;
+	case 'r': ctx->store_opts.ring_packets = (size_t)v; break;
+	case 'P':
+		ctx->sharded = true;
+		ctx->nshards = (size_t)v;
+		break;
+	case OPT_RECV_BUF: ctx->recv_buf_sz = (size_t)v; break;
+	case OPT_MAX_PACKET: ctx->max_packet = (size_t)v; break;
+	case OPT_WRITE_CHUNK: ctx->write_chunk = (size_t)v; break;
+	case OPT_BACKLOG: ctx->backlog = (int)v; break;
+	case OPT_RCVBUF: ctx->rcvbuf = (int)v; break;
+	case OPT_SNDBUF: ctx->sndbuf = (int)v; break;
+	case OPT_DEFER_ACCEPT: ctx->defer_accept = (int)v; break;
+	case OPT_MEM_BUDGET:
+		ctx->mem_budget = (size_t)v;
+		ctx->mem_budget_set = true;
 		break;
-	case 4:
-		/* -d -p <PORT> or invalid */
-		if ((!memcmp(argv[1], "-d", 2) &&
-		   (!memcmp(argv[2], "-p", 2)) &&
-		   ((strlen(argv[3]) == 4)))) {
-			ctx->daemonize = true;
-			ctx->port = argv[3];
-			return 0;
-		} else {
+	case OPT_TIMESTAMP_INTERVAL: ctx->timestamp_interval = (unsigned)v; break;
+	}
+	return 0;
+}
+
+/* conf_load() callback: a config file line is a long option */
+static int apply_conf(void *arg, const char *key, const char *val,
+		unsigned line) {
+	ServerContext *ctx = arg;
+
+	for (const struct option *o = long_opts; o->name; o++) {
+		if (strcmp(o->name, key))
+			continue;
+		if (o->val == 'f' || o->val == 'h')
+			break;
+		if (o->has_arg == required_argument && !val) {
+			fprintf(stderr, "aesdsocket: %s:%u: %s needs a value\n",
+				ctx->config_path, line, key);
+			return -1;
+		}
+		if (apply_opt(ctx, o->val, (char *)val) == -1) {
+			fprintf(stderr, "aesdsocket: %s:%u: bad value\n",
+				ctx->config_path, line);
+			return -1;
+		}
+		return 0;
+	}
+
+	fprintf(stderr, "aesdsocket: %s:%u: unknown option '%s'\n",
+		ctx->config_path, line, key);
+	return -1;
+}
+
+/*
+ * Defaults, then the config file named by -f, then the command line,
+ * so a command line option overrides the file.
+ */
+static int parse_args(ServerContext *ctx, int argc, char **argv) {
+	int opt;
+
+	/* First pass: only look for the config file */
+	opterr = 0;
+	while ((opt = getopt_long(argc, argv, SHORT_OPTS, long_opts,
+			NULL)) != -1) {
+		if (opt == 'f')
+			ctx->config_path = optarg;
+	}
+	opterr = 1;
+	optind = 0; /* full rescan */
+
+	if (ctx->config_path && conf_load(ctx->config_path, apply_conf, ctx,
+			&ctx->conf_buf) != 0) {
+		if (!ctx->conf_buf)
+			fprintf(stderr, "aesdsocket: %s: %s\n", ctx->config_path,
+				strerror(errno));
+		return -1;
+	}
+
+	while ((opt = getopt_long(argc, argv, SHORT_OPTS, long_opts,
+			NULL)) != -1) {
+		if (opt == 'f')
+			continue;
+		if (opt == 'h' || opt == '?') {
 			print_usage();
 			return -1;
 		}
+		if (apply_opt(ctx, opt, optarg) == -1)
+			return -1;
 	}
-		   
+
+	if (optind != argc) {
+		print_usage();
+		return -1;
+	}
+
+	const store_opts_t *so = &ctx->store_opts;
+	if (so->ring_packets
+			&& (so->seg_bytes || so->keep_bytes || so->keep_packets)) {
+		fprintf(stderr, "aesdsocket: --ring does not go with "
+			"--segment-bytes, --retain-bytes or --retain-packets\n");
+		return -1;
+	}
+
+	/* Only the event loop throttles reads; a worker serves one client */
+	if (!ctx->event_loop) {
+		if (ctx->mem_budget_set)
+			fprintf(stderr, "aesdsocket: --mem-budget needs -e, "
+				"ignored\n");
+		ctx->mem_budget = 0;
+	}
+
 	return 0;
 }
 
+/* The settings in effect, in config file syntax */
+static void log_config(const ServerContext *ctx) {
+	const store_opts_t *so = &ctx->store_opts;
+	char durability[32];
+
+	syslog(LOG_INFO, "config: port = %s, coalesce-port = %s, "
+	       "data-path = %s, event-loop = %s, uring = %s, durability = %s, "
+	       "timestamp-interval = %u, shards = %zu", ctx->port,
+	       ctx->coalesce_port ? ctx->coalesce_port : "none",
+	       ctx->data_path, ctx->event_loop ? "on" : "off",
+	       ctx->use_uring ? "on" : "off",
+	       fl_format(&ctx->durability, durability, sizeof durability),
+	       ctx->timestamp_interval, ctx->sharded ? ctx->nshards : 0);
+	syslog(LOG_INFO, "config: recv-buf = %zu, max-packet = %zu, "
+	       "write-chunk = %zu, mirror-max = %zu, segment-bytes = %lld, "
+	       "retain-bytes = %lld, retain-packets = %llu, ring = %zu, "
+	       "mem-budget = %zu",
+	       ctx->recv_buf_sz, ctx->max_packet, ctx->write_chunk,
+	       ctx->mirror_max, (long long)so->seg_bytes,
+	       (long long)so->keep_bytes,
+	       (unsigned long long)so->keep_packets, so->ring_packets,
+	       ctx->mem_budget);
+	syslog(LOG_INFO, "config: backlog = %d, tcp-nodelay = %s, rcvbuf = %d, "
+	       "sndbuf = %d, defer-accept = %d, stats = %s", ctx->backlog,
+	       ctx->tcp_nodelay ? "on" : "off", ctx->rcvbuf, ctx->sndbuf,
+	       ctx->defer_accept, ctx->stats_addr ? ctx->stats_addr : "none");
+}
+
 static int setup_daemon(int fd) {
 	pid_t pid = fork();
 	if (pid < 0) { /* error */ return EXIT_ERROR; }
@@ -112,7 +456,79 @@ void *get_in_addr(struct sockaddr *sa) {
 	return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
-static int create_listen_socket(ServerContext *ctx) {
+/*
+ * Stats listener: a Unix socket if addr is a path (anything with a '/'),
+ * otherwise a TCP port on the loopback address only.
+ */
+static int create_stats_socket(const char *addr, int *fd) {
+	int yes = 1;
+
+	if (strchr(addr, '/')) {
+		struct sockaddr_un sun = { .sun_family = AF_UNIX };
+		if (strlen(addr) >= sizeof sun.sun_path) {
+			errno = ENAMETOOLONG;
+			return EXIT_ERROR;
+		}
+		strcpy(sun.sun_path, addr);
+
+		if ((*fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+			return EXIT_ERROR;
+		unlink(addr); /* stale socket from an earlier run */
+		if (bind(*fd, (struct sockaddr *)&sun, sizeof sun) == -1)
+			return EXIT_ERROR;
+	} else {
+		char *endp;
+		errno = 0;
+		unsigned long port = strtoul(addr, &endp, 10);
+		if (errno || endp == addr || *endp || !port || port > 65535) {
+			errno = EINVAL;
+			return EXIT_ERROR;
+		}
+
+		struct sockaddr_in sin = {
+			.sin_family = AF_INET,
+			.sin_port = htons((uint16_t)port),
+			.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+		};
+		if ((*fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+			return EXIT_ERROR;
+		if (setsockopt(*fd, SOL_SOCKET, SO_REUSEADDR, &yes,
+				sizeof(int)) == -1)
+			return EXIT_ERROR;
+		if (bind(*fd, (struct sockaddr *)&sin, sizeof sin) == -1)
+			return EXIT_ERROR;
+	}
+
+	if (listen(*fd, BACKLOG) == -1)
+		return EXIT_ERROR;
+	return 0;
+}
+
+/*
+ * Options set on a listener are inherited by the sockets it accepts, so
+ * the client socket options are applied here once.
+ */
+static int set_listen_opts(const ServerContext *ctx, int fd) {
+	int on = ctx->tcp_nodelay;
+
+	/* Before listen(), so the window scale is negotiated to match */
+	if (ctx->rcvbuf && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &ctx->rcvbuf,
+			sizeof(int)) == -1)
+		return EXIT_ERROR;
+	if (ctx->sndbuf && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &ctx->sndbuf,
+			sizeof(int)) == -1)
+		return EXIT_ERROR;
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(int)) == -1)
+		return EXIT_ERROR;
+	if (ctx->defer_accept && setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+			&ctx->defer_accept, sizeof(int)) == -1)
+		return EXIT_ERROR;
+	return 0;
+}
+
+/* reuseport: one of several listeners sharing the port (-P) */
+static int create_listen_socket(const ServerContext *ctx, const char *port,
+		bool reuseport, int *fd) {
 	int rc;
 
 	/* 
@@ -128,7 +544,7 @@ static int create_listen_socket(ServerContext *ctx) {
 	hints.ai_socktype = SOCK_STREAM; /* TCP */
 	hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV; 
 
-	if ((rc = getaddrinfo(NULL, ctx->port, &hints, &servinfo)) != 0) {
+	if ((rc = getaddrinfo(NULL, port, &hints, &servinfo)) != 0) {
 		return EXIT_ERROR;
 	}
 
@@ -137,19 +553,32 @@ static int create_listen_socket(ServerContext *ctx) {
 	 * Loop and bind to the first available.
 	 */
 	for (p = servinfo; p!= NULL; p = p->ai_next) {
-		if ((ctx->listen_fd = socket(p->ai_family, 
+		if ((*fd = socket(p->ai_family, 
 					p->ai_socktype | SOCK_CLOEXEC,
 						p->ai_protocol)) == -1) {
 			continue;
 		}
 		
-		if (setsockopt(ctx->listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes,
+		if (setsockopt(*fd, SOL_SOCKET, SO_REUSEADDR, &yes,
 				sizeof(int)) == -1) {
 			freeaddrinfo(servinfo); 
 			return EXIT_ERROR;
 		}
 
-		if (bind(ctx->listen_fd, p->ai_addr, p->ai_addrlen) == -1) {
+		if (reuseport && setsockopt(*fd, SOL_SOCKET, SO_REUSEPORT,
+				&yes, sizeof(int)) == -1) {
+			freeaddrinfo(servinfo);
+			return EXIT_ERROR;
+		}
+
+		if (set_listen_opts(ctx, *fd) == -1) {
+			freeaddrinfo(servinfo);
+			return EXIT_ERROR;
+		}
+
+		if (bind(*fd, p->ai_addr, p->ai_addrlen) == -1) {
+			close(*fd);
+			*fd = -1;
 			continue;
 		}
 
@@ -163,7 +592,7 @@ static int create_listen_socket(ServerContext *ctx) {
 
 	freeaddrinfo(servinfo); 
 
-	if (listen(ctx->listen_fd, BACKLOG) == -1) {
+	if (listen(*fd, ctx->backlog) == -1) {
 		return EXIT_ERROR;
 	}
 
@@ -185,6 +614,9 @@ static void sigaction_handler(int signum, siginfo_t *info, void *context) {
 		case SIGTERM:
 			exit_requested = signum;
 			break;
+		case SIGUSR1:
+			metrics_request_dump();
+			break;
 		default:
 			break;
 	}
@@ -202,44 +634,124 @@ static int install_sigaction(void) {
 		return EXIT_ERROR;
 	}
 
+	/* Replies use sendfile/splice, which have no MSG_NOSIGNAL */
+	sa.sa_handler = SIG_IGN;
+	sa.sa_flags = 0;
+	if (sigaction(SIGPIPE, &sa, NULL) == -1) {
+		return EXIT_ERROR;
+	}
+
 	/* SIGCHLD with SA_RESTART in addition */
+	sa.sa_sigaction = sigaction_handler;
+	sa.sa_flags = SA_SIGINFO;
 	sa.sa_flags |= SA_RESTART;
 	if ((sigaction(SIGCHLD, &sa, NULL) == -1)) {
 		return EXIT_ERROR;
 	}
 
+	/* SIGUSR1: stats dump, interrupted calls just carry on */
+	if ((sigaction(SIGUSR1, &sa, NULL) == -1)) {
+		return EXIT_ERROR;
+	}
+
 	return 0;
 }
 
-static int open_append(ServerContext *ctx) {
-	if ((ctx->append_fd = open(AESD_DATA_PATH, 
-			O_WRONLY | O_APPEND | 
-			O_CREAT | O_CLOEXEC, 0644)) == -1) {
+static int open_store(ServerContext *ctx) {
+	/* Background durability also syncs each segment as it is sealed */
+	ctx->store_opts.sync_roll = ctx->durability.mode >= FL_INTERVAL;
+	if (store_open(&ctx->store, ctx->data_path, &ctx->store_opts) == -1)
 		return EXIT_ERROR;
-	}
+	ctx->store_ready = true;
 
+	if (ctx->store.opts.ring_packets)
+		syslog(LOG_INFO, "in-memory data store: last %zu packets",
+		       ctx->store.opts.ring_packets);
+	else if (ctx->store.segmented)
+		syslog(LOG_INFO, "segmented data store: %lld byte segments, "
+		       "keeping %lld bytes / %llu packets (0: all)",
+		       (long long)ctx->store.opts.seg_bytes,
+		       (long long)ctx->store.opts.keep_bytes,
+		       (unsigned long long)ctx->store.opts.keep_packets);
 	return 0;
 }
 
-static int alloc_runtime_buffers(ServerContext *ctx) {
-
-	/* scratch buffer for recv loop */
-	ctx->scratch = malloc(MAX_PACKET);
-	if (!ctx->scratch) {
+static int init_shared(ServerContext *ctx) {
+	if (hc_shared_init(&ctx->shared, &ctx->store, ctx->mirror_max) == -1)
 		return EXIT_ERROR;
+	ctx->shared_ready = true;
+	ctx->shared.use_uring = ctx->use_uring;
+	ctx->shared.gc.sync = ctx->durability.mode == FL_STRICT;
+	if (ctx->use_uring && ctx->durability.mode != FL_NONE) {
+		/*
+		 * The io_uring append links its reply and bypasses the group
+		 * committer, leaving no room to sync before replying
+		 */
+		char mode[32];
+		syslog(LOG_WARNING, "--durability=%s: not using io_uring, its "
+		       "appends bypass the group committer",
+		       fl_format(&ctx->durability, mode, sizeof mode));
+		ctx->shared.use_uring = false;
 	}
+	ctx->shared.max_packet = ctx->max_packet;
+	ctx->shared.recv_buf_sz = ctx->recv_buf_sz;
+	ctx->shared.write_chunk = ctx->write_chunk;
+	ctx->shared.mem_budget = ctx->mem_budget;
+	atomic_store(&metrics.mem_budget, ctx->mem_budget);
 
-	if (sb_init(&ctx->sb, 4096, MAX_PACKET) == -1) {
-		free(ctx->scratch);
+	if (fl_start(&ctx->shared.fl, &ctx->store, &ctx->durability) == -1)
+		return EXIT_ERROR;
+	return 0;
+}
+
+static int start_workers(ServerContext *ctx) {
+	/* Each worker allocates its own StringBuilder and recv buffer */
+	if (wp_init(&ctx->pool, WORKER_THREADS, WORK_QUEUE_DEPTH,
+			&ctx->shared) == -1) {
 		return EXIT_ERROR;
 	}
 
 	return 0;
 }
 
-static int run_accept_loop(ServerContext *ctx) {
+/*
+ * Wait until one of the listeners has a pending client. Returns the
+ * ready listener, or -1 (errno EINTR when interrupted by a signal,
+ * ECANCELED once stop_fd is readable).
+ */
+static int wait_listener(int listen_fd, int coalesce_fd, int stop_fd,
+		bool *coalesce) {
+	*coalesce = false;
+	if (coalesce_fd == -1 && stop_fd == -1)
+		return listen_fd;
+
+	/* An fd of -1 is skipped by poll() */
+	struct pollfd pfd[3] = {
+		{ .fd = listen_fd, .events = POLLIN },
+		{ .fd = coalesce_fd, .events = POLLIN },
+		{ .fd = stop_fd, .events = POLLIN },
+	};
+	if (poll(pfd, 3, -1) == -1)
+		return -1;
+
+	if (pfd[2].revents) {
+		errno = ECANCELED;
+		return -1;
+	}
+
+	/* Plain clients first, then the coalescing ones */
+	if (pfd[0].revents)
+		return listen_fd;
+	*coalesce = true;
+	return coalesce_fd;
+}
+
+/* Accept clients of listen_fd and coalesce_fd and hand them to pool */
+static int run_accept_loop(int listen_fd, int coalesce_fd, int stop_fd,
+		workpool_t *pool) {
 	for(;;) {
-		int new_fd;
+		int new_fd, ready_fd;
+		bool coalesce;
 		char peer_ip[INET6_ADDRSTRLEN];
 		/* Address of the connector */
 		struct sockaddr_storage their_addr; 
@@ -250,8 +762,17 @@ static int run_accept_loop(ServerContext *ctx) {
 			break;
 		}
 
+		ready_fd = wait_listener(listen_fd, coalesce_fd, stop_fd,
+				&coalesce);
+		if (ready_fd == -1) {
+			if (errno == EINTR) continue;
+			if (errno == ECANCELED) break;
+			syslog(LOG_ERR, "poll failed\n");
+			return EXIT_ERROR;
+		}
+
 		sin_size = sizeof their_addr;
-		new_fd = accept(ctx->listen_fd, 
+		new_fd = accept(ready_fd, 
 				(struct sockaddr *)&their_addr, &sin_size);
 		if (new_fd == -1) {
 			if (errno == EINTR) continue;
@@ -261,47 +782,209 @@ static int run_accept_loop(ServerContext *ctx) {
 				return EXIT_ERROR;
 			}
 		}
+		lat_ts_t accepted = lat_now();
 
 		inet_ntop(their_addr.ss_family,
 				get_in_addr((struct sockaddr *)&their_addr),
 				peer_ip, sizeof peer_ip);
-		syslog(LOG_INFO, "Accepted conection from %s\n", peer_ip);
-
-		hc_result_t res;
-		handle_connection(new_fd, ctx->append_fd, &ctx->sb, ctx->scratch, 
-				&res);
-		if (res.outcome == HC_OUTCOME_ERROR) {
-			switch (res.op) {
-			case HC_OP_RECV:
-				syslog(LOG_ERR, "recv failed from %s: %s", peer_ip, strerror(res.sys_errno));
-				break;
-			case HC_OP_APPEND:
-				if (res.err == HC_ERR_SHORT_WRITE)
-					syslog(LOG_ERR, "short write appending %zu bytes for %s", res.intended, peer_ip);
-				else
-					syslog(LOG_ERR, "append failed for %s: %s (intended %zu)", peer_ip, strerror(res.sys_errno), res.intended);
-				break;
-			case HC_OP_SEND:
-				syslog(LOG_ERR, "send failed to %s: %s",
-					peer_ip, strerror(res.sys_errno));
-				break;
-			default:
-				syslog(LOG_ERR, "connection error with %s: %s", peer_ip, strerror(res.sys_errno));
-			}
+		alog(ALOG_ACCEPTED, peer_ip, 0, 0);
+		metrics_inc(&metrics.conns_accepted, 1);
+
+		/* Blocks while every worker is busy and the queue is full */
+		if (wp_submit(pool, new_fd, peer_ip, coalesce,
+				accepted) == -1) {
+			close(new_fd);
+			alog(ALOG_CLOSED, peer_ip, 0, 0);
 		}
-		
-		syslog(LOG_INFO, "Closed connection from %s", peer_ip);
 	}
 	return 0;
 }
 
+/* The i-th CPU this process may run on, round robin; -1 if unknown */
+static int shard_cpu(size_t i) {
+	cpu_set_t set;
+	if (sched_getaffinity(0, sizeof set, &set) == -1)
+		return -1;
+
+	int n = CPU_COUNT(&set);
+	if (n <= 0)
+		return -1;
+
+	size_t k = i % (size_t)n;
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &set) && k-- == 0)
+			return cpu;
+	}
+	return -1;
+}
+
+/* Listeners and the stop pipe; threads only start after daemonizing */
+static int open_shards(ServerContext *ctx) {
+	if (!ctx->nshards) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		ctx->nshards = n > 0 ? (size_t)n : 1;
+		if (ctx->nshards > SHARDS_MAX) ctx->nshards = SHARDS_MAX;
+	}
+
+	if (pipe2(ctx->stop_pipe, O_CLOEXEC) == -1)
+		return EXIT_ERROR;
+
+	ctx->shards = calloc(ctx->nshards, sizeof *ctx->shards);
+	if (!ctx->shards)
+		return EXIT_ERROR;
+
+	for (size_t i = 0; i < ctx->nshards; i++) {
+		shard_t *sh = &ctx->shards[i];
+		sh->ctx = ctx;
+		sh->id = i;
+		sh->cpu = shard_cpu(i);
+		sh->listen_fd = -1;
+		sh->coalesce_fd = -1;
+	}
+
+	for (size_t i = 0; i < ctx->nshards; i++) {
+		shard_t *sh = &ctx->shards[i];
+		if (create_listen_socket(ctx, ctx->port, true,
+				&sh->listen_fd) == -1)
+			return EXIT_ERROR;
+		if (ctx->coalesce_port && create_listen_socket(ctx,
+				ctx->coalesce_port, true, &sh->coalesce_fd) == -1)
+			return EXIT_ERROR;
+	}
+	return 0;
+}
+
+static void *shard_main(void *arg) {
+	shard_t *sh = arg;
+	ServerContext *ctx = sh->ctx;
+
+	/* Pin first: the workers inherit the affinity */
+	if (sh->cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(sh->cpu, &set);
+		int err = pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+		if (err)
+			syslog(LOG_WARNING, "shard %zu: cannot pin to cpu %d: %s",
+			       sh->id, sh->cpu, strerror(err));
+	}
+
+	if (ctx->event_loop) {
+		sh->rc = ev_run(sh->listen_fd, sh->coalesce_fd,
+				ctx->stop_pipe[0], &ctx->shared);
+	} else if (wp_init(&sh->pool, WORKER_THREADS, WORK_QUEUE_DEPTH,
+			&ctx->shared) == -1) {
+		syslog(LOG_ERR, "shard %zu: no workers: %s", sh->id,
+		       strerror(errno));
+		sh->rc = EXIT_ERROR;
+	} else {
+		sh->rc = run_accept_loop(sh->listen_fd, sh->coalesce_fd,
+					 ctx->stop_pipe[0], &sh->pool);
+	}
+
+	/* A failed shard takes the server down, like the single loop does */
+	if (sh->rc == EXIT_ERROR)
+		kill(getpid(), SIGTERM);
+	return NULL;
+}
+
+/*
+ * Start every shard and sleep until SIGINT/SIGTERM, then stop and join
+ * them. The shards block all signals, so they land on this thread.
+ * Returns EXIT_ERROR if a shard failed to start or run.
+ */
+static int run_shards(ServerContext *ctx) {
+	int rc = 0;
+	sigset_t all, old, stop;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for (size_t i = 0; i < ctx->nshards; i++) {
+		shard_t *sh = &ctx->shards[i];
+		if ((errno = pthread_create(&sh->tid, NULL, shard_main, sh))) {
+			syslog(LOG_ERR, "shard %zu: %s", i, strerror(errno));
+			rc = EXIT_ERROR;
+			break;
+		}
+		sh->started = true;
+	}
+
+	/* Keep SIGINT/SIGTERM blocked between checks, so none is missed */
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	sigemptyset(&stop);
+	sigaddset(&stop, SIGINT);
+	sigaddset(&stop, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &stop, NULL);
+
+	if (rc == 0)
+		syslog(LOG_INFO, "sharded: %zu listeners on port %s",
+		       ctx->nshards, ctx->port);
+	while (rc == 0 && !exit_requested)
+		sigsuspend(&old);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	/* Never read, so it stays readable for every shard */
+	while (write(ctx->stop_pipe[1], "q", 1) == -1 && errno == EINTR) {}
+
+	for (size_t i = 0; i < ctx->nshards; i++) {
+		shard_t *sh = &ctx->shards[i];
+		if (!sh->started) continue;
+		pthread_join(sh->tid, NULL);
+		if (sh->rc == EXIT_ERROR) rc = EXIT_ERROR;
+	}
+	return rc;
+}
+
+/* After run_shards(): drain each shard's workers, close its listeners */
+static void close_shards(ServerContext *ctx) {
+	if (!ctx->shards) return;
+
+	for (size_t i = 0; i < ctx->nshards; i++) {
+		shard_t *sh = &ctx->shards[i];
+		wp_shutdown(&sh->pool);
+		if (sh->listen_fd != -1) close(sh->listen_fd);
+		if (sh->coalesce_fd != -1) close(sh->coalesce_fd);
+	}
+	free(ctx->shards);
+	ctx->shards = NULL;
+}
+
 void ctx_init(ServerContext *ctx) {
 	ctx->port = "9000";
+	ctx->coalesce_port = NULL;
 	ctx->data_path = AESD_DATA_PATH;
 	ctx->daemonize = false;
+	ctx->event_loop = false;
+	ctx->use_uring = false;
+	ctx->mirror_max = MIRROR_MAX_BYTES;
+	ctx->durability = (fl_opts_t){ .mode = FL_NONE };
+	ctx->store_opts = (store_opts_t){0};
 	ctx->listen_fd = -1;
-	ctx->append_fd = -1;
-	ctx->scratch = NULL;
+	ctx->coalesce_fd = -1;
+	ctx->store_ready = false;
+	ctx->shared_ready = false;
+	ctx->pool = (workpool_t){0};
+	ctx->stats_addr = NULL;
+	ctx->stats_fd = -1;
+	ctx->stats = (metrics_srv_t){0};
+	ctx->sharded = false;
+	ctx->nshards = 0;
+	ctx->shards = NULL;
+	ctx->stop_pipe[0] = ctx->stop_pipe[1] = -1;
+	ctx->recv_buf_sz = RECV_BUF_SZ;
+	ctx->max_packet = MAX_PACKET;
+	ctx->write_chunk = WRITE_CHUNK_SZ;
+	ctx->backlog = BACKLOG;
+	ctx->tcp_nodelay = true;
+	ctx->rcvbuf = 0;
+	ctx->sndbuf = 0;
+	ctx->defer_accept = 0;
+	ctx->mem_budget = MEM_BUDGET;
+	ctx->mem_budget_set = false;
+	ctx->timestamp_interval = TIMESTAMP_INTERVAL_S;
+	ctx->stamp = (tstamp_t){0};
+	ctx->config_path = NULL;
+	ctx->conf_buf = NULL;
 	ctx->exit_flag = &exit_requested;
 }
 
@@ -315,7 +998,21 @@ int main(int argc, char** argv) {
 	if ((parse_args(&ctx, argc, argv)) == -1)
 		goto cleanup;
 
-	if (create_listen_socket(&ctx) == -1)
+	if (ctx.sharded) {
+		if (open_shards(&ctx) == -1)
+			goto cleanup;
+	} else {
+		if (create_listen_socket(&ctx, ctx.port, false,
+				&ctx.listen_fd) == -1)
+			goto cleanup;
+
+		if (ctx.coalesce_port && create_listen_socket(&ctx,
+				ctx.coalesce_port, false, &ctx.coalesce_fd) == -1)
+			goto cleanup;
+	}
+
+	if (ctx.stats_addr && create_stats_socket(ctx.stats_addr,
+			&ctx.stats_fd) == -1)
 		goto cleanup;
 
 	if (daemonize_after_listen(ctx.listen_fd, ctx.daemonize) == -1)
@@ -325,17 +1022,39 @@ int main(int argc, char** argv) {
 		goto cleanup;
 
 	openlog("aesdsocket", LOG_PID, LOG_USER);
+	log_config(&ctx);
 	syslog(LOG_INFO, "server: waiting for connections...\n");
 
-	if (open_append(&ctx) == -1) 
+	if (alog_start() == -1)
 		goto cleanup;
 
-	if (alloc_runtime_buffers(&ctx) == -1)
+	if (open_store(&ctx) == -1) 
 		goto cleanup;
 
-	if (run_accept_loop(&ctx) == -1) {
-		unlink_on_exit = false;
+	if (init_shared(&ctx) == -1)
 		goto cleanup;
+
+	if (metrics_srv_start(&ctx.stats, ctx.stats_fd) == -1)
+		goto cleanup;
+
+	if (ts_start(&ctx.stamp, &ctx.shared.gc, ctx.timestamp_interval) == -1)
+		goto cleanup;
+
+	if (ctx.sharded) {
+		if (run_shards(&ctx) == -1)
+			goto cleanup;
+	} else if (ctx.event_loop) {
+		if (ev_run(ctx.listen_fd, ctx.coalesce_fd, -1, &ctx.shared) == -1)
+			goto cleanup;
+	} else {
+		if (start_workers(&ctx) == -1)
+			goto cleanup;
+
+		if (run_accept_loop(ctx.listen_fd, ctx.coalesce_fd, -1,
+				&ctx.pool) == -1) {
+			unlink_on_exit = false;
+			goto cleanup;
+		}
 	}
 
 	/* Graceful shutdown via signal */
@@ -344,23 +1063,52 @@ int main(int argc, char** argv) {
 	rc = EXIT_SUCCESS;
 
 cleanup:
+	/* Drain in-flight connections before their fds go away */
+	wp_shutdown(&ctx.pool);
+	close_shards(&ctx);
+
+	/* Every connection is gone: log what they queued */
+	alog_stop();
+
+	/* No more dumps once the stats thread is gone */
+	signal(SIGUSR1, SIG_IGN);
+	metrics_srv_stop(&ctx.stats);
+	lat_free_all();
+	if (ctx.stats_fd != -1) {
+		close(ctx.stats_fd);
+		ctx.stats_fd = -1;
+		if (strchr(ctx.stats_addr, '/'))
+			unlink(ctx.stats_addr);
+	}
+	/* Appends through the committer, so it goes before shared state */
+	ts_stop(&ctx.stamp);
+	if (ctx.shared_ready) {
+		hc_shared_destroy(&ctx.shared);
+		ctx.shared_ready = false;
+	}
+
 	if (ctx.listen_fd != -1) {
 		close(ctx.listen_fd);
 		ctx.listen_fd = -1;
 	}
 
-	if (ctx.append_fd != -1) {
-		close(ctx.append_fd);
-		ctx.append_fd = -1;
+	if (ctx.coalesce_fd != -1) {
+		close(ctx.coalesce_fd);
+		ctx.coalesce_fd = -1;
 	}
 
-	if (ctx.scratch) { free(ctx.scratch); ctx.scratch = NULL; }
-	sb_free(&ctx.sb);
+	if (ctx.stop_pipe[0] != -1) {
+		close(ctx.stop_pipe[0]);
+		close(ctx.stop_pipe[1]);
+	}
 
-	if (unlink_on_exit && ctx.data_path) {
-		unlink(ctx.data_path);
+	/* The data goes away with a graceful exit */
+	if (ctx.store_ready) {
+		store_close(&ctx.store, unlink_on_exit);
+		ctx.store_ready = false;
 	}
 
 	closelog();
+	free(ctx.conf_buf); /* config strings point into it */
 	return rc;
 }
@@ -18,22 +18,87 @@
 #include <syslog.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <sched.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <limits.h>
+#include <strings.h>
+#include <netinet/tcp.h>
 
 #include "aesd_config.h"
 #include "sb.h"
 #include "handleconn.h"
+#include "store.h"
+#include "workpool.h"
+#include "evloop.h"
+#include "metrics.h"
+#include "alog.h"
+#include "conffile.h"
+#include "flusher.h"
+#include "tstamp.h"
 
+struct server_ctx;
+
+/*
+ * One SO_REUSEPORT shard: its own listeners, accept loop (or event loop)
+ * and worker pool, all on one CPU. The kernel spreads new connections
+ * over the shards; appends still meet in the shared group committer.
+ */
 typedef struct {
+	struct server_ctx *ctx;
+	size_t id;
+	int cpu;		/* pinned to, -1: not pinned */
+	int listen_fd;
+	int coalesce_fd;	/* -1 without -c */
+	workpool_t pool;	/* worker pool mode only */
+	pthread_t tid;
+	bool started;
+	int rc;			/* loop result, EXIT_ERROR on failure */
+} shard_t;
+
+typedef struct server_ctx {
 	/* config */
+	char *config_path;	/* -f: config file, read before the options */
+	char *conf_buf;		/* its contents; config strings point here */
 	char *port;
+	char *coalesce_port;	/* -c: listener with coalesced replies */
 	const char *data_path;
 	bool daemonize;
+	bool event_loop;	/* -e: epoll loop instead of worker pool */
+	bool use_uring;		/* -u: io_uring in the workers if supported */
+	size_t mirror_max;	/* -m: memory mirror ceiling, 0 disables */
+	fl_opts_t durability;	/* --durability, -S: when data is synced */
+	store_opts_t store_opts; /* -s, -R, -N, -r: layout and retention */
+	char *stats_addr;	/* -M: stats port or Unix socket path */
+	bool sharded;		/* -P: one listener per shard */
+	size_t nshards;		/* -P: shard count, 0: online CPUs */
+	size_t recv_buf_sz;	/* --recv-buf */
+	size_t max_packet;	/* --max-packet */
+	size_t write_chunk;	/* --write-chunk */
+	int backlog;		/* --backlog */
+	bool tcp_nodelay;	/* --tcp-nodelay */
+	int rcvbuf;		/* --rcvbuf, 0: kernel default */
+	int sndbuf;		/* --sndbuf, 0: kernel default */
+	int defer_accept;	/* --defer-accept, seconds, 0: off */
+	size_t mem_budget;	/* --mem-budget, 0: unlimited */
+	bool mem_budget_set;	/* given, not the default */
+	unsigned timestamp_interval; /* --timestamp-interval, 0: off */
 
 	/* long-lived resourced */
 	int listen_fd;
-	int append_fd;
-	char *scratch;
-	StringBuilder sb;
+	int coalesce_fd;	/* -1 without -c */
+	store_t store;
+	bool store_ready;
+	hc_shared_t shared;
+	bool shared_ready;
+	workpool_t pool;
+	int stats_fd;		/* -1 without -M */
+	metrics_srv_t stats;
+	tstamp_t stamp;		/* periodic timestamp lines */
+	shard_t *shards;	/* nshards entries with -P, else NULL */
+	int stop_pipe[2];	/* -P: readable once the shards should stop */
 
 	/* state */
 	volatile sig_atomic_t *exit_flag;
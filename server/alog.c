@@ -0,0 +1,249 @@
+#define _GNU_SOURCE /* pipe2 */
+#include <stdio.h>     /* snprintf */
+#include <string.h>    /* strerror */
+#include <errno.h>     /* errno */
+#include <fcntl.h>     /* O_NONBLOCK, O_CLOEXEC */
+#include <poll.h>      /* poll */
+#include <pthread.h>   /* pthread_join */
+#include <stdatomic.h> /* atomics */
+#include <stdbool.h>   /* bool */
+#include <stdint.h>    /* uint64_t */
+#include <syslog.h>    /* syslog */
+#include <time.h>      /* clock_gettime */
+#include <unistd.h>    /* pipe2, read, write, close */
+
+#include "aesd_config.h"
+#include "alog.h"
+#include "bgthread.h"
+#include "metrics.h"
+
+#if ALOG_RING_SLOTS & (ALOG_RING_SLOTS - 1)
+#error "ALOG_RING_SLOTS must be a power of two"
+#endif
+
+/* How often drops and suppressions are summarized, ms */
+#define ALOG_REPORT_MS 1000
+
+/*
+ * Bounded multi-producer ring (Vyukov): a slot is free for the producer
+ * at position pos when its seq equals pos, and holds a record for the
+ * consumer at pos when seq is pos + 1.
+ */
+typedef struct {
+	atomic_size_t seq;
+	alog_rec_t rec;
+} slot_t;
+
+static slot_t slots[ALOG_RING_SLOTS];
+static atomic_size_t tail;	/* next position to claim */
+static size_t head;		/* consumer only */
+
+static atomic_bool running;
+static atomic_bool sleeping;	/* consumer waits on the pipe */
+static int wake_fd[2] = { -1, -1 };
+static pthread_t tid;
+
+static void emit(const alog_rec_t *r) {
+	const char *peer = r->peer;
+
+	switch (r->kind) {
+	case ALOG_ACCEPTED:
+		syslog(LOG_INFO, "Accepted conection from %s\n", peer);
+		break;
+	case ALOG_CLOSED:
+		syslog(LOG_INFO, "Closed connection from %s", peer);
+		break;
+	case ALOG_NO_RESOURCES:
+		syslog(LOG_ERR, "no resources for %s: %s", peer,
+		       strerror(r->err));
+		break;
+	case ALOG_EPOLL_CTL:
+		syslog(LOG_ERR, "epoll_ctl failed for %s: %s", peer,
+		       strerror(r->err));
+		break;
+	case ALOG_RECV_FAILED:
+		syslog(LOG_ERR, "recv failed from %s: %s", peer, strerror(r->err));
+		break;
+	case ALOG_SHORT_WRITE:
+		syslog(LOG_ERR, "short write appending %zu bytes for %s", r->n,
+		       peer);
+		break;
+	case ALOG_APPEND_FAILED:
+		syslog(LOG_ERR, "append failed for %s: %s (intended %zu)", peer,
+		       strerror(r->err), r->n);
+		break;
+	case ALOG_SEND_FAILED:
+		syslog(LOG_ERR, "send failed to %s: %s", peer, strerror(r->err));
+		break;
+	default:
+		syslog(LOG_ERR, "connection error with %s: %s", peer,
+		       strerror(r->err));
+	}
+}
+
+void alog(alog_kind_t kind, const char *peer, int err, size_t n) {
+	alog_rec_t rec = { .kind = kind, .err = err, .n = n };
+	snprintf(rec.peer, sizeof rec.peer, "%s", peer);
+
+	if (!atomic_load_explicit(&running, memory_order_acquire)) {
+		emit(&rec);
+		return;
+	}
+
+	size_t pos = atomic_load_explicit(&tail, memory_order_relaxed);
+	slot_t *s;
+	for (;;) {
+		s = &slots[pos & (ALOG_RING_SLOTS - 1)];
+		size_t seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+		intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+		if (dif == 0) {
+			if (atomic_compare_exchange_weak_explicit(&tail, &pos,
+					pos + 1, memory_order_relaxed,
+					memory_order_relaxed))
+				break;
+		} else if (dif < 0) {
+			metrics_inc(&metrics.log_dropped, 1); /* full */
+			return;
+		} else {
+			pos = atomic_load_explicit(&tail, memory_order_relaxed);
+		}
+	}
+
+	s->rec = rec;
+
+	/*
+	 * Publish, then check for a sleeping consumer; wait_records() does
+	 * the mirror image, and seq_cst keeps one of us from missing the
+	 * other.
+	 */
+	atomic_store(&s->seq, pos + 1);
+	if (atomic_load(&sleeping) && atomic_exchange(&sleeping, false)) {
+		int saved_errno = errno;
+		(void)!write(wake_fd[1], "w", 1);
+		errno = saved_errno;
+	}
+}
+
+static bool pop(alog_rec_t *rec) {
+	slot_t *s = &slots[head & (ALOG_RING_SLOTS - 1)];
+	if (atomic_load_explicit(&s->seq, memory_order_acquire) != head + 1)
+		return false;
+
+	*rec = s->rec;
+	atomic_store_explicit(&s->seq, head + ALOG_RING_SLOTS,
+			      memory_order_release);
+	head++;
+	return true;
+}
+
+static bool ring_empty(void) {
+	slot_t *s = &slots[head & (ALOG_RING_SLOTS - 1)];
+	return atomic_load(&s->seq) != head + 1;
+}
+
+static uint64_t now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/* Sleep until a producer wakes us or timeout_ms; true on a stop request */
+static bool wait_records(int timeout_ms) {
+	atomic_store(&sleeping, true);
+	if (!ring_empty()) {
+		atomic_store(&sleeping, false);
+		return false;
+	}
+
+	struct pollfd pfd = { .fd = wake_fd[0], .events = POLLIN };
+	poll(&pfd, 1, timeout_ms);
+	atomic_store(&sleeping, false);
+
+	bool stop = false;
+	char buf[64];
+	ssize_t n;
+	while ((n = read(wake_fd[0], buf, sizeof buf)) > 0)
+		stop = stop || memchr(buf, 'q', (size_t)n);
+	return stop;
+}
+
+static void *alog_main(void *arg) {
+	(void)arg;
+	/* Token bucket: ALOG_RATE per second, bursts up to ALOG_RATE */
+	uint64_t tokens = ALOG_RATE, last_fill = now_ms();
+	uint64_t last_report = last_fill;
+	uint64_t dropped = 0, suppressed = 0;
+	bool stop = false;
+	alog_rec_t rec;
+
+	for (;;) {
+		while (pop(&rec)) {
+			uint64_t now = now_ms();
+			if (now > last_fill) {
+				tokens += (now - last_fill) * ALOG_RATE / 1000;
+				if (tokens > ALOG_RATE) tokens = ALOG_RATE;
+				last_fill = now;
+			}
+			if (!tokens) {
+				metrics_inc(&metrics.log_suppressed, 1);
+				continue;
+			}
+			tokens--;
+			emit(&rec);
+		}
+
+		uint64_t now = now_ms();
+		if (stop || now - last_report >= ALOG_REPORT_MS) {
+			uint64_t d = atomic_load_explicit(&metrics.log_dropped,
+							  memory_order_relaxed);
+			uint64_t s = atomic_load_explicit(&metrics.log_suppressed,
+							  memory_order_relaxed);
+			if (d != dropped || s != suppressed)
+				syslog(LOG_WARNING, "log: %llu records dropped "
+				       "(ring full), %llu suppressed (rate limit)",
+				       (unsigned long long)(d - dropped),
+				       (unsigned long long)(s - suppressed));
+			dropped = d;
+			suppressed = s;
+			last_report = now;
+		}
+
+		if (stop)
+			return NULL;
+		stop = wait_records(ALOG_REPORT_MS);
+	}
+}
+
+int alog_start(void) {
+	for (size_t i = 0; i < ALOG_RING_SLOTS; i++)
+		atomic_store_explicit(&slots[i].seq, i, memory_order_relaxed);
+	atomic_store(&tail, 0);
+	head = 0;
+
+	if (pipe2(wake_fd, O_NONBLOCK | O_CLOEXEC) == -1)
+		return -1;
+
+	if (bg_spawn(&tid, alog_main, NULL) == -1) {
+		int err = errno;
+		close(wake_fd[0]);
+		close(wake_fd[1]);
+		wake_fd[0] = wake_fd[1] = -1;
+		errno = err;
+		return -1;
+	}
+	atomic_store_explicit(&running, true, memory_order_release);
+	return 0;
+}
+
+void alog_stop(void) {
+	if (!atomic_load(&running)) return;
+
+	/* Records still queued are logged before the thread returns */
+	while (write(wake_fd[1], "q", 1) == -1 && errno == EINTR) {}
+	pthread_join(tid, NULL);
+	atomic_store(&running, false);
+
+	close(wake_fd[0]);
+	close(wake_fd[1]);
+	wake_fd[0] = wake_fd[1] = -1;
+}
@@ -0,0 +1,47 @@
+#ifndef __ALOG_H__
+#define __ALOG_H__
+
+#include <stddef.h>     /* size_t */
+#include <netinet/in.h> /* INET6_ADDRSTRLEN */
+
+/*
+ * Asynchronous logging for the per-connection messages.
+ *
+ * alog() copies a fixed-size record (event kind plus its arguments) into
+ * a bounded lock-free ring and returns; a background thread formats the
+ * records and hands them to syslog(), at most ALOG_RATE per second. When
+ * the ring is full the record is dropped, and when the rate is exceeded
+ * it is suppressed; both are counted in the metrics and summarized to
+ * syslog once a second.
+ *
+ * Before alog_start() and after alog_stop(), alog() calls syslog()
+ * directly, so code using it works without the thread (benchmarks).
+ */
+typedef enum {
+	ALOG_ACCEPTED = 0,	/* peer */
+	ALOG_CLOSED,		/* peer */
+	ALOG_NO_RESOURCES,	/* peer, err */
+	ALOG_EPOLL_CTL,		/* peer, err */
+	ALOG_RECV_FAILED,	/* peer, err */
+	ALOG_SHORT_WRITE,	/* peer, n: bytes intended */
+	ALOG_APPEND_FAILED,	/* peer, err, n: bytes intended */
+	ALOG_SEND_FAILED,	/* peer, err */
+	ALOG_CONN_ERROR,	/* peer, err */
+	ALOG_KINDS,
+} alog_kind_t;
+
+typedef struct {
+	alog_kind_t kind;
+	int err;
+	size_t n;
+	char peer[INET6_ADDRSTRLEN];
+} alog_rec_t;
+
+/* Queue one record; never blocks and never fails (drops are counted) */
+void alog(alog_kind_t kind, const char *peer, int err, size_t n);
+
+int alog_start(void);
+/* Log what is queued and stop; call once no thread logs any more */
+void alog_stop(void);
+
+#endif
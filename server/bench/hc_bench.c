@@ -0,0 +1,335 @@
+/*
+ * Microbenchmarks of the framing and buffer code, without a network.
+ *
+ * Framing: a client thread feeds handle_connection() over a socketpair
+ * following a script of send sizes, and waits until each chunk has been
+ * read (SIOCOUTQ drops to 0) before sending the next, so every recv() in
+ * the handler sees exactly one scripted chunk. Replies are drained by the
+ * client as they come. The store is a one-packet memory ring, which keeps
+ * replies to the packet just sent and leaves the disk out.
+ *
+ * Time is the handler thread's CPU time (CLOCK_THREAD_CPUTIME_ID), so the
+ * lockstep waiting on the client does not count, but the syscalls made by
+ * the handler do. Allocations are counted on the handler thread only, by
+ * wrapping malloc and friends at link time (-Wl,--wrap, see the Makefile).
+ *
+ * sb_reserve: growth patterns driven directly, plain and pool backed.
+ *
+ * Usage: hc_bench [-n packets] [-f framing_case] [-g growth_case]
+ */
+#define _GNU_SOURCE	/* SIOCOUTQ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/sockios.h>
+
+#include "../handleconn.h"
+#include "../bufpool.h"
+#include "../sb.h"
+
+volatile sig_atomic_t exit_requested = 0;
+
+/* Only the measured thread is counted */
+static __thread int counting;
+static unsigned long n_alloc, n_free;
+
+void *__real_malloc(size_t size);
+void *__wrap_malloc(size_t size) {
+	if (counting) n_alloc++;
+	return __real_malloc(size);
+}
+
+void *__real_calloc(size_t n, size_t size);
+void *__wrap_calloc(size_t n, size_t size) {
+	if (counting) n_alloc++;
+	return __real_calloc(n, size);
+}
+
+void *__real_realloc(void *ptr, size_t size);
+void *__wrap_realloc(void *ptr, size_t size) {
+	if (counting) n_alloc++;
+	return __real_realloc(ptr, size);
+}
+
+void __real_free(void *ptr);
+void __wrap_free(void *ptr) {
+	if (counting && ptr) n_free++;
+	__real_free(ptr);
+}
+
+static uint64_t cpu_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t wall_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * A framing case: packets of line_len bytes (newline included), sent in
+ * chunks of chunk bytes that run across line boundaries.
+ */
+typedef struct {
+	const char *name;
+	size_t line_len;
+	size_t chunk;
+	size_t packets_div;	/* run packets / packets_div of these */
+	const char *what;
+} frame_case_t;
+
+static const frame_case_t frame_cases[] = {
+	{ "dribble",  64,             1,       16, "1-byte sends" },
+	{ "lines",    64,             64,      1,  "one line per send" },
+	{ "batch",    64,             4096,    1,  "64 lines per send" },
+	{ "straddle", 100,            4096,    1,  "lines across sends" },
+	{ "huge",     256 * 1024,     4096,    256, "256K lines" },
+	{ "oversize", MAX_PACKET + 4096, 65536, 512, "discarded lines" },
+};
+#define N_FRAME_CASES (sizeof frame_cases / sizeof frame_cases[0])
+
+typedef struct {
+	int fd;
+	const frame_case_t *fc;
+	size_t packets;
+	uint64_t reply_bytes;
+	int failed;
+} client_t;
+
+static char drain_buf[1 << 16];
+
+static void drain(client_t *cl, int flags) {
+	for (;;) {
+		ssize_t n = recv(cl->fd, drain_buf, sizeof drain_buf, flags);
+		if (n > 0) {
+			cl->reply_bytes += (uint64_t)n;
+			continue;
+		}
+		if (n == -1 && errno == EINTR) continue;
+		if (n == -1 && errno != EAGAIN) cl->failed = 1;
+		return;
+	}
+}
+
+/* Until the handler has read everything sent, draining replies */
+static void wait_consumed(client_t *cl) {
+	int queued;
+	for (;;) {
+		drain(cl, MSG_DONTWAIT);
+		if (ioctl(cl->fd, SIOCOUTQ, &queued) == -1 || queued <= 0)
+			return;
+		sched_yield();
+	}
+}
+
+static void *client_main(void *arg) {
+	client_t *cl = arg;
+	const frame_case_t *fc = cl->fc;
+	size_t total = cl->packets * fc->line_len;
+	char *chunk = malloc(fc->chunk);
+
+	if (!chunk) {
+		cl->failed = 1;
+		shutdown(cl->fd, SHUT_WR);
+		return NULL;
+	}
+
+	/* Stream offset pos is byte pos % line_len of a line */
+	for (size_t pos = 0; pos < total && !cl->failed; ) {
+		size_t len = total - pos < fc->chunk ? total - pos : fc->chunk;
+		for (size_t i = 0; i < len; i++)
+			chunk[i] = (pos + i) % fc->line_len == fc->line_len - 1
+				? '\n' : 'x';
+
+		for (size_t off = 0; off < len; ) {
+			ssize_t n = send(cl->fd, chunk + off, len - off,
+					 MSG_NOSIGNAL);
+			if (n == -1) {
+				if (errno == EINTR) continue;
+				cl->failed = 1;
+				break;
+			}
+			off += (size_t)n;
+		}
+		pos += len;
+		wait_consumed(cl);
+	}
+
+	shutdown(cl->fd, SHUT_WR);
+	drain(cl, 0);	/* to EOF */
+	free(chunk);
+	return NULL;
+}
+
+static int run_frame(const frame_case_t *fc, size_t packets) {
+	store_t store;
+	store_opts_t opts = { .ring_packets = 1 };
+	hc_shared_t shared;
+	hc_bufs_t bufs;
+
+	if (store_open(&store, "hc_bench", &opts) == -1
+			|| hc_shared_init(&shared, &store, 0) == -1
+			|| hc_bufs_init(&bufs, &shared) == -1) {
+		perror("setup");
+		return -1;
+	}
+
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+		perror("socketpair");
+		return -1;
+	}
+
+	client_t cl = { .fd = sv[1], .fc = fc, .packets = packets };
+	pthread_t tid;
+	if ((errno = pthread_create(&tid, NULL, client_main, &cl))) {
+		perror("pthread_create");
+		return -1;
+	}
+
+	hc_result_t res;
+	n_alloc = n_free = 0;
+	uint64_t w0 = wall_ns(), c0 = cpu_ns();
+	counting = 1;
+	handle_connection(sv[0], &shared, &bufs, false, &res);
+	counting = 0;
+	uint64_t cpu = cpu_ns() - c0, wall = wall_ns() - w0;
+
+	shutdown(sv[0], SHUT_WR);
+	pthread_join(tid, NULL);
+
+	uint64_t handled = res.packets_written + res.packets_dropped_oversize;
+	bool ok = !cl.failed && res.outcome != HC_OUTCOME_ERROR
+		&& handled == packets;
+
+	printf("frame %-9s %-18s %7zu pkts %10.0f ns/pkt %8.2f allocs/pkt "
+	       "%8.2f frees/pkt %7.1f ms wall%s\n", fc->name, fc->what,
+	       packets, (double)cpu / packets, (double)n_alloc / packets,
+	       (double)n_free / packets, wall / 1e6, ok ? "" : "  FAILED");
+
+	close(sv[0]);
+	close(sv[1]);
+	hc_bufs_free(&bufs);
+	hc_shared_destroy(&shared);
+	store_close(&store, true);
+	return ok ? 0 : -1;
+}
+
+/*
+ * A growth case: rounds of sb_reserve() calls, each round starting from
+ * an empty builder (sb_clear, then sb_trim back to SB_BASE_CAP the way a
+ * connection does after a large line).
+ */
+typedef struct {
+	const char *name;
+	size_t step;		/* need grows by this per call */
+	size_t top;		/* ... up to this, then the round ends */
+	bool trim;		/* trim between rounds */
+	const char *what;
+} grow_case_t;
+
+static const grow_case_t grow_cases[] = {
+	{ "small",   64,   4096,         false, "64B steps to 4K" },
+	{ "linear",  64,   256 * 1024,   false, "64B steps to 256K" },
+	{ "linear-t", 64,  256 * 1024,   true,  "same, trimmed" },
+	{ "jump",    MAX_PACKET, MAX_PACKET, false, "straight to 1M" },
+	{ "jump-t",  MAX_PACKET, MAX_PACKET, true, "same, trimmed" },
+};
+#define N_GROW_CASES (sizeof grow_cases / sizeof grow_cases[0])
+
+static int run_grow(const grow_case_t *gc, bufpool_t *pool, size_t rounds) {
+	StringBuilder sb;
+	if (sb_init_pool(&sb, pool, SB_BASE_CAP, MAX_PACKET) == -1) {
+		perror("sb_init");
+		return -1;
+	}
+
+	size_t calls = 0;
+	n_alloc = n_free = 0;
+	uint64_t t0 = cpu_ns();
+	counting = 1;
+	for (size_t r = 0; r < rounds; r++) {
+		for (size_t need = gc->step; need <= gc->top; need += gc->step) {
+			if (sb_reserve(&sb, need, MAX_PACKET) == -1) {
+				counting = 0;
+				perror("sb_reserve");
+				sb_free(&sb);
+				return -1;
+			}
+			sb.len = need;
+			calls++;
+		}
+		sb_clear(&sb);
+		if (gc->trim && sb_cap(&sb) > SB_TRIM_ABOVE)
+			sb_trim(&sb, SB_BASE_CAP);
+	}
+	counting = 0;
+	uint64_t ns = cpu_ns() - t0;
+
+	printf("grow  %-9s %-18s %-5s %7zu calls %8.1f ns/call %8.4f allocs/call "
+	       "%8zu cap\n", gc->name, gc->what, pool ? "pool" : "plain", calls,
+	       (double)ns / calls, (double)n_alloc / calls, sb_cap(&sb));
+	sb_free(&sb);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	size_t packets = 20000;
+	const char *only_frame = NULL, *only_grow = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:f:g:")) != -1) {
+		switch (opt) {
+		case 'n': packets = strtoul(optarg, NULL, 0); break;
+		case 'f': only_frame = optarg; break;
+		case 'g': only_grow = optarg; break;
+		default:
+			fprintf(stderr, "Usage: %s [-n packets] [-f framing_case] "
+				"[-g growth_case]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (!packets) {
+		fprintf(stderr, "need packets > 0\n");
+		return 1;
+	}
+
+	int failed = 0;
+	for (size_t i = 0; i < N_FRAME_CASES; i++) {
+		const frame_case_t *fc = &frame_cases[i];
+		if (only_grow || (only_frame && strcmp(only_frame, fc->name)))
+			continue;
+		size_t n = packets / fc->packets_div;
+		if (run_frame(fc, n ? n : 1) == -1)
+			failed = 1;
+	}
+
+	bufpool_t pool;
+	if (bp_init(&pool, BUFPOOL_MAX_CACHED) == -1) {
+		perror("bp_init");
+		return 1;
+	}
+	for (size_t i = 0; i < N_GROW_CASES; i++) {
+		const grow_case_t *gc = &grow_cases[i];
+		if (only_frame || (only_grow && strcmp(only_grow, gc->name)))
+			continue;
+		size_t rounds = gc->step == gc->top ? packets : packets / 100;
+		if (!rounds) rounds = 1;
+		if (run_grow(gc, NULL, rounds) == -1
+				|| run_grow(gc, &pool, rounds) == -1)
+			failed = 1;
+	}
+	bp_destroy(&pool);
+
+	return failed;
+}
@@ -0,0 +1,433 @@
+/*
+ * Load generator for a running aesdsocket: N concurrent clients, each on
+ * its own connection and thread, sending newline-terminated packets.
+ *
+ * Reply modes:
+ *   full   every reply is read and matched to its packet: a reply ends
+ *          with the packet that caused it, and each packet is unique, so
+ *          the first occurrence of packet i in the stream ends reply i.
+ *          Latency is send of packet i to the end of reply i.
+ *   drain  replies are read and discarded as they come, no latency; the
+ *          client half-closes after its last packet and reads to EOF.
+ *
+ * Up to -P packets per client are in flight (sent, reply not yet
+ * complete) in full mode; drain mode just keeps the socket busy.
+ *
+ * The clock starts once every client has connected, so neither the
+ * duration nor the rates include connection setup. Size the server's
+ * listen backlog for all of them: a client left in the accept queue
+ * overflow sees its first reply only after a SYN-ACK retransmit.
+ *
+ * Every reply carries the whole retained window, so run the server with
+ * a bounded one (e.g. -r 1024) and keep clients * depth well below it:
+ * a packet pushed out of the window before its reply is taken would get
+ * an empty reply, and full mode would wait for it until -t seconds pass
+ * without any reply data.
+ *
+ * Usage: loadgen [-H host] [-p port] [-c clients] [-n packets | -d secs]
+ *                [-s size|min-max|mixed] [-P depth] [-m full|drain]
+ *                [-t idle_timeout_secs] [-l label]
+ */
+#define _GNU_SOURCE	/* memmem */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "../aesd_config.h"
+
+#define RECV_CHUNK (256 * 1024)
+
+typedef enum { MODE_FULL, MODE_DRAIN } reply_mode_t;
+
+typedef struct {
+	size_t min, max;	/* packet length range, newline included */
+	unsigned big_pct;	/* share drawn from [big_min, big_max] */
+	size_t big_min, big_max;
+} sizes_t;
+
+typedef struct {
+	const char *host;
+	const char *port;
+	unsigned clients;
+	uint64_t packets;	/* per client, 0 with a duration */
+	double duration;
+	double timeout;
+	unsigned depth;
+	reply_mode_t mode;
+	sizes_t sizes;
+	const char *label;
+} config_t;
+
+typedef struct {
+	const config_t *cfg;
+	unsigned id;
+	double deadline;	/* stop sending, duration mode; set once connected */
+
+	uint64_t sent;		/* packets fully sent */
+	uint64_t replied;	/* replies complete (full mode) */
+	uint64_t bytes_out;
+	uint64_t bytes_in;
+	uint64_t *lat;		/* ns per completed reply */
+	size_t nlat, lat_cap;
+	const char *error;
+	unsigned long rng;
+} client_t;
+
+static double now_sec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static size_t pick(unsigned long *rng, size_t lo, size_t hi) {
+	*rng ^= *rng << 13;
+	*rng ^= *rng >> 7;
+	*rng ^= *rng << 17;
+	return lo + *rng % (hi - lo + 1);
+}
+
+/*
+ * Packet seq of client id: a unique tag, filler up to len, then '\n'.
+ * Returns the tag length; the tag alone identifies the packet.
+ */
+static size_t make_packet(char *buf, size_t len, unsigned id, uint64_t seq) {
+	int tag = snprintf(buf, len, "c%u-%llu:", id, (unsigned long long)seq);
+	size_t t = (size_t)tag < len - 1 ? (size_t)tag : len - 1;
+	for (size_t i = t; i < len - 1; i++)
+		buf[i] = (char)('a' + i % 26);
+	buf[len - 1] = '\n';
+	return t;
+}
+
+static int connect_to(const char *host, const char *port) {
+	struct addrinfo hints = { .ai_family = AF_UNSPEC,
+				  .ai_socktype = SOCK_STREAM }, *res, *p;
+	int fd = -1;
+
+	if (getaddrinfo(host, port, &hints, &res) != 0)
+		return -1;
+	for (p = res; p; p = p->ai_next) {
+		fd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC,
+			    p->ai_protocol);
+		if (fd == -1) continue;
+		if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+
+	if (fd != -1) {
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	}
+	return fd;
+}
+
+static void add_latency(client_t *cl, uint64_t ns) {
+	if (cl->nlat == cl->lat_cap) {
+		size_t cap = cl->lat_cap ? cl->lat_cap * 2 : 4096;
+		uint64_t *tmp = realloc(cl->lat, cap * sizeof *tmp);
+		if (!tmp) return; /* keep counting, stop sampling */
+		cl->lat = tmp;
+		cl->lat_cap = cap;
+	}
+	cl->lat[cl->nlat++] = ns;
+}
+
+/* In-flight packet in full mode */
+typedef struct {
+	char tag[32];
+	size_t tag_len;
+	uint64_t sent_ns;
+} inflight_t;
+
+/* Every client and main(): the clock starts when all have connected */
+static pthread_barrier_t connected;
+
+static void *client_main(void *arg) {
+	client_t *cl = arg;
+	const config_t *cfg = cl->cfg;
+	bool full = cfg->mode == MODE_FULL;
+
+	char *pkt = malloc(cfg->sizes.big_pct ? cfg->sizes.big_max
+					       : cfg->sizes.max);
+	char *rbuf = malloc(RECV_CHUNK);
+	inflight_t *fl = calloc(cfg->depth, sizeof *fl);
+	int fd = connect_to(cfg->host, cfg->port);
+	pthread_barrier_wait(&connected);
+	cl->deadline = now_sec() + cfg->duration;
+	if (!pkt || !rbuf || !fl || fd == -1) {
+		cl->error = fd == -1 ? "connect failed" : "out of memory";
+		goto out;
+	}
+
+	size_t pkt_len = 0, pkt_off = 0;	/* packet being sent */
+	size_t keep = 0;		/* tail kept for a split tag match */
+	bool done_sending = false, shut = false;
+	double give_up = now_sec() + cfg->timeout;	/* no progress until */
+
+	for (;;) {
+		if (!done_sending && !pkt_len) {
+			bool more = cfg->packets ? cl->sent < cfg->packets
+						 : now_sec() < cl->deadline;
+			if (!more) {
+				done_sending = true;
+			} else if (!full || cl->sent - cl->replied < cfg->depth) {
+				const sizes_t *s = &cfg->sizes;
+				pkt_len = s->big_pct && pick(&cl->rng, 1, 100)
+					<= s->big_pct
+					? pick(&cl->rng, s->big_min, s->big_max)
+					: pick(&cl->rng, s->min, s->max);
+				size_t t = make_packet(pkt, pkt_len, cl->id,
+						       cl->sent);
+				inflight_t *f = &fl[cl->sent % cfg->depth];
+				memcpy(f->tag, pkt, t);
+				f->tag_len = t;
+				f->sent_ns = now_ns();
+				pkt_off = 0;
+			}
+		}
+
+		if (done_sending) {
+			if (full && cl->replied == cl->sent)
+				break;
+			if (!full && !shut) {
+				shutdown(fd, SHUT_WR);
+				shut = true;
+			}
+		}
+
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		if (pkt_len) pfd.events |= POLLOUT;
+		int rc = poll(&pfd, 1, 100);
+		if (rc == -1 && errno != EINTR) {
+			cl->error = "poll failed";
+			break;
+		}
+		if (now_sec() > give_up) {
+			cl->error = "timed out waiting for replies";
+			break;
+		}
+		if (rc <= 0) continue;
+
+		if (pfd.revents & POLLOUT) {
+			ssize_t n = send(fd, pkt + pkt_off, pkt_len - pkt_off,
+					 MSG_NOSIGNAL);
+			if (n == -1 && errno != EAGAIN && errno != EINTR) {
+				cl->error = "send failed";
+				break;
+			}
+			if (n > 0) {
+				pkt_off += (size_t)n;
+				cl->bytes_out += (uint64_t)n;
+				if (pkt_off == pkt_len) {
+					cl->sent++;
+					pkt_len = 0;
+				}
+			}
+		}
+
+		if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+			ssize_t n = recv(fd, rbuf + keep, RECV_CHUNK - keep, 0);
+			if (n == -1) {
+				if (errno == EAGAIN || errno == EINTR) continue;
+				cl->error = "recv failed";
+				break;
+			}
+			if (n == 0) {
+				if (!full && shut) break; /* drained */
+				cl->error = "server closed the connection";
+				break;
+			}
+			cl->bytes_in += (uint64_t)n;
+			give_up = now_sec() + cfg->timeout;
+			if (!full) continue;
+
+			/* Match replies in order against the in-flight tags */
+			size_t len = keep + (size_t)n, pos = 0;
+			while (cl->replied < cl->sent) {
+				inflight_t *f = &fl[cl->replied % cfg->depth];
+				char *hit = memmem(rbuf + pos, len - pos, f->tag,
+						   f->tag_len);
+				if (!hit) break;
+				add_latency(cl, now_ns() - f->sent_ns);
+				cl->replied++;
+				pos = (size_t)(hit - rbuf) + f->tag_len;
+			}
+
+			/* A tag may straddle the next recv() */
+			keep = len - pos < sizeof fl->tag ? len - pos
+							  : sizeof fl->tag;
+			memmove(rbuf, rbuf + len - keep, keep);
+		}
+	}
+
+out:
+	if (fd != -1) close(fd);
+	free(pkt);
+	free(rbuf);
+	free(fl);
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static double pct(const uint64_t *v, size_t n, double q) {
+	if (!n) return 0;
+	size_t i = (size_t)(q * (double)(n - 1) + 0.5);
+	return v[i] / 1e3; /* us */
+}
+
+static int parse_sizes(const char *arg, sizes_t *s) {
+	char *end;
+	*s = (sizes_t){0};
+
+	if (!strcmp(arg, "mixed")) {
+		*s = (sizes_t){ 16, 256, 5, 4096, 64 * 1024 };
+		return 0;
+	}
+
+	s->min = strtoul(arg, &end, 10);
+	s->max = s->min;
+	if (*end == '-')
+		s->max = strtoul(end + 1, &end, 10);
+	if (*end || s->min < 2 || s->max < s->min || s->max > MAX_PACKET)
+		return -1;
+	return 0;
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [-H host] [-p port] [-c clients] "
+		"[-n packets | -d secs]\n"
+		"          [-s size|min-max|mixed] [-P depth] [-m full|drain] "
+		"[-t timeout] [-l label]\n", prog);
+}
+
+int main(int argc, char **argv) {
+	config_t cfg = {
+		.host = "127.0.0.1", .port = "9000", .clients = 8,
+		.packets = 1000, .timeout = 10, .depth = 1,
+		.mode = MODE_FULL, .sizes = { 100, 100, 0, 0, 0 },
+		.label = "run",
+	};
+	int opt;
+
+	while ((opt = getopt(argc, argv, "H:p:c:n:d:s:P:m:t:l:")) != -1) {
+		switch (opt) {
+		case 'H': cfg.host = optarg; break;
+		case 'p': cfg.port = optarg; break;
+		case 'c': cfg.clients = (unsigned)strtoul(optarg, NULL, 10); break;
+		case 'n': cfg.packets = strtoull(optarg, NULL, 10); break;
+		case 'd': cfg.duration = strtod(optarg, NULL); break;
+		case 'P': cfg.depth = (unsigned)strtoul(optarg, NULL, 10); break;
+		case 't': cfg.timeout = strtod(optarg, NULL); break;
+		case 'l': cfg.label = optarg; break;
+		case 's':
+			if (parse_sizes(optarg, &cfg.sizes) == -1) {
+				fprintf(stderr, "bad size spec: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'm':
+			if (!strcmp(optarg, "full")) cfg.mode = MODE_FULL;
+			else if (!strcmp(optarg, "drain")) cfg.mode = MODE_DRAIN;
+			else { usage(argv[0]); return 1; }
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (cfg.duration > 0) cfg.packets = 0;
+	if (!cfg.clients || !cfg.depth || (!cfg.packets && cfg.duration <= 0)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	client_t *cl = calloc(cfg.clients, sizeof *cl);
+	pthread_t *tid = calloc(cfg.clients, sizeof *tid);
+	if (!cl || !tid) { perror("calloc"); return 1; }
+
+	if ((errno = pthread_barrier_init(&connected, NULL, cfg.clients + 1))) {
+		perror("pthread_barrier_init");
+		return 1;
+	}
+	for (unsigned i = 0; i < cfg.clients; i++) {
+		cl[i] = (client_t){ .cfg = &cfg, .id = i,
+				    .rng = 88172645463325252UL + i * 7919 };
+		if ((errno = pthread_create(&tid[i], NULL, client_main, &cl[i]))) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+	pthread_barrier_wait(&connected);
+	double t0 = now_sec();
+
+	uint64_t sent = 0, replied = 0, out = 0, in = 0;
+	size_t nlat = 0;
+	int failed = 0;
+	for (unsigned i = 0; i < cfg.clients; i++) {
+		pthread_join(tid[i], NULL);
+		sent += cl[i].sent;
+		replied += cl[i].replied;
+		out += cl[i].bytes_out;
+		in += cl[i].bytes_in;
+		nlat += cl[i].nlat;
+		if (cl[i].error) {
+			if (!failed++)
+				fprintf(stderr, "client %u: %s\n", i, cl[i].error);
+		}
+	}
+	double secs = now_sec() - t0;
+
+	uint64_t *lat = malloc((nlat ? nlat : 1) * sizeof *lat);
+	size_t k = 0;
+	for (unsigned i = 0; i < cfg.clients; i++) {
+		if (lat && cl[i].nlat)
+			memcpy(lat + k, cl[i].lat, cl[i].nlat * sizeof *lat);
+		k += cl[i].nlat;
+		free(cl[i].lat);
+	}
+	if (!lat) nlat = 0;
+	qsort(lat, nlat, sizeof *lat, cmp_u64);
+
+	uint64_t done = cfg.mode == MODE_FULL ? replied : sent;
+	printf("%-14s clients=%u depth=%u mode=%s pkts=%llu secs=%.2f "
+	       "pkts/s=%.0f out_MB/s=%.2f in_MB/s=%.2f "
+	       "p50_us=%.1f p90_us=%.1f p99_us=%.1f p999_us=%.1f max_us=%.1f%s\n",
+	       cfg.label, cfg.clients, cfg.depth,
+	       cfg.mode == MODE_FULL ? "full" : "drain",
+	       (unsigned long long)done, secs, done / secs, out / secs / 1e6,
+	       in / secs / 1e6, pct(lat, nlat, 0.50), pct(lat, nlat, 0.90),
+	       pct(lat, nlat, 0.99), pct(lat, nlat, 0.999),
+	       nlat ? lat[nlat - 1] / 1e3 : 0.0,
+	       failed ? "  FAILED" : "");
+
+	pthread_barrier_destroy(&connected);
+	free(lat);
+	free(cl);
+	free(tid);
+	return failed ? 1 : 0;
+}
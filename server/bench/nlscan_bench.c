@@ -0,0 +1,173 @@
+/*
+ * Microbenchmark of newline indexing over the receive buffer: the old
+ * memchr()-per-line framing against each nl_scan() implementation.
+ *
+ * A buffer of lines is generated for each length distribution and walked
+ * in RECV_BUF_SZ chunks, the way data arrives from recv(), finding every
+ * newline in each chunk with NL_BATCH offsets per nl_scan() call.
+ *
+ * Each implementation reports its fastest round, which is what repeats
+ * from run to run on a busy or single-CPU machine; the mean does not.
+ *
+ * Usage: nlscan_bench [-m megabytes] [-r rounds]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "../aesd_config.h"
+#include "../nlscan.h"
+
+typedef struct {
+	const char *name;
+	size_t min, max;	/* line length range, newline included */
+	unsigned big_pct;	/* share of lines drawn from [big_min, big_max] */
+	size_t big_min, big_max;
+} dist_t;
+
+static const dist_t dists[] = {
+	{ "telemetry", 16, 96, 0, 0, 0 },
+	{ "logs", 64, 512, 0, 0, 0 },
+	{ "mixed", 16, 256, 5, 4096, 64 * 1024 },
+	{ "blobs", 256 * 1024, MAX_PACKET - 1, 0, 0, 0 },
+};
+
+static unsigned long rng = 88172645463325252UL;
+
+static size_t pick(size_t lo, size_t hi) {
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return lo + rng % (hi - lo + 1);
+}
+
+static size_t fill(char *buf, size_t size, const dist_t *d, size_t *lines) {
+	size_t pos = 0;
+	*lines = 0;
+
+	for (;;) {
+		size_t len = d->big_pct && pick(1, 100) <= d->big_pct
+			? pick(d->big_min, d->big_max) : pick(d->min, d->max);
+		if (pos + len > size)
+			break;
+		for (size_t i = 0; i < len - 1; i++)
+			buf[pos + i] = (char)('a' + (pos + i) % 26);
+		buf[pos + len - 1] = '\n';
+		pos += len;
+		(*lines)++;
+	}
+	return pos;
+}
+
+static double now_sec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Former framing: one memchr() per line within each chunk */
+static size_t count_memchr(const char *buf, size_t len) {
+	size_t found = 0;
+	for (size_t off = 0; off < len; off += RECV_BUF_SZ) {
+		size_t clen = len - off < RECV_BUF_SZ ? len - off : RECV_BUF_SZ;
+		const char *p = buf + off, *end = p + clen, *nl;
+		while (p < end && (nl = memchr(p, '\n', (size_t)(end - p)))) {
+			found++;
+			p = nl + 1;
+		}
+	}
+	return found;
+}
+
+static size_t count_scan(nl_scan_fn fn, const char *buf, size_t len) {
+	uint32_t offs[NL_BATCH];
+	size_t found = 0;
+
+	for (size_t off = 0; off < len; off += RECV_BUF_SZ) {
+		size_t clen = len - off < RECV_BUF_SZ ? len - off : RECV_BUF_SZ;
+		size_t done = 0;
+		while (done < clen) {
+			size_t scanned;
+			found += fn(buf + off + done, clen - done, offs,
+				    NL_BATCH, &scanned);
+			done += scanned;
+		}
+	}
+	return found;
+}
+
+static void report(const char *impl, size_t bytes, size_t lines,
+		size_t found, double secs) {
+	printf("  %-8s %9.0f MB/s %8.2f ns/line%s\n", impl,
+	       (double)bytes / secs / 1e6, secs * 1e9 / (double)lines,
+	       found == lines ? "" : "  MISCOUNT");
+}
+
+/* Fastest of rounds runs of fn (NULL: memchr per line) over buf */
+static double best_round(nl_scan_fn fn, const char *buf, size_t len,
+		unsigned rounds, size_t *found) {
+	double best = 0;
+	for (unsigned r = 0; r < rounds; r++) {
+		double t0 = now_sec();
+		*found = fn ? count_scan(fn, buf, len) : count_memchr(buf, len);
+		double t = now_sec() - t0;
+		if (!r || t < best)
+			best = t;
+	}
+	return best;
+}
+
+int main(int argc, char **argv) {
+	size_t mb = 64;
+	unsigned rounds = 5;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "m:r:")) != -1) {
+		switch (opt) {
+		case 'm': mb = strtoul(optarg, NULL, 0); break;
+		case 'r': rounds = (unsigned)strtoul(optarg, NULL, 0); break;
+		default:
+			fprintf(stderr, "Usage: %s [-m megabytes] [-r rounds]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (!mb || !rounds) {
+		fprintf(stderr, "need megabytes > 0 and rounds > 0\n");
+		return 1;
+	}
+
+	size_t size = mb << 20;
+	char *buf = malloc(size);
+	if (!buf) { perror("malloc"); return 1; }
+
+	printf("nl_scan uses %s, %zu MiB per round, best of %u rounds\n",
+	       nl_isa_name(nl_scan_isa()), mb, rounds);
+
+	for (size_t d = 0; d < sizeof dists / sizeof dists[0]; d++) {
+		size_t lines;
+		size_t len = fill(buf, size, &dists[d], &lines);
+		if (!lines) {
+			printf("%s: buffer too small\n", dists[d].name);
+			continue;
+		}
+		printf("%s: %zu lines, avg %zu bytes\n", dists[d].name, lines,
+		       len / lines);
+
+		size_t found;
+		double t = best_round(NULL, buf, len, rounds, &found);
+		report("memchr", len, lines, found, t);
+
+		for (int isa = 0; isa < NL_ISA_MAX; isa++) {
+			nl_scan_fn fn = nl_scan_get((nl_isa_t)isa);
+			if (!fn) continue;
+			t = best_round(fn, buf, len, rounds, &found);
+			report(nl_isa_name((nl_isa_t)isa), len, lines, found, t);
+		}
+	}
+
+	free(buf);
+	return 0;
+}
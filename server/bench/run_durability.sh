@@ -0,0 +1,62 @@
+#!/bin/bash
+# Throughput of each --durability mode: a fresh file-backed server per mode,
+# the same loadgen scenario against each, then one table.
+#
+# The data lives in a scratch directory (DIR, default under /var/tmp so it
+# is on a real disk rather than tmpfs) and retention keeps replies small.
+#
+# Usage: bench/run_durability.sh   (from server/, normally via
+#        make bench-durability)
+set -u
+
+cd "$(dirname "$0")/.."
+
+PORT=${PORT:-9318}
+DIR=${DIR:-/var/tmp}
+LOAD_ARGS=${LOAD_ARGS:--c 8 -d 3 -s 64}
+MODES=${MODES:-none interval:10 packets:64 bytes:64K strict}
+
+scratch=$(mktemp -d "$DIR/aesd-durability.XXXXXX") || exit 1
+server=
+stop_server() {
+	[ -n "$server" ] || return
+	kill "$server" 2>/dev/null
+	wait "$server" 2>/dev/null
+	server=
+}
+trap 'stop_server; rm -rf "$scratch"' EXIT
+
+results=$(mktemp)
+trap 'stop_server; rm -rf "$scratch" "$results"' EXIT
+
+failed=0
+for mode in $MODES; do
+	rm -f "$scratch"/data*
+	./aesdsocket -p "$PORT" -D "$scratch/data" -N 256 \
+		--durability="$mode" &
+	server=$!
+
+	for _ in $(seq 50); do
+		(exec 3<>"/dev/tcp/127.0.0.1/$PORT") 2>/dev/null && break
+		sleep 0.1
+	done
+
+	if ! ./bench/loadgen -p "$PORT" -l "$mode" $LOAD_ARGS \
+			| tee -a "$results"; then
+		failed=1
+	fi
+	stop_server
+done
+
+# field=value lookup in a result line
+field() { sed -n "s|.* $2=\([0-9.]*\).*|\1|p" <<< "$1"; }
+
+echo
+echo "loadgen $LOAD_ARGS, data in $DIR"
+printf '%-14s %12s %10s %10s\n' durability pkts/s p50_us p99_us
+while read -r line; do
+	printf '%-14s %12s %10s %10s\n' "${line%% *}" "$(field "$line" pkts/s)" \
+		"$(field "$line" p50_us)" "$(field "$line" p99_us)"
+done < "$results"
+
+exit $failed
@@ -0,0 +1,97 @@
+#!/bin/bash
+# Start aesdsocket on a scratch port, run the load generator scenarios and
+# compare each against bench/baseline.txt.
+#
+# A scenario regresses when its packets/s drops, or its p99 latency rises,
+# by more than TOLERANCE percent (default 25). Regressions are listed and
+# the script exits 1. SAVE=1 writes the results as the new baseline instead.
+#
+# The checked-in baseline comes from a 1 CPU VM where client and server
+# share the core: over five back-to-back runs packets/s spread by up to 25%
+# and p99 by up to 20% (min to max), so the default tolerance only catches
+# gross regressions there. Record a baseline on the machine you compare on,
+# and rerun a scenario before trusting a single miss.
+#
+# Usage: bench/run_loadgen.sh   (from server/, normally via make bench)
+set -u
+
+cd "$(dirname "$0")/.."
+
+PORT=${PORT:-9317}
+TOLERANCE=${TOLERANCE:-25}
+BASELINE=bench/baseline.txt
+# Bounded in-memory window: replies stay small and no file is touched.
+# Keep clients * depth of every scenario well below it (see loadgen.c).
+SERVER_ARGS=${SERVER_ARGS:--r 256}
+
+# label, then loadgen arguments; fixed durations keep a slow server from
+# stretching the run. The worker pool serves WORKER_THREADS (8) clients at
+# a time, so no scenario uses more: the rest would wait out the whole run
+# for a free worker and show up as multi-second tail latency.
+SCENARIOS=(
+	"1c-small      -c 1  -d 3 -s 64"
+	"8c-small      -c 8  -d 3 -s 64"
+	"8c-mixed      -c 8  -d 3 -s mixed"
+	"8c-pipe4      -c 8  -d 3 -s 16-256 -P 4"
+	"8c-drain      -c 8  -d 3 -s 64-1024 -m drain"
+)
+
+./aesdsocket -p "$PORT" $SERVER_ARGS &
+server=$!
+trap 'kill $server 2>/dev/null; wait $server 2>/dev/null' EXIT
+
+for _ in $(seq 50); do
+	(exec 3<>"/dev/tcp/127.0.0.1/$PORT") 2>/dev/null && break
+	sleep 0.1
+done
+
+results=$(mktemp)
+trap 'kill $server 2>/dev/null; wait $server 2>/dev/null; rm -f "$results"' EXIT
+
+failed=0
+for s in "${SCENARIOS[@]}"; do
+	set -- $s
+	label=$1
+	shift
+	if ! ./bench/loadgen -p "$PORT" -l "$label" "$@" | tee -a "$results"; then
+		failed=1
+	fi
+done
+
+if [ "${SAVE:-0}" = 1 ]; then
+	{
+		echo "# make bench baseline: $(date -u +%Y-%m-%d) $(uname -m)" \
+			"$(nproc) cpus, server $SERVER_ARGS"
+		cat "$results"
+	} > "$BASELINE"
+	echo "baseline saved to $BASELINE"
+	exit $failed
+fi
+
+[ -f "$BASELINE" ] || { echo "no $BASELINE, run SAVE=1 make bench"; exit $failed; }
+
+# field=value lookup in a result line
+field() { sed -n "s|.* $2=\([0-9.]*\).*|\1|p" <<< "$1"; }
+
+echo
+printf '%-14s %12s %12s %8s %10s %10s %8s\n' scenario base_pkts/s pkts/s diff% \
+	base_p99 p99 diff%
+while read -r line; do
+	label=${line%% *}
+	base=$(grep "^$label " "$BASELINE") || continue
+	bp=$(field "$base" pkts/s); np=$(field "$line" pkts/s)
+	bl=$(field "$base" p99_us); nl=$(field "$line" p99_us)
+	verdict=$(awk -v bp="$bp" -v np="$np" -v bl="$bl" -v nl="$nl" \
+		-v tol="$TOLERANCE" 'BEGIN {
+		dp = bp > 0 ? (np - bp) * 100 / bp : 0
+		dl = bl > 0 ? (nl - bl) * 100 / bl : 0
+		bad = dp < -tol || (bl > 0 && dl > tol)
+		printf "%+.1f %+.1f %s", dp, dl, bad ? "REGRESSION" : "ok"
+	}')
+	set -- $verdict
+	printf '%-14s %12s %12s %8s %10s %10s %8s  %s\n' "$label" "$bp" "$np" \
+		"$1" "$bl" "$nl" "$2" "$3"
+	[ "$3" = REGRESSION ] && failed=1
+done < "$results"
+
+exit $failed
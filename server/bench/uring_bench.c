@@ -0,0 +1,292 @@
+/*
+ * In-process benchmark of the connection hot path: syscall path versus
+ * the io_uring backend. A client thread drives handle_connection() over
+ * a socketpair, one packet at a time, reading each full reply before
+ * sending the next packet.
+ *
+ * Syscalls made by the handler thread are counted by wrapping the libc
+ * entry points at link time (-Wl,--wrap, see the Makefile). For io_uring
+ * the submit/wait calls are counted, which is an upper bound on
+ * io_uring_enter() since completions already in the CQ need no syscall.
+ *
+ * Usage: uring_bench [-n packets] [-s packet_size]
+ */
+#define _GNU_SOURCE	/* loff_t */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "../handleconn.h"
+#include "../uring.h"
+
+volatile sig_atomic_t exit_requested = 0;
+
+/* Only the handler thread is counted, not the client */
+static __thread int counting;
+
+enum { SC_RECV, SC_SEND, SC_WRITE, SC_WRITEV, SC_PREAD, SC_OPEN, SC_CLOSE, SC_FSTAT,
+       SC_SENDFILE, SC_SPLICE, SC_FDATASYNC, SC_URING, SC_MAX };
+static const char *sc_names[SC_MAX] = {
+	"recv", "send", "write", "writev", "pread", "open", "close", "fstat",
+	"sendfile", "splice", "fdatasync", "uring",
+};
+static unsigned long sc_count[SC_MAX];
+
+#define COUNT(sc) do { if (counting) sc_count[sc]++; } while (0)
+
+ssize_t __real_recv(int fd, void *buf, size_t len, int flags);
+ssize_t __wrap_recv(int fd, void *buf, size_t len, int flags) {
+	COUNT(SC_RECV);
+	return __real_recv(fd, buf, len, flags);
+}
+
+ssize_t __real_send(int fd, const void *buf, size_t len, int flags);
+ssize_t __wrap_send(int fd, const void *buf, size_t len, int flags) {
+	COUNT(SC_SEND);
+	return __real_send(fd, buf, len, flags);
+}
+
+ssize_t __real_write(int fd, const void *buf, size_t len);
+ssize_t __wrap_write(int fd, const void *buf, size_t len) {
+	COUNT(SC_WRITE);
+	return __real_write(fd, buf, len);
+}
+
+ssize_t __real_writev(int fd, const struct iovec *iov, int iovcnt);
+ssize_t __wrap_writev(int fd, const struct iovec *iov, int iovcnt) {
+	COUNT(SC_WRITEV);
+	return __real_writev(fd, iov, iovcnt);
+}
+
+ssize_t __real_pread(int fd, void *buf, size_t len, off_t off);
+ssize_t __wrap_pread(int fd, void *buf, size_t len, off_t off) {
+	COUNT(SC_PREAD);
+	return __real_pread(fd, buf, len, off);
+}
+
+int __real_open(const char *path, int flags, ...);
+int __wrap_open(const char *path, int flags, mode_t mode) {
+	COUNT(SC_OPEN);
+	return __real_open(path, flags, mode);
+}
+
+int __real_close(int fd);
+int __wrap_close(int fd) {
+	COUNT(SC_CLOSE);
+	return __real_close(fd);
+}
+
+int __real_fstat(int fd, struct stat *st);
+int __wrap_fstat(int fd, struct stat *st) {
+	COUNT(SC_FSTAT);
+	return __real_fstat(fd, st);
+}
+
+ssize_t __real_sendfile(int out, int in, off_t *off, size_t len);
+ssize_t __wrap_sendfile(int out, int in, off_t *off, size_t len) {
+	COUNT(SC_SENDFILE);
+	return __real_sendfile(out, in, off, len);
+}
+
+ssize_t __real_splice(int in, loff_t *in_off, int out, loff_t *out_off,
+		size_t len, unsigned flags);
+ssize_t __wrap_splice(int in, loff_t *in_off, int out, loff_t *out_off,
+		size_t len, unsigned flags) {
+	COUNT(SC_SPLICE);
+	return __real_splice(in, in_off, out, out_off, len, flags);
+}
+
+int __real_fdatasync(int fd);
+int __wrap_fdatasync(int fd) {
+	COUNT(SC_FDATASYNC);
+	return __real_fdatasync(fd);
+}
+
+#ifdef AESD_HAVE_URING
+#include <liburing.h>
+
+int __real_io_uring_submit(struct io_uring *ring);
+int __wrap_io_uring_submit(struct io_uring *ring) {
+	COUNT(SC_URING);
+	return __real_io_uring_submit(ring);
+}
+
+int __real_io_uring_submit_and_wait(struct io_uring *ring, unsigned n);
+int __wrap_io_uring_submit_and_wait(struct io_uring *ring, unsigned n) {
+	COUNT(SC_URING);
+	return __real_io_uring_submit_and_wait(ring, n);
+}
+
+int __real___io_uring_get_cqe(struct io_uring *ring,
+		struct io_uring_cqe **cqe, unsigned submit, unsigned wait,
+		sigset_t *sigmask);
+int __wrap___io_uring_get_cqe(struct io_uring *ring,
+		struct io_uring_cqe **cqe, unsigned submit, unsigned wait,
+		sigset_t *sigmask) {
+	COUNT(SC_URING);
+	return __real___io_uring_get_cqe(ring, cqe, submit, wait, sigmask);
+}
+#endif
+
+typedef struct {
+	int fd;
+	size_t packets;
+	size_t size;
+	size_t reply_bytes;
+	int failed;
+} client_t;
+
+static void *client_main(void *arg) {
+	client_t *cl = arg;
+	char *pkt = malloc(cl->size);
+	char *buf = malloc(1 << 16);
+	size_t file_len = 0;
+
+	memset(pkt, 'b', cl->size - 1);
+	pkt[cl->size - 1] = '\n';
+
+	for (size_t i = 0; i < cl->packets && !cl->failed; i++) {
+		if (send(cl->fd, pkt, cl->size, MSG_NOSIGNAL) != (ssize_t)cl->size) {
+			cl->failed = 1;
+			break;
+		}
+		file_len += cl->size;
+
+		/* The reply is the whole file so far */
+		size_t got = 0;
+		while (got < file_len) {
+			ssize_t n = recv(cl->fd, buf, 1 << 16, 0);
+			if (n <= 0) { cl->failed = 1; break; }
+			got += (size_t)n;
+		}
+		cl->reply_bytes += got;
+	}
+
+	shutdown(cl->fd, SHUT_WR);
+	free(pkt);
+	free(buf);
+	return NULL;
+}
+
+static double now_sec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int run(const char *mode, int use_uring, size_t packets, size_t size) {
+	char path[] = "/tmp/aesd-bench-XXXXXX";
+	int tmp = mkstemp(path);
+	if (tmp == -1) { perror("mkstemp"); return -1; }
+	close(tmp);
+
+	store_t store;
+	store_opts_t opts = {0};
+	hc_shared_t shared;
+	hc_bufs_t bufs;
+	if (store_open(&store, path, &opts) == -1
+			|| hc_shared_init(&shared, &store, 0) == -1
+			|| hc_bufs_init(&bufs, &shared) == -1) {
+		perror("setup");
+		unlink(path);
+		return -1;
+	}
+
+	if (use_uring) {
+		bufs.ring = ur_create(&bufs, &shared);
+		if (!bufs.ring) {
+			printf("%-9s unavailable: %s\n", mode, strerror(errno));
+			hc_bufs_free(&bufs);
+			hc_shared_destroy(&shared);
+			store_close(&store, true);
+			return 0;
+		}
+	}
+
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+		perror("socketpair");
+		return -1;
+	}
+
+	client_t cl = { .fd = sv[1], .packets = packets, .size = size };
+	pthread_t tid;
+	memset(sc_count, 0, sizeof sc_count);
+
+	double t0 = now_sec();
+	if ((errno = pthread_create(&tid, NULL, client_main, &cl)) != 0) {
+		perror("pthread_create");
+		close(sv[0]);
+		close(sv[1]);
+		hc_bufs_free(&bufs);
+		hc_shared_destroy(&shared);
+		store_close(&store, true);
+		return EXIT_ERROR;
+	}
+
+	hc_result_t res;
+	counting = 1;
+	handle_connection(sv[0], &shared, &bufs, false, &res);
+	counting = 0;
+
+	pthread_join(tid, NULL);
+	double secs = now_sec() - t0;
+
+	unsigned long total = 0;
+	for (int i = 0; i < SC_MAX; i++)
+		total += sc_count[i];
+
+	printf("%-9s %8zu pkts %10.0f pkts/s %8.1f MB/s reply  "
+	       "%6.1f syscalls/pkt%s\n", mode, packets, packets / secs,
+	       cl.reply_bytes / secs / 1e6, (double)total / packets,
+	       cl.failed || res.outcome == HC_OUTCOME_ERROR ? "  FAILED" : "");
+	printf("%-9s", "");
+	for (int i = 0; i < SC_MAX; i++) {
+		if (sc_count[i])
+			printf(" %s=%lu", sc_names[i], sc_count[i]);
+	}
+	printf("\n");
+
+	close(sv[0]);
+	close(sv[1]);
+	hc_bufs_free(&bufs);
+	hc_shared_destroy(&shared);
+	store_close(&store, true);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	size_t packets = 2000;
+	size_t size = 100;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+		switch (opt) {
+		case 'n': packets = strtoul(optarg, NULL, 0); break;
+		case 's': size = strtoul(optarg, NULL, 0); break;
+		default:
+			fprintf(stderr, "Usage: %s [-n packets] [-s packet_size]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+
+	if (!packets || size < 2 || size > MAX_PACKET) {
+		fprintf(stderr, "need packets > 0 and 2 <= size <= %d\n",
+			MAX_PACKET);
+		return 1;
+	}
+
+	if (run("syscalls", 0, packets, size) == -1)
+		return 1;
+	if (run("io_uring", 1, packets, size) == -1)
+		return 1;
+	return 0;
+}
@@ -0,0 +1,32 @@
+#include <errno.h>  /* errno */
+#include <signal.h> /* sigfillset */
+#include <time.h>   /* CLOCK_MONOTONIC */
+
+#include "bgthread.h"
+
+int bg_spawn(pthread_t *tid, void *(*fn)(void *), void *arg) {
+	sigset_t all, old;
+
+	/* The new thread inherits the mask; restore ours right after */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	int rc = pthread_create(tid, NULL, fn, arg);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (rc) {
+		errno = rc;
+		return -1;
+	}
+	return 0;
+}
+
+int bg_cond_init(pthread_cond_t *cond) {
+	pthread_condattr_t attr;
+
+	if ((errno = pthread_condattr_init(&attr)) != 0)
+		return -1;
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	errno = pthread_cond_init(cond, &attr);
+	pthread_condattr_destroy(&attr);
+	return errno ? -1 : 0;
+}
@@ -0,0 +1,18 @@
+#ifndef __BGTHREAD_H__
+#define __BGTHREAD_H__
+
+#include <pthread.h> /* pthread_t, pthread_cond_t */
+
+/*
+ * Helpers for the background threads (logging, metrics, durability,
+ * timestamps). Signals belong to the accept thread, so bg_spawn() starts
+ * the thread with every signal blocked. bg_cond_init() makes a condition
+ * variable whose timed waits run on CLOCK_MONOTONIC, so a wall clock
+ * step neither cuts a period short nor stretches it.
+ *
+ * Both return -1 with errno set on error.
+ */
+int bg_spawn(pthread_t *tid, void *(*fn)(void *), void *arg);
+int bg_cond_init(pthread_cond_t *cond);
+
+#endif
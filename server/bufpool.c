@@ -0,0 +1,106 @@
+#include <stdlib.h> /* malloc, free */
+#include <errno.h>  /* errno */
+
+#include "bufpool.h"
+
+/* Class index for a size, or -1 if it is above the largest class */
+static int size_class(size_t sz) {
+	if (sz > BP_MAX_SZ)
+		return -1;
+
+	int cls = 0;
+	while (((size_t)1 << (BP_MIN_SHIFT + cls)) < sz)
+		cls++;
+	return cls;
+}
+
+int bp_init(bufpool_t *bp, size_t max_cached) {
+	for (int i = 0; i < BP_CLASSES; i++)
+		bp->free[i] = NULL;
+	bp->cached_bytes = 0;
+	bp->max_cached = max_cached;
+	atomic_init(&bp->hits, 0);
+	atomic_init(&bp->misses, 0);
+	atomic_init(&bp->releases, 0);
+	atomic_init(&bp->drops, 0);
+
+	if ((errno = pthread_mutex_init(&bp->lock, NULL)) != 0)
+		return -1;
+	return 0;
+}
+
+void bp_destroy(bufpool_t *bp) {
+	for (int i = 0; i < BP_CLASSES; i++) {
+		while (bp->free[i]) {
+			void *next = *(void **)bp->free[i];
+			free(bp->free[i]);
+			bp->free[i] = next;
+		}
+	}
+	bp->cached_bytes = 0;
+	pthread_mutex_destroy(&bp->lock);
+}
+
+void *bp_get(bufpool_t *bp, size_t need, size_t *cap) {
+	int cls = size_class(need);
+	void *buf = NULL;
+
+	if (cls != -1) {
+		size_t sz = (size_t)1 << (BP_MIN_SHIFT + cls);
+
+		pthread_mutex_lock(&bp->lock);
+		if ((buf = bp->free[cls])) {
+			bp->free[cls] = *(void **)buf;
+			bp->cached_bytes -= sz;
+		}
+		pthread_mutex_unlock(&bp->lock);
+
+		need = sz;
+	}
+
+	if (buf) {
+		atomic_fetch_add_explicit(&bp->hits, 1, memory_order_relaxed);
+	} else {
+		atomic_fetch_add_explicit(&bp->misses, 1, memory_order_relaxed);
+		if (!(buf = malloc(need))) {
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+
+	*cap = need;
+	return buf;
+}
+
+void bp_put(bufpool_t *bp, void *buf, size_t cap) {
+	if (!buf) return;
+
+	int cls = size_class(cap);
+	if (cls != -1 && cap == (size_t)1 << (BP_MIN_SHIFT + cls)) {
+		pthread_mutex_lock(&bp->lock);
+		if (bp->cached_bytes + cap <= bp->max_cached) {
+			*(void **)buf = bp->free[cls];
+			bp->free[cls] = buf;
+			bp->cached_bytes += cap;
+			pthread_mutex_unlock(&bp->lock);
+			atomic_fetch_add_explicit(&bp->releases, 1,
+						  memory_order_relaxed);
+			return;
+		}
+		pthread_mutex_unlock(&bp->lock);
+	}
+
+	atomic_fetch_add_explicit(&bp->drops, 1, memory_order_relaxed);
+	free(buf);
+}
+
+void bp_get_stats(bufpool_t *bp, bp_stats_t *st) {
+	st->hits = atomic_load_explicit(&bp->hits, memory_order_relaxed);
+	st->misses = atomic_load_explicit(&bp->misses, memory_order_relaxed);
+	st->releases = atomic_load_explicit(&bp->releases, memory_order_relaxed);
+	st->drops = atomic_load_explicit(&bp->drops, memory_order_relaxed);
+
+	pthread_mutex_lock(&bp->lock);
+	st->cached_bytes = bp->cached_bytes;
+	pthread_mutex_unlock(&bp->lock);
+}
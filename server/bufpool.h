@@ -0,0 +1,57 @@
+#ifndef __BUFPOOL_H__
+#define __BUFPOOL_H__
+
+#include <stddef.h>    /* size_t */
+#include <stdint.h>    /* uint64_t */
+#include <stdatomic.h> /* atomics */
+#include <pthread.h>   /* pthread_mutex_t */
+
+/*
+ * Shared pool for connection buffers (line builders, receive buffers).
+ * Sizes are rounded up to power-of-two classes from BP_MIN_SZ to
+ * BP_MAX_SZ, and released buffers wait on a per-class free list for the
+ * next connection instead of going back to malloc. At most max_cached
+ * bytes are parked; anything beyond that, or outside the classes, is
+ * freed right away.
+ */
+#define BP_MIN_SHIFT 8		/* 256 B */
+#define BP_MAX_SHIFT 20		/* 1 MiB */
+#define BP_CLASSES (BP_MAX_SHIFT - BP_MIN_SHIFT + 1)
+#define BP_MIN_SZ ((size_t)1 << BP_MIN_SHIFT)
+#define BP_MAX_SZ ((size_t)1 << BP_MAX_SHIFT)
+
+typedef struct {
+	uint64_t hits;		/* served from a free list */
+	uint64_t misses;	/* had to malloc */
+	uint64_t releases;	/* parked on a free list */
+	uint64_t drops;		/* freed: cache full or unclassed size */
+	size_t cached_bytes;
+} bp_stats_t;
+
+typedef struct bufpool {
+	pthread_mutex_t lock;	/* guards the lists and cached_bytes */
+	void *free[BP_CLASSES];	/* singly linked through the buffers */
+	size_t cached_bytes;
+	size_t max_cached;
+
+	atomic_uint_fast64_t hits;
+	atomic_uint_fast64_t misses;
+	atomic_uint_fast64_t releases;
+	atomic_uint_fast64_t drops;
+} bufpool_t;
+
+int bp_init(bufpool_t *bp, size_t max_cached);
+/* Frees everything parked; buffers still handed out stay valid */
+void bp_destroy(bufpool_t *bp);
+
+/*
+ * A buffer of at least need bytes; *cap is its real size, which must be
+ * passed back to bp_put(). NULL with errno = ENOMEM on failure.
+ */
+void *bp_get(bufpool_t *bp, size_t need, size_t *cap);
+/* Return a buffer from bp_get(); NULL is ignored */
+void bp_put(bufpool_t *bp, void *buf, size_t cap);
+
+void bp_get_stats(bufpool_t *bp, bp_stats_t *st);
+
+#endif
@@ -0,0 +1,59 @@
+#include <stdio.h>  /* fopen, fread */
+#include <stdlib.h> /* malloc, realloc, free */
+#include <string.h> /* strchr, strcspn */
+#include <ctype.h>  /* isspace */
+#include <errno.h>  /* errno */
+
+#include "conffile.h"
+
+/* Config files are a few lines; anything bigger is a mistake */
+#define CONF_MAX_BYTES (64 * 1024)
+
+static char *trim(char *s) {
+	while (isspace((unsigned char)*s)) s++;
+	char *end = s + strlen(s);
+	while (end > s && isspace((unsigned char)end[-1])) end--;
+	*end = '\0';
+	return s;
+}
+
+static char *read_all(const char *path) {
+	FILE *f = fopen(path, "r");
+	if (!f) return NULL;
+
+	char *buf = malloc(CONF_MAX_BYTES + 1);
+	size_t len = buf ? fread(buf, 1, CONF_MAX_BYTES + 1, f) : 0;
+	int failed = !buf || ferror(f);
+	fclose(f);
+
+	if (failed || len > CONF_MAX_BYTES) {
+		free(buf);
+		errno = failed ? (buf ? EIO : ENOMEM) : EFBIG;
+		return NULL;
+	}
+	buf[len] = '\0';
+	return buf;
+}
+
+int conf_load(const char *path, conf_set_fn set, void *arg, char **buf) {
+	*buf = read_all(path);
+	if (!*buf) return -1;
+
+	unsigned line = 0;
+	for (char *p = *buf, *next; p; p = next) {
+		line++;
+		next = strchr(p, '\n');
+		if (next) *next++ = '\0';
+
+		p[strcspn(p, "#")] = '\0';
+		char *eq = strchr(p, '=');
+		if (eq) *eq = '\0';
+
+		char *key = trim(p);
+		if (!*key && !eq) continue; /* blank or comment only */
+
+		int rc = set(arg, key, eq ? trim(eq + 1) : NULL, line);
+		if (rc) return rc;
+	}
+	return 0;
+}
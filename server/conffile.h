@@ -0,0 +1,21 @@
+#ifndef __CONFFILE_H__
+#define __CONFFILE_H__
+
+#include <stddef.h> /* size_t */
+
+/*
+ * Minimal config file reader: one "key = value" per line, '#' starts a
+ * comment, blank lines are skipped and whitespace around keys and values
+ * is dropped. A key alone on its line gets the value NULL.
+ *
+ * set() is called for every entry in file order; a non-zero return stops
+ * the load. Keys and values point into *buf, which stays allocated for
+ * the caller to free() once they are no longer needed.
+ */
+typedef int (*conf_set_fn)(void *arg, const char *key, const char *val,
+		unsigned line);
+
+/* 0 on success, -1 with errno on I/O errors, else what set() returned */
+int conf_load(const char *path, conf_set_fn set, void *arg, char **buf);
+
+#endif
@@ -0,0 +1,410 @@
+#define _GNU_SOURCE	/* accept4 */
+#include <stdio.h>      /* snprintf */
+#include <stdlib.h>     /* malloc, free */
+#include <string.h>     /* strerror */
+#include <errno.h>      /* errno */
+#include <unistd.h>     /* close */
+#include <fcntl.h>      /* fcntl */
+#include <syslog.h>     /* syslog */
+#include <sys/epoll.h>  /* epoll_* */
+#include <sys/socket.h> /* accept4 */
+#include <netinet/in.h> /* sockaddr_in, INET6_ADDRSTRLEN */
+#include <arpa/inet.h>  /* inet_ntop */
+
+#include "evloop.h"
+#include "metrics.h"
+#include "alog.h"
+
+extern volatile sig_atomic_t exit_requested;
+
+/*
+ * Buffers are held only while a connection has something in them: the
+ * receive buffer (hc.rbuf) and line builder come from the shared pool
+ * when it turns readable and go back once it is idle, so a quiet client
+ * costs no buffer memory. The receive buffer is sized from the recent
+ * reads, up to shared->recv_buf_sz.
+ */
+typedef struct ev_conn {
+	hc_conn_t hc;
+	StringBuilder sb;
+	uint32_t events;	/* current epoll interest */
+	bool paused;		/* not read from: over the memory budget */
+	char peer_ip[INET6_ADDRSTRLEN];
+	struct ev_conn *prev, *next;
+} ev_conn_t;
+
+typedef struct {
+	int fd;
+	bool coalesce;
+} ev_listener_t;
+
+typedef struct {
+	int epfd;
+	ev_listener_t listeners[2];	/* plain, coalescing */
+	size_t nlisteners;
+	hc_shared_t *shared;
+	ev_conn_t *conns;	/* live connections, for teardown */
+	size_t npaused;
+	size_t pause_floor;	/* lightest paused, see budget_check */
+	ev_conn_t **readers;	/* budget_check scratch */
+	size_t readers_cap;
+} ev_loop_t;
+
+static void *peer_addr(struct sockaddr *sa) {
+	if (sa->sa_family == AF_INET)
+		return &(((struct sockaddr_in *)sa)->sin_addr);
+
+	return &(((struct sockaddr_in6 *)sa)->sin6_addr);
+}
+
+static void conn_close(ev_loop_t *ev, ev_conn_t *ec) {
+	epoll_ctl(ev->epfd, EPOLL_CTL_DEL, ec->hc.fd, NULL);
+	hc_conn_release(&ec->hc);
+	close(ec->hc.fd);
+	alog(ALOG_CLOSED, ec->peer_ip, 0, 0);
+
+	if (ec->paused) {
+		ev->npaused--;
+		atomic_fetch_sub_explicit(&metrics.conns_throttled, 1,
+					  memory_order_relaxed);
+	}
+	if (ec->prev) ec->prev->next = ec->next;
+	else ev->conns = ec->next;
+	if (ec->next) ec->next->prev = ec->prev;
+
+	sb_free(&ec->sb);
+	bp_put(&ev->shared->pool, ec->hc.rbuf, ec->hc.rbuf_cap);
+	free(ec);
+}
+
+static int conn_open(ev_loop_t *ev, int fd, const char *peer_ip,
+		bool coalesce) {
+	ev_conn_t *ec = calloc(1, sizeof *ec);
+	if (!ec) return -1;
+
+	/* Empty until the first read; cannot fail */
+	sb_init_pool(&ec->sb, &ev->shared->pool, 0, ev->shared->max_packet);
+	hc_conn_init(&ec->hc, fd, &ec->sb, NULL, 0);
+	ec->hc.coalesce = coalesce;
+	snprintf(ec->peer_ip, sizeof ec->peer_ip, "%s", peer_ip);
+
+	struct epoll_event e = { .events = EPOLLIN, .data.ptr = ec };
+	if (epoll_ctl(ev->epfd, EPOLL_CTL_ADD, fd, &e) == -1) {
+		hc_conn_release(&ec->hc);
+		free(ec);
+		return -1;
+	}
+	ec->events = EPOLLIN;
+
+	ec->next = ev->conns;
+	if (ev->conns) ev->conns->prev = ec;
+	ev->conns = ec;
+	return 0;
+}
+
+static int accept_all(ev_loop_t *ev, const ev_listener_t *l) {
+	for (;;) {
+		char peer_ip[INET6_ADDRSTRLEN];
+		struct sockaddr_storage their_addr;
+		socklen_t sin_size = sizeof their_addr;
+
+		int fd = accept4(l->fd, (struct sockaddr *)&their_addr,
+				 &sin_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			/* Transient per-connection failures, try again later */
+			if (errno == ECONNABORTED || errno == EMFILE
+					|| errno == ENFILE || errno == ENOBUFS
+					|| errno == ENOMEM)
+				return 0;
+			syslog(LOG_ERR, "accept failed: %s", strerror(errno));
+			return -1;
+		}
+
+		inet_ntop(their_addr.ss_family,
+			  peer_addr((struct sockaddr *)&their_addr),
+			  peer_ip, sizeof peer_ip);
+		alog(ALOG_ACCEPTED, peer_ip, 0, 0);
+		metrics_inc(&metrics.conns_accepted, 1);
+
+		if (conn_open(ev, fd, peer_ip, l->coalesce) == -1) {
+			alog(ALOG_NO_RESOURCES, peer_ip, errno, 0);
+			close(fd);
+			alog(ALOG_CLOSED, peer_ip, 0, 0);
+		}
+	}
+}
+
+/* A receive buffer of the size the recent reads call for */
+static int rbuf_attach(ev_loop_t *ev, ev_conn_t *ec) {
+	size_t cap;
+	char *buf = bp_get(&ev->shared->pool,
+			   hc_recv_want(&ec->hc, ev->shared->recv_buf_sz), &cap);
+	if (!buf) return -1;
+	hc_conn_set_rbuf(&ec->hc, buf, cap);
+	return 0;
+}
+
+/*
+ * Once the input is used up: an idle connection gives back both of its
+ * buffers, and a paused one, or one whose reads outgrew the receive
+ * buffer, gives that up until (for a larger one at) the next read.
+ */
+static void bufs_settle(ev_loop_t *ev, ev_conn_t *ec) {
+	hc_conn_t *c = &ec->hc;
+	if (c->rpos < c->rlen)
+		return;
+
+	bool idle = hc_conn_idle(c);
+	if (idle || ec->paused
+			|| hc_recv_want(c, ev->shared->recv_buf_sz) > c->rbuf_cap) {
+		bp_put(&ev->shared->pool, c->rbuf, c->rbuf_cap);
+		hc_conn_set_rbuf(c, NULL, 0);
+	}
+	if (idle)
+		sb_free(&ec->sb);
+	hc_conn_account(c);
+}
+
+static int set_events(ev_loop_t *ev, ev_conn_t *ec, uint32_t want) {
+	if (want == ec->events)
+		return 0;
+
+	struct epoll_event e = { .events = want, .data.ptr = ec };
+	if (epoll_ctl(ev->epfd, EPOLL_CTL_MOD, ec->hc.fd, &e) == -1) {
+		alog(ALOG_EPOLL_CTL, ec->peer_ip, errno, 0);
+		return -1;
+	}
+	ec->events = want;
+	return 0;
+}
+
+/* Stop reading; a reply in progress still finishes */
+static void conn_pause(ev_loop_t *ev, ev_conn_t *ec) {
+	if (ec->events == EPOLLIN && set_events(ev, ec, 0) == -1)
+		return;
+	ec->paused = true;
+	ev->npaused++;
+	metrics_inc(&metrics.conns_throttled, 1);
+	metrics_inc(&metrics.throttle_events, 1);
+	bufs_settle(ev, ec);
+}
+
+static void conn_resume(ev_loop_t *ev, ev_conn_t *ec) {
+	if (!ec->events && set_events(ev, ec, EPOLLIN) == -1)
+		return;
+	ec->paused = false;
+	ev->npaused--;
+	atomic_fetch_sub_explicit(&metrics.conns_throttled, 1,
+				  memory_order_relaxed);
+}
+
+static bool over_budget(ev_loop_t *ev) {
+	return ev->shared->mem_budget
+		&& atomic_load_explicit(&metrics.conn_buf_bytes,
+					memory_order_relaxed)
+		   > ev->shared->mem_budget;
+}
+
+static void conn_step(ev_loop_t *ev, ev_conn_t *ec, uint32_t revents) {
+	uint32_t want;
+
+	/*
+	 * Paused with no interest set, epoll still reports a hangup or error
+	 * (a reset peer), level-triggered. Reading would drain the socket past
+	 * the budget and the report would repeat every loop: close instead.
+	 */
+	if (ec->paused && !ec->events) {
+		if (revents & (EPOLLHUP | EPOLLERR)) {
+			hc_log_result(ec->peer_ip, &ec->hc.res);
+			conn_close(ev, ec);
+		}
+		return;
+	}
+
+	/* Over the budget, lines as heavy as a paused one wait before reading */
+	if (ec->sb.len && !ec->paused && ec->events == EPOLLIN
+			&& ec->hc.buf_bytes >= ev->pause_floor && over_budget(ev)) {
+		conn_pause(ev, ec);
+		return;
+	}
+
+	if (!ec->hc.rbuf && rbuf_attach(ev, ec) == -1) {
+		alog(ALOG_NO_RESOURCES, ec->peer_ip, errno, 0);
+		conn_close(ev, ec);
+		return;
+	}
+
+	switch (hc_conn_step(&ec->hc, ev->shared)) {
+	case HC_STEP_READ:
+		bufs_settle(ev, ec);
+		want = ec->paused ? 0 : EPOLLIN;
+		break;
+	case HC_STEP_WRITE:
+		want = EPOLLOUT;
+		break;
+	default:
+		hc_log_result(ec->peer_ip, &ec->hc.res);
+		conn_close(ev, ec);
+		return;
+	}
+
+	if (set_events(ev, ec, want) == -1)
+		conn_close(ev, ec);
+}
+
+/* Heaviest first */
+static int cmp_heavier(const void *a, const void *b) {
+	size_t x = (*(ev_conn_t *const *)a)->hc.buf_bytes;
+	size_t y = (*(ev_conn_t *const *)b)->hc.buf_bytes;
+	return (x < y) - (x > y);
+}
+
+/* Connections still read with a partial line, into ev->readers */
+static size_t collect_readers(ev_loop_t *ev) {
+	size_t n = 0;
+	for (ev_conn_t *ec = ev->conns; ec; ec = ec->next) {
+		if (ec->paused || !ec->sb.len)
+			continue;
+		if (n == ev->readers_cap) {
+			size_t cap = n ? n * 2 : 64;
+			ev_conn_t **r = realloc(ev->readers, cap * sizeof *r);
+			if (!r)
+				break; /* throttle among those gathered */
+			ev->readers = r;
+			ev->readers_cap = cap;
+		}
+		ev->readers[n++] = ec;
+	}
+	return n;
+}
+
+/*
+ * Memory budget, checked after every batch of events. While the
+ * connections of all loops hold more than shared->mem_budget bytes, the
+ * heaviest connections with a partial line stop being read, heaviest
+ * first, until what the others hold is under three quarters of the
+ * budget; TCP flow control then holds those clients back instead of
+ * their lines growing. Paused connections cannot grow, so they do not
+ * count against that mark, and conn_step() pauses any line at least as
+ * heavy as one already paused before reading it.
+ *
+ * At least one partial line is always read, since only a completed line
+ * frees memory. Below three quarters of the budget every paused
+ * connection resumes.
+ */
+static void budget_check(ev_loop_t *ev) {
+	uint64_t budget = ev->shared->mem_budget;
+	if (!budget)
+		return;
+
+	uint64_t used = atomic_load_explicit(&metrics.conn_buf_bytes,
+					     memory_order_relaxed);
+	if (used <= budget && !ev->npaused)
+		return;
+
+	uint64_t low = budget - budget / 4;
+	if (used <= low) {
+		for (ev_conn_t *ec = ev->conns; ec && ev->npaused; ec = ec->next)
+			if (ec->paused)
+				conn_resume(ev, ec);
+		ev->pause_floor = SIZE_MAX;
+		return;
+	}
+
+	uint64_t growing = used;
+	ev_conn_t *lightest = NULL;	/* paused */
+	for (ev_conn_t *ec = ev->conns; ec; ec = ec->next) {
+		if (!ec->paused)
+			continue;
+		growing -= ec->hc.buf_bytes < growing ? ec->hc.buf_bytes
+						      : growing;
+		if (!lightest || ec->hc.buf_bytes < lightest->hc.buf_bytes)
+			lightest = ec;
+	}
+
+	size_t n = collect_readers(ev);
+	if (used > budget && n > 1 && growing > low) {
+		qsort(ev->readers, n, sizeof *ev->readers, cmp_heavier);
+		for (size_t i = 0; i + 1 < n && growing > low; i++) {
+			size_t bytes = ev->readers[i]->hc.buf_bytes;
+			growing -= bytes < growing ? bytes : growing;
+			ev->pause_floor = bytes;
+			conn_pause(ev, ev->readers[i]);
+		}
+	}
+
+	/* Every partial line paused: let the lightest finish unhindered */
+	if (!n && lightest && lightest->sb.len) {
+		conn_resume(ev, lightest);
+		ev->pause_floor = SIZE_MAX;
+	}
+}
+
+static bool is_listener(ev_loop_t *ev, void *ptr) {
+	return ptr >= (void *)ev->listeners
+		&& ptr < (void *)(ev->listeners + ev->nlisteners);
+}
+
+int ev_run(int listen_fd, int coalesce_fd, int stop_fd, hc_shared_t *shared) {
+	int rc = -1;
+	ev_loop_t ev = { .epfd = -1, .shared = shared, .pause_floor = SIZE_MAX };
+
+	ev.listeners[ev.nlisteners++] = (ev_listener_t){ listen_fd, false };
+	if (coalesce_fd != -1)
+		ev.listeners[ev.nlisteners++] = (ev_listener_t){ coalesce_fd, true };
+
+	ev.epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (ev.epfd == -1) goto out;
+
+	/* Listener events point into ev.listeners, the rest at connections */
+	for (size_t i = 0; i < ev.nlisteners; i++) {
+		ev_listener_t *l = &ev.listeners[i];
+		int flags = fcntl(l->fd, F_GETFL);
+		if (flags == -1 || fcntl(l->fd, F_SETFL, flags | O_NONBLOCK) == -1)
+			goto out;
+
+		struct epoll_event le = { .events = EPOLLIN, .data.ptr = l };
+		if (epoll_ctl(ev.epfd, EPOLL_CTL_ADD, l->fd, &le) == -1)
+			goto out;
+	}
+
+	/* The stop fd is the one event with a NULL pointer */
+	struct epoll_event se = { .events = EPOLLIN, .data.ptr = NULL };
+	if (stop_fd != -1 && epoll_ctl(ev.epfd, EPOLL_CTL_ADD, stop_fd, &se) == -1)
+		goto out;
+
+	struct epoll_event events[EV_MAX_EVENTS];
+	while (!exit_requested) {
+		int n = epoll_wait(ev.epfd, events, EV_MAX_EVENTS,
+				   ev.npaused ? EV_THROTTLE_POLL_MS : -1);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			syslog(LOG_ERR, "epoll_wait failed: %s", strerror(errno));
+			goto out;
+		}
+
+		for (int i = 0; i < n; i++) {
+			void *ptr = events[i].data.ptr;
+			if (!ptr) goto stopped;
+			if (is_listener(&ev, ptr)) {
+				if (accept_all(&ev, ptr) == -1) goto out;
+				continue;
+			}
+			/* Errors and hangups surface through recv/send */
+			conn_step(&ev, ptr, events[i].events);
+		}
+		budget_check(&ev);
+	}
+
+stopped:
+	rc = 0;
+out:
+	while (ev.conns)
+		conn_close(&ev, ev.conns);
+	free(ev.readers);
+	if (ev.epfd != -1) close(ev.epfd);
+	return rc;
+}
@@ -0,0 +1,15 @@
+#ifndef __EVLOOP_H__
+#define __EVLOOP_H__
+
+#include "handleconn.h" /* hc_shared_t */
+
+/*
+ * Single-threaded event-driven server: every client socket is
+ * non-blocking and driven through hc_conn_step() from one epoll loop.
+ * Clients of coalesce_fd (-1 if none) get coalesced replies.
+ * Returns 0 when exit_requested or a readable stop_fd (-1 if none)
+ * stops the loop, -1 on a fatal error.
+ */
+int ev_run(int listen_fd, int coalesce_fd, int stop_fd, hc_shared_t *shared);
+
+#endif
@@ -0,0 +1,197 @@
+#include <stdio.h>   /* snprintf */
+#include <stdlib.h>  /* strtoull */
+#include <string.h>  /* strcmp, strncmp, strerror */
+#include <errno.h>   /* errno */
+#include <limits.h>  /* ULLONG_MAX */
+#include <syslog.h>  /* syslog */
+#include <time.h>    /* clock_gettime */
+
+#include "flusher.h"
+#include "bgthread.h"
+#include "metrics.h"
+
+static const struct {
+	const char *name;
+	fl_mode_t mode;
+} modes[] = {
+	{ "none",     FL_NONE },
+	{ "strict",   FL_STRICT },
+	{ "interval", FL_INTERVAL },
+	{ "packets",  FL_PACKETS },
+	{ "bytes",    FL_BYTES },
+};
+
+/* N with an optional K, M or G */
+static int parse_every(const char *arg, uint64_t *out) {
+	char *endp;
+	errno = 0;
+	unsigned long long v = strtoull(arg, &endp, 10);
+	if (errno || endp == arg || arg[0] == '-')
+		return -1;
+
+	unsigned shift = 0;
+	switch (*endp) {
+	case 'K': case 'k': shift = 10; endp++; break;
+	case 'M': case 'm': shift = 20; endp++; break;
+	case 'G': case 'g': shift = 30; endp++; break;
+	}
+	if (*endp || !v || v > (ULLONG_MAX >> shift))
+		return -1;
+	*out = v << shift;
+	return 0;
+}
+
+int fl_parse(const char *arg, fl_opts_t *opts) {
+	for (size_t i = 0; i < sizeof modes / sizeof modes[0]; i++) {
+		size_t n = strlen(modes[i].name);
+		if (strncmp(arg, modes[i].name, n))
+			continue;
+
+		fl_opts_t o = { .mode = modes[i].mode, .every = 0 };
+		bool counted = o.mode >= FL_INTERVAL;
+		if (counted ? arg[n] != ':' || parse_every(arg + n + 1,
+				&o.every) == -1 : arg[n] != '\0')
+			break;
+		*opts = o;
+		return 0;
+	}
+	errno = EINVAL;
+	return -1;
+}
+
+const char *fl_format(const fl_opts_t *opts, char *buf, size_t cap) {
+	const char *name = "?";
+	for (size_t i = 0; i < sizeof modes / sizeof modes[0]; i++) {
+		if (modes[i].mode == opts->mode)
+			name = modes[i].name;
+	}
+
+	if (opts->mode >= FL_INTERVAL)
+		snprintf(buf, cap, "%s:%llu", name,
+			 (unsigned long long)opts->every);
+	else
+		snprintf(buf, cap, "%s", name);
+	return buf;
+}
+
+/* One fdatasync covering at least the first seen pending units */
+static void sync_once(flusher_t *fl, uint64_t seen) {
+	if (store_sync(fl->store) == -1) {
+		metrics_inc(&metrics.sync_errors, 1);
+		syslog(LOG_ERR, "fdatasync of %s failed: %s", fl->store->path,
+		       strerror(errno));
+	}
+	metrics_inc(&metrics.syncs, 1);
+	atomic_fetch_sub_explicit(&fl->pending, seen, memory_order_relaxed);
+}
+
+static void deadline_in(struct timespec *ts, uint64_t ms) {
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	ts->tv_sec += (time_t)(ms / 1000);
+	ts->tv_nsec += (long)(ms % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+static uint64_t pending(flusher_t *fl) {
+	return atomic_load_explicit(&fl->pending, memory_order_relaxed);
+}
+
+static void *fl_main(void *arg) {
+	flusher_t *fl = arg;
+	struct timespec deadline;
+
+	pthread_mutex_lock(&fl->lock);
+	while (!fl->stop) {
+		if (fl->opts.mode == FL_INTERVAL) {
+			/* A tick with nothing new costs no syscall */
+			deadline_in(&deadline, fl->opts.every);
+			while (!fl->stop && pthread_cond_timedwait(&fl->wake,
+					&fl->lock, &deadline) != ETIMEDOUT) {}
+		} else {
+			/* fl_note() signals when pending reaches every */
+			while (!fl->stop && pending(fl) < fl->opts.every)
+				pthread_cond_wait(&fl->wake, &fl->lock);
+		}
+		if (fl->stop)
+			break;
+
+		uint64_t seen = pending(fl);
+		if (!seen)
+			continue;
+		pthread_mutex_unlock(&fl->lock);
+		sync_once(fl, seen);
+		pthread_mutex_lock(&fl->lock);
+	}
+	pthread_mutex_unlock(&fl->lock);
+	return NULL;
+}
+
+int fl_start(flusher_t *fl, store_t *store, const fl_opts_t *opts) {
+	fl->opts = *opts;
+	fl->store = store;
+	fl->stop = false;
+	fl->started = false;
+	atomic_store(&fl->pending, 0);
+
+	/* Strict syncs in the committer, and the memory ring has no file */
+	if (opts->mode < FL_INTERVAL || store->opts.ring_packets)
+		return 0;
+
+	if (bg_cond_init(&fl->wake) == -1)
+		return -1;
+	if ((errno = pthread_mutex_init(&fl->lock, NULL)) != 0) {
+		pthread_cond_destroy(&fl->wake);
+		return -1;
+	}
+
+	if (bg_spawn(&fl->tid, fl_main, fl) == -1) {
+		int err = errno;
+		pthread_mutex_destroy(&fl->lock);
+		pthread_cond_destroy(&fl->wake);
+		errno = err;
+		return -1;
+	}
+	fl->started = true;
+	return 0;
+}
+
+void fl_note(flusher_t *fl, size_t len) {
+	if (!fl->started)
+		return;
+
+	uint64_t n = fl->opts.mode == FL_BYTES ? len : 1;
+	uint64_t prev = atomic_fetch_add_explicit(&fl->pending, n,
+						  memory_order_relaxed);
+
+	/* Interval mode only needs to know there is something to sync */
+	if (fl->opts.mode == FL_INTERVAL || prev >= fl->opts.every
+			|| prev + n < fl->opts.every)
+		return;
+
+	pthread_mutex_lock(&fl->lock);
+	pthread_cond_signal(&fl->wake);
+	pthread_mutex_unlock(&fl->lock);
+}
+
+void fl_stop(flusher_t *fl) {
+	if (!fl->started)
+		return;
+
+	pthread_mutex_lock(&fl->lock);
+	fl->stop = true;
+	pthread_cond_signal(&fl->wake);
+	pthread_mutex_unlock(&fl->lock);
+	pthread_join(fl->tid, NULL);
+	fl->started = false;
+
+	/* Whatever came in since the last round */
+	uint64_t seen = pending(fl);
+	if (seen)
+		sync_once(fl, seen);
+
+	pthread_mutex_destroy(&fl->lock);
+	pthread_cond_destroy(&fl->wake);
+}
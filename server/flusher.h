@@ -0,0 +1,58 @@
+#ifndef __FLUSHER_H__
+#define __FLUSHER_H__
+
+#include <stdbool.h>   /* bool */
+#include <stddef.h>    /* size_t */
+#include <stdint.h>    /* uint64_t */
+#include <stdatomic.h> /* atomics */
+#include <pthread.h>   /* pthread_t, mutex, cond */
+
+#include "store.h" /* store_t */
+
+/*
+ * Durability modes. FL_STRICT syncs every group-committed batch before
+ * its replies go out (gc.sync). The others reply as soon as the bytes
+ * are written and leave fdatasync to a background thread: after every
+ * N milliseconds with new data, N packets or N bytes. FL_NONE leaves it
+ * to the kernel.
+ */
+typedef enum {
+	FL_NONE = 0,
+	FL_STRICT,
+	FL_INTERVAL,
+	FL_PACKETS,
+	FL_BYTES,
+} fl_mode_t;
+
+typedef struct {
+	fl_mode_t mode;
+	uint64_t every;		/* ms, packets or bytes; 0 for the others */
+} fl_opts_t;
+
+typedef struct {
+	fl_opts_t opts;
+	store_t *store;
+	atomic_uint_fast64_t pending;	/* packets or bytes since a sync */
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	bool stop;		/* guarded by lock */
+	bool started;
+	pthread_t tid;
+} flusher_t;
+
+/*
+ * "none", "strict", "interval:MS", "packets:N" or "bytes:N"; counts take
+ * a K, M or G suffix. -1 with errno = EINVAL on anything else.
+ */
+int fl_parse(const char *arg, fl_opts_t *opts);
+/* The mode back in fl_parse() syntax */
+const char *fl_format(const fl_opts_t *opts, char *buf, size_t cap);
+
+/* Starts the sync thread for the background modes, no-op otherwise */
+int fl_start(flusher_t *fl, store_t *store, const fl_opts_t *opts);
+/* One committed packet of len bytes, under the append lock */
+void fl_note(flusher_t *fl, size_t len);
+/* Final sync and join; safe to call when never started */
+void fl_stop(flusher_t *fl);
+
+#endif
@@ -0,0 +1,177 @@
+#define _GNU_SOURCE  /* IOV_MAX */
+#include <stdlib.h>  /* malloc, free */
+#include <string.h>  /* memcpy */
+#include <errno.h>   /* errno */
+#include <limits.h>  /* IOV_MAX */
+
+#include "aesd_config.h"
+#include "gcommit.h"
+
+struct gc_req {
+	const struct iovec *iov;
+	int iovcnt;
+	size_t len;
+	off_t end;		/* set on commit */
+	int err;		/* 0 or errno */
+	bool done;		/* guarded by gc->lock */
+	struct gc_req *next;
+};
+
+int gc_writev_all(int fd, struct iovec *iov, int iovcnt, size_t *written) {
+	*written = 0;
+
+	while (iovcnt > 0) {
+		int cnt = iovcnt > IOV_MAX ? IOV_MAX : iovcnt;
+		ssize_t n = writev(fd, iov, cnt);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		if (!n) { errno = EIO; return -1; }
+		*written += (size_t)n;
+
+		/* Skip what went out, then trim the first partial entry */
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= (ssize_t)iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= (size_t)n;
+		}
+	}
+
+	return 0;
+}
+
+int gc_init(gcommit_t *gc, pthread_mutex_t *file_lock, gc_write_fn write,
+		gc_commit_fn committed, void *arg) {
+	gc->sync = false;
+	gc->file_lock = file_lock;
+	gc->write = write;
+	gc->committed = committed;
+	gc->arg = arg;
+	gc->head = NULL;
+	gc->tail = NULL;
+	gc->flushing = false;
+
+	gc->iov = malloc(GC_MAX_IOV * sizeof *gc->iov);
+	if (!gc->iov) return -1;
+
+	if ((errno = pthread_mutex_init(&gc->lock, NULL)) != 0) {
+		free(gc->iov);
+		gc->iov = NULL;
+		return -1;
+	}
+	if ((errno = pthread_cond_init(&gc->done_cv, NULL)) != 0) {
+		pthread_mutex_destroy(&gc->lock);
+		free(gc->iov);
+		gc->iov = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+void gc_destroy(gcommit_t *gc) {
+	if (!gc->iov) return;
+	pthread_cond_destroy(&gc->done_cv);
+	pthread_mutex_destroy(&gc->lock);
+	free(gc->iov);
+	gc->iov = NULL;
+}
+
+/* Detach the longest prefix of the queue that fits one gather list */
+static gc_req_t *take_batch(gcommit_t *gc) {
+	gc_req_t *first = gc->head, *last = NULL;
+	int iovcnt = 0;
+
+	for (gc_req_t *r = first; r; r = r->next) {
+		if (last && iovcnt + r->iovcnt > GC_MAX_IOV)
+			break;
+		iovcnt += r->iovcnt;
+		last = r;
+	}
+
+	gc->head = last->next;
+	if (!gc->head) gc->tail = NULL;
+	last->next = NULL;
+	return first;
+}
+
+/* Runs without gc->lock; only one committer at a time */
+static void flush_batch(gcommit_t *gc, gc_req_t *batch) {
+	int iovcnt = 0;
+	for (gc_req_t *r = batch; r; r = r->next) {
+		memcpy(gc->iov + iovcnt, r->iov, r->iovcnt * sizeof *r->iov);
+		iovcnt += r->iovcnt;
+	}
+
+	pthread_mutex_lock(gc->file_lock);
+
+	size_t written = 0;
+	int err = 0;
+	if (gc->write(gc->arg, gc->iov, iovcnt, gc->sync, &written) == -1)
+		err = errno;
+
+	/*
+	 * Packets wholly in the file are committed (and carry the error of
+	 * a failed fdatasync, if any); a packet cut short or never reached
+	 * failed.
+	 */
+	size_t at = 0;
+	for (gc_req_t *r = batch; r; r = r->next) {
+		if (at + r->len <= written) {
+			r->end = gc->committed(gc->arg, r->iov, r->iovcnt, r->len);
+			r->err = err;
+		} else {
+			r->err = err ? err : EIO;
+		}
+		at += r->len;
+	}
+
+	pthread_mutex_unlock(gc->file_lock);
+}
+
+int gc_append(gcommit_t *gc, const struct iovec *iov, int iovcnt,
+		size_t len, off_t *end) {
+	if (iovcnt < 1 || iovcnt > GC_MAX_IOV) { errno = EINVAL; return -1; }
+
+	gc_req_t req = { .iov = iov, .iovcnt = iovcnt, .len = len };
+
+	pthread_mutex_lock(&gc->lock);
+	if (gc->tail) gc->tail->next = &req;
+	else gc->head = &req;
+	gc->tail = &req;
+
+	while (!req.done) {
+		if (gc->flushing) {
+			pthread_cond_wait(&gc->done_cv, &gc->lock);
+			continue;
+		}
+
+		/* Become the committer for everything queued so far */
+		gc->flushing = true;
+		gc_req_t *batch = take_batch(gc);
+		pthread_mutex_unlock(&gc->lock);
+
+		flush_batch(gc, batch);
+
+		pthread_mutex_lock(&gc->lock);
+		/* A waiter may return as soon as it sees done; read next first */
+		for (gc_req_t *r = batch, *next; r; r = next) {
+			next = r->next;
+			r->done = true;
+		}
+		gc->flushing = false;
+		pthread_cond_broadcast(&gc->done_cv);
+	}
+	pthread_mutex_unlock(&gc->lock);
+
+	if (req.err) {
+		errno = req.err;
+		return -1;
+	}
+	*end = req.end;
+	return 0;
+}
@@ -0,0 +1,72 @@
+#ifndef __GCOMMIT_H__
+#define __GCOMMIT_H__
+
+#include <stdbool.h>   /* bool */
+#include <stddef.h>    /* size_t */
+#include <pthread.h>   /* pthread_mutex_t, pthread_cond_t */
+#include <sys/types.h> /* off_t */
+#include <sys/uio.h>   /* struct iovec */
+
+/*
+ * Group commit for the data store. Every appender queues its packet and
+ * waits; whichever waiter finds no flush in progress becomes the
+ * committer, takes the whole queue (in arrival order) and hands it to the
+ * write callback as one gather list - one writev(), plus one fdatasync()
+ * when sync is set - on behalf of everyone. Uncontended, a batch is just
+ * the caller's own packet.
+ *
+ * Packets are written from the appenders' own buffers, which stay valid
+ * because each appender blocks until its packet is committed.
+ */
+
+/*
+ * Called by the committer while holding *file_lock. write puts a batch
+ * at the end of the file (0, or -1 with errno; *written counts what made
+ * it either way). committed is then called for each packet of it that
+ * was written whole, in file order, and returns the end offset after
+ * that packet.
+ */
+typedef int (*gc_write_fn)(void *arg, struct iovec *iov, int iovcnt,
+		bool sync, size_t *written);
+typedef off_t (*gc_commit_fn)(void *arg, const struct iovec *iov, int iovcnt,
+		size_t len);
+
+typedef struct gc_req gc_req_t;
+
+typedef struct {
+	bool sync;			/* fdatasync every batch */
+	pthread_mutex_t *file_lock;	/* shared with other file writers */
+	gc_write_fn write;
+	gc_commit_fn committed;
+	void *arg;
+
+	pthread_mutex_t lock;		/* guards the fields below */
+	pthread_cond_t done_cv;
+	gc_req_t *head;
+	gc_req_t *tail;
+	bool flushing;
+
+	struct iovec *iov;		/* committer's gather list */
+} gcommit_t;
+
+int gc_init(gcommit_t *gc, pthread_mutex_t *file_lock, gc_write_fn write,
+		gc_commit_fn committed, void *arg);
+void gc_destroy(gcommit_t *gc);
+
+/*
+ * Append len bytes described by iov (at most GC_MAX_IOV entries) and
+ * return once they are in the file, with *end = file size after them.
+ * Returns -1 with errno set if the write (or the batch fdatasync)
+ * failed; errno = EIO if the file stopped accepting data.
+ */
+int gc_append(gcommit_t *gc, const struct iovec *iov, int iovcnt,
+		size_t len, off_t *end);
+
+/*
+ * Resume-on-partial writev(). Returns 0 once everything is written, -1
+ * otherwise; *written counts the bytes that made it either way. iov is
+ * consumed in place.
+ */
+int gc_writev_all(int fd, struct iovec *iov, int iovcnt, size_t *written);
+
+#endif
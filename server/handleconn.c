@@ -1,156 +1,297 @@
+#define _GNU_SOURCE /* memmem */
 #include "handleconn.h"
+#include "metrics.h"
+#include "alog.h"
+#include "uring.h"
 
 extern volatile sig_atomic_t exit_requested;
 
-/* 
- * Returns 0 on success, -1 on failure, errno = EIO on short write
- */
-static ssize_t write_all(int fd, const void *buf, size_t len) {
-	if (fd < 0 || !buf) { errno = EINVAL; return -1; }
-	if ((ssize_t)len > SSIZE_MAX) { errno = EINVAL; return -1; }
-
-	const char *p = buf;
-	ssize_t n = write(fd, p, len);
-	if (n == (ssize_t)len) return 0; /* Success */
-
-	/* Try again on EINTR */
-	else if (n == -1 && errno == EINTR) {
-		for(;;) {
-			n = write(fd, p, len);
-			if (n == -1) {
-				if (errno == EINTR) continue;
-				else return -1;
-			}
-			if (n == (ssize_t)len)
-				return 0;
-			if (n > 0 && n < (ssize_t)len)
-				goto short_write;
-		}
-	} else if (n == -1) {
-		return -1;
-	} else if (n < (ssize_t)len) {
-		goto short_write;
-	}
+static hc_step_t conn_fail(hc_conn_t *c, hc_op_t op, hc_err_t err,
+		size_t intended) {
+	c->res.outcome = HC_OUTCOME_ERROR;
+	c->res.op = op;
+	c->res.err = err;
+	c->res.sys_errno = errno;
+	c->res.intended = intended;
+	return HC_STEP_DONE;
+}
+
+/* Moving average over roughly the last 8 samples */
+static inline size_t ewma(size_t avg, size_t sample) {
+	if (!avg) return sample;
+	return avg - avg / 8 + sample / 8;
+}
+
+static inline bool packet_fits(size_t sb_len, size_t seg_len, size_t max_packet) {
+	return seg_len <= max_packet && sb_len <= max_packet - seg_len;
+}
+
+static void mirror_follow(hc_shared_t *shared, const struct iovec *iov,
+		int iovcnt) {
+	if (mirror_append(&shared->mirror, iov, iovcnt) == -1)
+		syslog(LOG_WARNING, "data store outgrew the %zu byte memory "
+		       "mirror, replies now read the files",
+		       shared->mirror.ceiling);
+}
+
+off_t hc_packet_committed(hc_shared_t *shared, const struct iovec *iov,
+		int iovcnt, size_t len) {
+	off_t end = store_commit(shared->store, iov, iovcnt, len);
+	mirror_follow(shared, iov, iovcnt);
+	fl_note(&shared->fl, len);
+	return end;
+}
 
-short_write:
-	errno = EIO;
-	return -1;
+/* Group committer callbacks, under append_lock */
+static int batch_write(void *arg, struct iovec *iov, int iovcnt, bool sync,
+		size_t *written) {
+	hc_shared_t *shared = arg;
+	if (sync && !shared->store->opts.ring_packets)
+		metrics_inc(&metrics.syncs, 1);
+	return store_write(shared->store, iov, iovcnt, sync, written);
 }
 
-static int send_all(int fd, char *buf, size_t len) {
-	ssize_t n;
-	size_t bytes_written;
-	size_t remaining;
-	if (fd == -1 || !buf)
+static off_t packet_committed(void *arg, const struct iovec *iov, int iovcnt,
+		size_t len) {
+	return hc_packet_committed(arg, iov, iovcnt, len);
+}
+
+/* Mirror whatever the store already holds, oldest segment first */
+static int mirror_load_store(mirror_t *m, size_t ceiling, store_t *st) {
+	/* The packet ring already is in memory */
+	if (st->opts.ring_packets)
+		return mirror_init(m, 0, 0, 0);
+
+	if (mirror_init(m, ceiling, st->head->start,
+			st->end - st->head->start) == -1)
 		return -1;
 
-	bytes_written = 0;
-	remaining = len - bytes_written;
-	size_t min;
-	while (remaining > 0) {
-		if (remaining < WRITE_CHUNK_SZ)
-			min = remaining;
-		else
-			min = WRITE_CHUNK_SZ;
+	for (store_seg_t *seg = st->head; seg;
+			seg = atomic_load(&seg->next)) {
+		if (mirror_load(m, seg->fd, seg->size) == -1)
+			return -1;
+	}
+	return 0;
+}
 
-		n = write(fd, buf + bytes_written, min);
-		if (n > 0) {
-			bytes_written += n;
-			remaining -= n;
-		} else if (n == -1 && errno == EINTR) {
-			continue;
-		} else if (n == -1 && (errno == EPIPE
-				|| errno == ECONNRESET)) {
-			return 0;
-		} else if (n == -1) {
-			return EXIT_ERROR;
-		}
+int hc_shared_init(hc_shared_t *shared, store_t *store, size_t mirror_max) {
+	shared->store = store;
+	shared->use_uring = false;
+	shared->max_packet = MAX_PACKET;
+	shared->recv_buf_sz = RECV_BUF_SZ;
+	shared->write_chunk = WRITE_CHUNK_SZ;
+	shared->mem_budget = 0;
+	shared->fl.started = false;
+	if (mirror_load_store(&shared->mirror, mirror_max, store) == -1)
+		return -1;
 
+	if ((errno = pthread_mutex_init(&shared->append_lock, NULL)) != 0) {
+		mirror_free(&shared->mirror);
+		return -1;
+	}
+
+	if (gc_init(&shared->gc, &shared->append_lock, batch_write,
+			packet_committed, shared) == -1) {
+		pthread_mutex_destroy(&shared->append_lock);
+		mirror_free(&shared->mirror);
+		return -1;
 	}
 
+	if (bp_init(&shared->pool, BUFPOOL_MAX_CACHED) == -1) {
+		gc_destroy(&shared->gc);
+		pthread_mutex_destroy(&shared->append_lock);
+		mirror_free(&shared->mirror);
+		return -1;
+	}
 	return 0;
 }
 
-static int send_file_to_client(int send_fd, const char *path) {
-	int fd = open(path, O_RDONLY | O_CLOEXEC);
-	if (fd == -1) return -1;
+void hc_shared_destroy(hc_shared_t *shared) {
+	fl_stop(&shared->fl);
+
+	bp_stats_t st;
+	bp_get_stats(&shared->pool, &st);
+	syslog(LOG_INFO, "buffer pool: %llu hits, %llu misses, %llu reused, "
+	       "%llu freed, %zu bytes cached",
+	       (unsigned long long)st.hits, (unsigned long long)st.misses,
+	       (unsigned long long)st.releases, (unsigned long long)st.drops,
+	       st.cached_bytes);
+	bp_destroy(&shared->pool);
+
+	gc_destroy(&shared->gc);
+	mirror_free(&shared->mirror);
+	pthread_mutex_destroy(&shared->append_lock);
+}
 
-	char buf[8192];
-	for (;;) {
-		ssize_t n = read(fd, buf, sizeof buf);
-		if (!n)	break; /* EOF */
-		if (n < 0) {
-			if (errno == EINTR) continue;
-			close(fd);
-			return -1;
-		}
+int hc_bufs_init(hc_bufs_t *bufs, hc_shared_t *shared) {
+	bufpool_t *pool = &shared->pool;
+	bufs->recv_buf = NULL;
+	bufs->pool = pool;
+	bufs->ring = NULL;
 
-		if (send_all(send_fd, buf, (size_t)n) == -1) {
-			close(fd);
-			return -1;
-		}
+	/* The line builder allocates on the first partial line */
+	sb_init_pool(&bufs->sb, pool, 0, shared->max_packet);
+
+	bufs->recv_buf = bp_get(pool, shared->recv_buf_sz, &bufs->recv_cap);
+	if (!bufs->recv_buf) {
+		hc_bufs_free(bufs);
+		return -1;
 	}
 
-	close(fd);
 	return 0;
 }
 
-/* All pointers must be initialised and not NULL */
-static void discard_mode(bool *discard, char *newline, char *position, char *end, size_t *rem) {
-	if (!newline) {
-		/* 
-		 * Still no new line,
-		 * keep discarding
-		 */
-		position = end;
-		*rem = 0;
-	} else {
-		position = newline + 1;
-		*rem = end - position;
-		*discard = false;
+/* Idempotent free */
+void hc_bufs_free(hc_bufs_t *bufs) {
+	ur_destroy(bufs->ring);
+	bufs->ring = NULL;
+	sb_free(&bufs->sb);
+	bp_put(bufs->pool, bufs->recv_buf, bufs->recv_cap);
+	bufs->recv_buf = NULL;
+}
+
+/* Drop the pending line; a builder grown by a large one goes back to base */
+static void pending_reset(StringBuilder *sb) {
+	sb->len = 0;
+	if (sb->cap > SB_TRIM_ABOVE)
+		sb_trim(sb, SB_BASE_CAP);
+}
+
+void hc_log_result(const char *peer_ip, const hc_result_t *res) {
+	if (res->outcome != HC_OUTCOME_ERROR)
+		return;
+
+	switch (res->op) {
+	case HC_OP_RECV:
+		alog(ALOG_RECV_FAILED, peer_ip, res->sys_errno, 0);
+		break;
+	case HC_OP_APPEND:
+		if (res->err == HC_ERR_SHORT_WRITE)
+			alog(ALOG_SHORT_WRITE, peer_ip, 0, res->intended);
+		else
+			alog(ALOG_APPEND_FAILED, peer_ip, res->sys_errno,
+			     res->intended);
+		break;
+	case HC_OP_SEND:
+		alog(ALOG_SEND_FAILED, peer_ip, res->sys_errno, 0);
+		break;
+	default:
+		alog(ALOG_CONN_ERROR, peer_ip, res->sys_errno, 0);
 	}
 }
 
-static inline bool packet_fits(size_t sb_len, size_t seg_len, size_t max_packet) {
-	return (sb_len <= max_packet - seg_len);
+/* Index the next stretch of rbuf; false once all of it is indexed */
+static bool index_more(hc_conn_t *c) {
+	if (c->nl_done >= c->rlen)
+		return false;
+
+	size_t scanned;
+	c->nl_base = c->nl_done;
+	c->nl_cnt = nl_scan(c->rbuf + c->nl_base, c->rlen - c->nl_base,
+			    c->nl, NL_BATCH, &scanned);
+	c->nl_pos = 0;
+	c->nl_done += scanned;
+	return true;
 }
 
-static int assemble_packet(char *scratch, size_t scratch_cap, const char *prefix, size_t pre_len, const char *seg, size_t seg_len, size_t *out_len) {
-	if (pre_len > scratch_cap - seg_len) { errno = EOVERFLOW; return -1; }
+/* First newline at or after rpos, NULL if the buffer has none */
+static char *next_nl(hc_conn_t *c) {
+	do {
+		for (; c->nl_pos < c->nl_cnt; c->nl_pos++) {
+			size_t at = c->nl_base + c->nl[c->nl_pos];
+			if (at >= c->rpos)
+				return c->rbuf + at;
+		}
+	} while (index_more(c));
 
-	memcpy(scratch, prefix, pre_len);
-	memcpy(scratch + pre_len, seg, seg_len);
-	*out_len = pre_len + seg_len;
-	return 0;
+	return NULL;
+}
+
+/* Last newline in the buffer; only after next_nl() found one */
+static char *last_nl(hc_conn_t *c) {
+	char *last;
+	do {
+		last = c->rbuf + c->nl_base + c->nl[c->nl_cnt - 1];
+	} while (index_more(c) && c->nl_cnt);
+
+	return last;
+}
+
+/* Longest seek command: the prefix, two 20-digit numbers, ',' and '\n' */
+#define SEEKTO_MAX_LEN (sizeof SEEKTO_CMD - 1 + 2 * 20 + 2)
+
+/* Unsigned decimal at *p up to stop, which must come next */
+static bool parse_u64(const char **p, char stop, uint64_t *v) {
+	const char *s = *p;
+	uint64_t n = 0;
+
+	if (*s < '0' || *s > '9') return false;
+	for (; *s >= '0' && *s <= '9'; s++) {
+		if (n > (UINT64_MAX - (uint64_t)(*s - '0')) / 10) return false;
+		n = n * 10 + (uint64_t)(*s - '0');
+	}
+	if (*s != stop) return false;
+
+	*p = s + 1;
+	*v = n;
+	return true;
 }
 
-int handle_connection(int fd, int write_fd, StringBuilder *sb, 
-		char *scratch, hc_result_t *res) {
+/* Is the packet "AESDCHAR_IOCSEEKTO:X,Y\n" rather than data? */
+static bool parse_seekto(const struct iovec *iov, int iovcnt, size_t len,
+		uint64_t *cmd, uint64_t *in) {
+	char buf[SEEKTO_MAX_LEN];
+	size_t n = 0;
+
+	if (len > sizeof buf || len < sizeof SEEKTO_CMD)
+		return false;
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(buf + n, iov[i].iov_base, iov[i].iov_len);
+		n += iov[i].iov_len;
+	}
+	if (memcmp(buf, SEEKTO_CMD, sizeof SEEKTO_CMD - 1))
+		return false;
+
+	const char *p = buf + sizeof SEEKTO_CMD - 1;
+	return parse_u64(&p, ',', cmd) && parse_u64(&p, '\n', in);
+}
+
+/*
+ * Frame and handle the buffered input until it is used up or a reply
+ * cannot be sent without blocking. Returns HC_STEP_READ when more input
+ * is needed.
+ */
+static hc_step_t process_input(hc_conn_t *c, hc_shared_t *shared) {
+	StringBuilder *sb = c->sb;
+	size_t max_packet = shared->max_packet;
 	int rc;
-	char recv_buf[RECV_BUF_SZ];
-	ssize_t bytes_received;
-	sb->len = 0; // Reset the pending buf per conn. Consider realloc
-	bool discard = false;
-	while (1) {
-		bytes_received = recv(fd, recv_buf, RECV_BUF_SZ, 0);
-		if (bytes_received == -1) {
-			if (errno == EINTR) continue;
-			res->outcome = HC_OUTCOME_ERROR;
-			res->op = HC_OP_RECV;
-			res->sys_errno = errno;
-			return EXIT_ERROR;
-		} else if ((bytes_received == 0) || exit_requested) {
-			/* Connection closed by peer/signal */
-			sb->len = 0;
-			res->outcome = HC_OUTCOME_CLOSED;
-			return 0;
-		} 
 
-		size_t bytes_len = (size_t)bytes_received;
+	c->reply.xfer.chunk = shared->write_chunk;
+	for (;;) {
+		if (c->reply.active) {
+			/* Straight from memory unless the mirror fell behind */
+			if (mirror_covers(&shared->mirror, c->reply.off,
+					c->reply.end))
+				rc = mirror_send(&shared->mirror, c->fd,
+						 &c->reply.off, c->reply.end,
+						 &c->res.transferred);
+			else
+				rc = store_send(&c->reply.snap, &c->reply.xfer,
+						c->fd, &c->reply.off,
+						&c->res.transferred);
+			if (rc == 1) return HC_STEP_WRITE;
+			if (rc == -1)
+				return conn_fail(c, HC_OP_SEND, HC_ERR_IO, 0);
+			store_snap_release(&c->reply.snap);
+			c->reply.active = false;
+			lat_since(LAT_REPLY, c->reply.started);
+		}
+
+		if (c->rpos >= c->rlen)
+			return HC_STEP_READ;
 
-		char *pos = recv_buf;
-		char *end = recv_buf + bytes_len;
-		size_t remaining = bytes_len;
+		char *pos = c->rbuf + c->rpos;
+		size_t remaining = c->rlen - c->rpos;
 
 		/*
 		 * Three valid states:
@@ -158,112 +299,288 @@ int handle_connection(int fd, int write_fd, StringBuilder *sb,
 		 * 2: Normal mode - newline found.
 		 * 3: Normal mode - newline not found.
 		 */
-		while (remaining > 0) {
-			/* Check for newline in buffer */
-			char *nl = memchr(pos, '\n', remaining);
+		char *nl = next_nl(c);
 
-			/* Discard mode */
-			if (discard) {
-				discard_mode(&discard, nl, pos, end, &remaining);
+		/* Discard mode - drop up to and including the next newline */
+		if (c->discard) {
+			if (!nl) {
+				c->rpos = c->rlen;
+			} else {
+				c->rpos += (size_t)(nl - pos) + 1;
+				c->discard = false;
 			}
+			continue;
+		}
 
-			/* Normal mode - newline found */
-			if (nl) {
-				size_t seg_len = (nl - pos) + 1;
+		/* Normal mode - newline found */
+		if (nl) {
+			size_t seg_len = (nl - pos) + 1;
 
-				/* Avoid overflow */
-				if (!packet_fits(sb->len, seg_len, MAX_PACKET)) {
-					sb->len = 0;
-					pos += seg_len;
-					remaining = (size_t)(end - pos);
-					continue;
-				}
+			/* Avoid overflow */
+			if (!packet_fits(sb->len, seg_len, max_packet)) {
+				pending_reset(sb);
+				c->rpos += seg_len;
+				c->res.packets_dropped_oversize++;
+				continue;
+			}
 
-				size_t packet_len = 0;
-				if (assemble_packet(scratch, 
-						    MAX_PACKET, 
-						    sb->str, 
-						    sb->len,
-						    pos, 
-						    seg_len, 
-						    &packet_len) == -1) {
-					res->outcome = HC_OUTCOME_ERROR;
-					/* TODO: add op and error */
-					res->sys_errno = errno;
-					return EXIT_ERROR;
-				}
+			/* Pending prefix and this segment, written in place */
+			struct iovec iov[HC_PACKET_IOV];
+			int iovcnt = 0;
+			if (sb->len)
+				iov[iovcnt++] = (struct iovec){ sb->str, sb->len };
+			iov[iovcnt++] = (struct iovec){ pos, seg_len };
+			size_t packet_len = sb->len + seg_len;
+			c->line_avg = ewma(c->line_avg, packet_len);
+
+			/* A seek is answered from the store, never appended */
+			uint64_t cmd, in;
+			if (parse_seekto(iov, iovcnt, packet_len, &cmd, &in)) {
+				pending_reset(sb);
+				c->rpos += seg_len;
+				c->reply.started = lat_now();
+				if (store_seek(shared->store, cmd, in,
+						&c->reply.snap, &c->reply.off,
+						&c->reply.end) == 0)
+					c->reply.active = true;
+				continue;
+			}
 
-				if (write_all(write_fd, scratch, packet_len) 
-							== -1) {
-					if (errno == EIO) {
-						res->outcome = HC_OUTCOME_ERROR;
-						res->op = HC_OP_APPEND;
-						res->err = HC_ERR_SHORT_WRITE;
-						res->sys_errno = errno;
-						res->intended = packet_len;
-						return EXIT_ERROR;
-					} else {
-						res->outcome = HC_OUTCOME_ERROR;
-						res->op = HC_OP_APPEND;
-						res->err = HC_ERR_IO;
-						res->sys_errno = errno;
-						res->intended = packet_len;
-						return EXIT_ERROR;
-					} 
+			/*
+			 * Coalescing: take every complete line left in the
+			 * buffer too, up to a seek command. Those are shorter
+			 * than the buffer, so only the first line can be
+			 * oversize, unless the buffer is larger than a packet.
+			 */
+			if (c->coalesce && seg_len < remaining
+					&& remaining <= max_packet) {
+				seg_len = (size_t)(last_nl(c) - pos) + 1;
+				char *seek = memmem(pos, seg_len - 1,
+						    "\n" SEEKTO_CMD,
+						    sizeof SEEKTO_CMD);
+				if (seek) {
+					seg_len = (size_t)(seek - pos) + 1;
+					/* Index again from the seek on */
+					c->nl_done = c->rpos + seg_len;
+					c->nl_cnt = c->nl_pos = 0;
 				}
+				iov[iovcnt - 1].iov_len = seg_len;
+				packet_len = sb->len + seg_len;
+			}
 
-				if (send_file_to_client(fd, 
-							AESD_DATA_PATH) == -1) {
-					res->outcome = HC_OUTCOME_ERROR;
-					res->op = HC_OP_SEND;
-					res->err = HC_ERR_IO;
-					res->sys_errno = errno;
-					return EXIT_ERROR;
+			/* Append and whole reply as one linked submission */
+			if (c->ring) {
+				hc_op_t op;
+				lat_ts_t t0 = lat_now();
+				int urc = ur_append_and_reply(c->ring, c, shared,
+						iov, iovcnt, packet_len, &op);
+				lat_since(LAT_APPEND, t0);
+				pending_reset(sb);
+				c->rpos += seg_len;
+				if (urc == 0)
+					c->res.packets_written++;
+				if (urc == -1) {
+					return conn_fail(c, op,
+						op == HC_OP_APPEND && errno == EIO
+							? HC_ERR_SHORT_WRITE
+							: HC_ERR_IO,
+						packet_len);
 				}
+				continue;
+			}
 
-				sb->len = 0;
-				pos += seg_len;
-				remaining = (size_t)(end - pos);
+			/* Returns once our packet is committed, maybe in a batch */
+			off_t end;
+			lat_ts_t t0 = lat_now();
+			if (gc_append(&shared->gc, iov, iovcnt, packet_len,
+					&end) == -1) {
+				return conn_fail(c, HC_OP_APPEND,
+					errno == EIO ? HC_ERR_SHORT_WRITE
+						     : HC_ERR_IO,
+					packet_len);
+			}
 
-			/* Normal mode - newline not found */
-			} else {
-				size_t chunk_len = remaining;
+			lat_since(LAT_APPEND, t0);
+			pending_reset(sb);
+			c->rpos += seg_len;
+			c->res.packets_written++;
+
+			/* Reply with the retained window up to our append */
+			c->reply.active = true;
+			c->reply.started = lat_now();
+			c->reply.end = end;
+			store_snapshot(shared->store, end, &c->reply.snap,
+				       &c->reply.off);
+
+		/* Normal mode - newline not found */
+		} else {
+			size_t chunk_len = remaining;
+			c->rpos = c->rlen;
+
+			if (chunk_len > max_packet
+					|| sb->len > max_packet - chunk_len) {
+				c->discard = true;
+				c->res.packets_dropped_oversize++;
+				pending_reset(sb);
+				continue;
+			}
 
-				if (sb->len > MAX_PACKET - chunk_len) {
-					discard = true;
-					sb->len = 0;
-					pos = end;
-					remaining = 0;
+			/*
+			 * No newline, stash in pending. A builder that has to
+			 * grow goes straight to the usual packet size.
+			 */
+			size_t need = sb->len + chunk_len;
+			if (need > sb->cap && need < c->line_avg)
+				need = c->line_avg < max_packet - 1
+					? c->line_avg : max_packet - 1;
+			rc = sb_reserve(sb, need, max_packet - 1);
+			if (rc == -1) {
+				if (errno == EOVERFLOW) {
+					c->discard = true;
+					c->res.packets_dropped_oversize++;
+					pending_reset(sb);
 					continue;
 				}
+				return conn_fail(c, HC_OP_NONE,
+						 HC_ERR_ALLOC, 0);
+			}
 
-				/* No newline, stash in pending */
-				rc = sb_reserve(sb, sb->len + chunk_len, 
-						MAX_PACKET - 1);
-				if (rc == -1) {
-					if (errno == EOVERFLOW) {
-						discard = true;
-						sb->len = 0;
-						pos = end;
-						remaining = 0;
-						continue;
-					} else {
-						res->outcome = HC_OUTCOME_ERROR;
-						res->op = HC_OP_NONE;
-						res->err = HC_ERR_ALLOC;
-						res->sys_errno = errno;
-						return EXIT_ERROR;
-					}
-				}
+			memcpy(sb->str + sb->len, pos, chunk_len);
+			sb->len += chunk_len;
+		}
+	}
+}
 
-				memcpy(sb->str + sb->len, pos, chunk_len);
-				pos = end;
-				remaining = 0;
-				sb->len += chunk_len;
-			}
+void hc_conn_init(hc_conn_t *c, int fd, StringBuilder *sb, char *rbuf,
+		size_t rbuf_cap) {
+	*c = (hc_conn_t){0};
+	c->fd = fd;
+	c->sb = sb;
+	c->rbuf = rbuf;
+	c->rbuf_cap = rbuf_cap;
+	reply_xfer_init(&c->reply.xfer);
+	sb->len = 0;
+
+	c->open = true;
+	metrics_inc(&metrics.conns_active, 1);
+	hc_conn_account(c);
+}
+
+/* Idempotent */
+void hc_conn_release(hc_conn_t *c) {
+	if (c->open) {
+		metrics_add_result(&c->res, &c->reported);
+		if (c->res.outcome == HC_OUTCOME_ERROR)
+			metrics_add_error(&c->res);
+		atomic_fetch_sub_explicit(&metrics.conns_active, 1,
+					  memory_order_relaxed);
+		atomic_fetch_sub_explicit(&metrics.conn_buf_bytes,
+					  c->buf_bytes, memory_order_relaxed);
+		c->buf_bytes = 0;
+		c->open = false;
+	}
+
+	store_snap_release(&c->reply.snap);
+	reply_xfer_release(&c->reply.xfer);
+	c->reply.active = false;
+	pending_reset(c->sb);
+}
+
+bool hc_conn_idle(const hc_conn_t *c) {
+	return c->rpos >= c->rlen && !c->sb->len && !c->reply.active;
+}
+
+size_t hc_recv_want(const hc_conn_t *c, size_t max) {
+	/* A coalescing client's batch is what one recv() returns */
+	if (c->coalesce) return max;
+
+	size_t want = c->recv_full ? c->rbuf_cap * 2 : c->recv_avg * 2;
+	if (want < RECV_BUF_MIN) want = RECV_BUF_MIN;
+	return want < max ? want : max;
+}
+
+void hc_conn_set_rbuf(hc_conn_t *c, char *rbuf, size_t rbuf_cap) {
+	c->rbuf = rbuf;
+	c->rbuf_cap = rbuf_cap;
+	c->rpos = c->rlen = 0;
+	c->nl_pos = c->nl_cnt = c->nl_done = 0;
+}
+
+void hc_conn_account(hc_conn_t *c) {
+	size_t now = c->rbuf_cap + c->sb->cap;
+	if (now == c->buf_bytes || !c->open)
+		return;
+
+	if (now > c->buf_bytes) {
+		metrics_inc(&metrics.conn_buf_bytes, now - c->buf_bytes);
+		metrics_max(&metrics.conn_buf_peak, now);
+	} else {
+		atomic_fetch_sub_explicit(&metrics.conn_buf_bytes,
+					  c->buf_bytes - now,
+					  memory_order_relaxed);
+	}
+	c->buf_bytes = now;
+}
+
+/* One step, buffer accounting aside */
+static hc_step_t conn_step(hc_conn_t *c, hc_shared_t *shared) {
+	unsigned budget = HC_STEP_RECV_BUDGET;
+
+	for (;;) {
+		hc_step_t st = process_input(c, shared);
+
+		/* Publish once per received batch, not per packet */
+		metrics_add_result(&c->res, &c->reported);
+		if (st != HC_STEP_READ)
+			return st;
+
+		/* Let other connections run; level-triggered callers come back */
+		if (!budget--)
+			return HC_STEP_READ;
+
+		lat_ts_t t0 = lat_now();
+		ssize_t n = c->ring ? ur_recv(c->ring, c->rbuf, c->rbuf_cap)
+				    : recv(c->fd, c->rbuf, c->rbuf_cap, 0);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return HC_STEP_READ;
+			return conn_fail(c, HC_OP_RECV, HC_ERR_NONE, 0);
+		} else if ((n == 0) || exit_requested) {
+			/* Connection closed by peer/signal */
+			c->sb->len = 0;
+			c->res.outcome = HC_OUTCOME_CLOSED;
+			return HC_STEP_DONE;
 		}
+
+		lat_since(LAT_RECV, t0);
+		c->recv_avg = ewma(c->recv_avg, (size_t)n);
+		c->recv_full = (size_t)n == c->rbuf_cap;
+		c->rpos = 0;
+		c->rlen = (size_t)n;
+		c->res.received += (size_t)n;
+		c->nl_pos = c->nl_cnt = c->nl_done = 0;
 	}
+}
 
-	return 0;
+hc_step_t hc_conn_step(hc_conn_t *c, hc_shared_t *shared) {
+	hc_step_t st = conn_step(c, shared);
+	hc_conn_account(c);
+	return st;
 }
 
+int handle_connection(int fd, hc_shared_t *shared, hc_bufs_t *bufs,
+		bool coalesce, hc_result_t *res) {
+	hc_conn_t c;
+	hc_conn_init(&c, fd, &bufs->sb, bufs->recv_buf, bufs->recv_cap);
+	c.coalesce = coalesce;
+	if (bufs->ring && ur_attach(bufs->ring, fd) == 0)
+		c.ring = bufs->ring;
+
+	/* On a blocking socket every step runs until the peer is done */
+	while (hc_conn_step(&c, shared) != HC_STEP_DONE) {}
+
+	hc_conn_release(&c);
+	*res = c.res;
+	return res->outcome == HC_OUTCOME_ERROR ? EXIT_ERROR : 0;
+}
@@ -9,9 +9,24 @@
 #include <string.h>  /* memchr */
 #include <fcntl.h>   /* open */
 #include <signal.h>  /* sig_atomic_t */
+#include <pthread.h> /* pthread_mutex_t */
+#include <syslog.h>  /* syslog */
+#include <sys/stat.h> /* fstat */
+#include <sys/types.h> /* off_t */
+#include <sys/uio.h>  /* writev, struct iovec */
 
 #include "aesd_config.h"
 #include "sb.h" /* StringBuilder */
+#include "reply.h" /* reply_xfer_t */
+#include "mirror.h" /* mirror_t */
+#include "gcommit.h" /* gcommit_t */
+#include "nlscan.h" /* nl_scan */
+#include "bufpool.h" /* bufpool_t */
+#include "store.h" /* store_t */
+#include "flusher.h" /* flusher_t */
+#include "latency.h" /* lat_ts_t */
+
+struct ur_ring; /* uring.h */
 
 typedef enum {
 	HC_OUTCOME_CLOSED = 0, /* peer closed normally */
@@ -23,14 +38,16 @@ typedef enum {
 	HC_OP_RECV,
 	HC_OP_APPEND, /* write all */
 	HC_OP_SEND,   /* send_file_to_client */
+	HC_OP_COUNT,
 } hc_op_t;
 
 typedef enum {
 	HC_ERR_NONE = 0,
 	HC_ERR_EINTR_AGAIN,
-	HC_ERR_SHORT_WRITE, /* write_all returned -1 with EIO */
+	HC_ERR_SHORT_WRITE, /* writev_all returned -1 with EIO */
 	HC_ERR_IO, 	    /* I/O failure (write/read/send) */
 	HC_ERR_ALLOC,	    /* ENOMEM from buffer builder */
+	HC_ERR_COUNT,
 } hc_err_t;
 
 typedef struct {
@@ -40,11 +57,138 @@ typedef struct {
 	int sys_errno;		/* snapshot of errno */
 	size_t intended;	/* intended bytes count for the op */
 	size_t transferred;	/* bytes actual */
+	size_t received;	/* bytes read from the peer */
 	uint64_t packets_written;
 	uint64_t packets_dropped_oversize;
 } hc_result_t;
 
-int handle_connection(int fd, int write_fd, StringBuilder *sb, 
-		char *scratch, hc_result_t *res);
+/*
+ * State shared by every connection handler. Appends go through the group
+ * committer, which holds the append lock for each batch write, so lines
+ * from concurrent clients never interleave in the data store.
+ */
+typedef struct {
+	store_t *store;		/* written under append_lock */
+	pthread_mutex_t append_lock;
+	bool use_uring;		/* workers try io_uring first */
+	mirror_t mirror;	/* written under append_lock, read lock-free */
+	gcommit_t gc;		/* set gc.sync for an fdatasync per batch */
+	flusher_t fl;		/* background fdatasync, see fl_start() */
+	bufpool_t pool;		/* connection buffers */
+	size_t max_packet;	/* longest packet kept, newline included */
+	size_t recv_buf_sz;	/* per-connection receive buffer */
+	size_t write_chunk;	/* most bytes per sendfile/splice call */
+	size_t mem_budget;	/* connection buffer bytes, 0: unlimited */
+} hc_shared_t;
+
+/* Working buffers owned by exactly one handler thread */
+typedef struct {
+	StringBuilder sb;	/* pending partial line */
+	char *recv_buf;		/* at least shared->recv_buf_sz bytes */
+	size_t recv_cap;
+	bufpool_t *pool;
+	struct ur_ring *ring;	/* NULL: plain syscalls */
+} hc_bufs_t;
+
+/* Pending reply: the logical byte range [off, end) of the data store */
+typedef struct {
+	bool active;
+	off_t off;
+	off_t end;
+	store_snap_t snap;	/* segments pinned for the reply */
+	reply_xfer_t xfer;
+	lat_ts_t started;
+} hc_reply_t;
+
+/*
+ * Per-connection framing state. Everything needed to resume after a
+ * would-block lives here, so a connection can be driven either by a
+ * dedicated thread (blocking fd) or by an event loop (non-blocking fd).
+ */
+typedef struct {
+	int fd;
+	StringBuilder *sb;	/* pending partial line */
+	char *rbuf;		/* received bytes not yet framed: [rpos, rlen) */
+	size_t rbuf_cap;
+	size_t rpos;
+	size_t rlen;
+	uint32_t nl[NL_BATCH];	/* newline offsets from nl_base, see nl_scan() */
+	size_t nl_base;
+	size_t nl_pos;		/* next unused entry in nl */
+	size_t nl_cnt;
+	size_t nl_done;		/* rbuf is indexed up to here */
+	bool discard;		/* dropping an oversize line until '\n' */
+	bool coalesce;		/* one append and reply per received batch */
+	hc_reply_t reply;
+	struct ur_ring *ring;	/* blocking fds only, NULL: plain syscalls */
+	hc_result_t res;
+	hc_result_t reported;	/* part of res already in the metrics */
+	bool open;		/* counted as an active connection */
+	size_t recv_avg;	/* moving average of recv() sizes */
+	bool recv_full;		/* the last recv() filled rbuf */
+	size_t line_avg;	/* moving average of packet sizes */
+	size_t buf_bytes;	/* rbuf and sb capacity in the metrics */
+} hc_conn_t;
+
+typedef enum {
+	HC_STEP_READ = 0,	/* wait until readable, then step again */
+	HC_STEP_WRITE,		/* reply blocked, wait until writable */
+	HC_STEP_DONE,		/* closed or failed, see res */
+} hc_step_t;
+
+/*
+ * mirror_max: in-memory mirror ceiling in bytes, 0 disables it. The
+ * sizes start at their aesd_config.h defaults; set them before the first
+ * hc_bufs_init() or connection.
+ */
+int hc_shared_init(hc_shared_t *shared, store_t *store, size_t mirror_max);
+void hc_shared_destroy(hc_shared_t *shared);
+
+/* Buffers come from shared->pool and go back to it on hc_bufs_free() */
+int hc_bufs_init(hc_bufs_t *bufs, hc_shared_t *shared);
+void hc_bufs_free(hc_bufs_t *bufs);
+
+void hc_conn_init(hc_conn_t *c, int fd, StringBuilder *sb, char *rbuf,
+		size_t rbuf_cap);
+void hc_conn_release(hc_conn_t *c);
+/* Run the connection until it needs to wait or is finished */
+hc_step_t hc_conn_step(hc_conn_t *c, hc_shared_t *shared);
+
+/*
+ * Adaptive buffers, for callers that own one rbuf per connection (the
+ * event loop). A connection is idle when it holds no input, partial line
+ * or reply; its rbuf and line builder can then go back to the pool, and
+ * hc_recv_want() tells what size to take when it becomes readable: the
+ * recent recv() sizes with headroom, doubled while reads fill the
+ * buffer, between RECV_BUF_MIN and max. Coalescing connections always
+ * get max, since their batches are what one recv() returns.
+ */
+bool hc_conn_idle(const hc_conn_t *c);
+size_t hc_recv_want(const hc_conn_t *c, size_t max);
+/* Swap rbuf (NULL: none); only while all input is consumed */
+void hc_conn_set_rbuf(hc_conn_t *c, char *rbuf, size_t rbuf_cap);
+/* Publish a change of the rbuf and line builder sizes to the metrics */
+void hc_conn_account(hc_conn_t *c);
+
+/*
+ * Blocking driver: runs the connection on fd until the peer is done.
+ * With coalesce, all complete lines of one recv() are appended together
+ * and answered with a single reply of the resulting file.
+ */
+int handle_connection(int fd, hc_shared_t *shared, hc_bufs_t *bufs,
+		bool coalesce, hc_result_t *res);
+
+/* Report a finished connection to syslog */
+void hc_log_result(const char *peer_ip, const hc_result_t *res);
+
+/* A packet is at most the pending prefix plus one segment of lines */
+#define HC_PACKET_IOV 2
+
+/*
+ * Account for a packet just written whole, under append_lock: store
+ * index and retention, then the mirror. Returns the new end offset.
+ */
+off_t hc_packet_committed(hc_shared_t *shared, const struct iovec *iov,
+		int iovcnt, size_t len);
 
 #endif
@@ -0,0 +1,153 @@
+#include <stdlib.h>    /* calloc, free */
+#include <stdatomic.h> /* atomics */
+
+#include "latency.h"
+
+static const char *const phase_names[LAT_PHASES] = {
+	"accept", "recv", "append", "reply",
+};
+
+const char *lat_phase_name(lat_phase_t phase) {
+	return phase < LAT_PHASES ? phase_names[phase] : "?";
+}
+
+#ifndef AESD_NO_LATENCY
+
+/* Linear buckets per power of two */
+#define LAT_SUB_BITS 5
+#define LAT_SUB (1u << LAT_SUB_BITS)
+/* Values from 2^LAT_MAX_BITS ns (about 18 minutes) up share a bucket */
+#define LAT_MAX_BITS 40
+#define LAT_BUCKETS ((LAT_MAX_BITS - LAT_SUB_BITS + 1) * LAT_SUB)
+
+/*
+ * One thread's histograms. Only the owner writes, with relaxed loads and
+ * stores; mergers read with relaxed loads and may see a record half done
+ * (count bumped, sum not yet), which is fine for monitoring.
+ */
+typedef struct lat_hist {
+	atomic_uint_fast64_t counts[LAT_PHASES][LAT_BUCKETS];
+	atomic_uint_fast64_t sum[LAT_PHASES];
+	atomic_uint_fast64_t max[LAT_PHASES];
+	struct lat_hist *next;
+} lat_hist_t;
+
+static _Thread_local lat_hist_t *mine;
+static _Thread_local int mine_failed;
+static _Atomic(lat_hist_t *) all;
+
+static unsigned bucket_of(uint64_t v) {
+	if (v < LAT_SUB)
+		return (unsigned)v;
+	if (v >> LAT_MAX_BITS)
+		return LAT_BUCKETS - 1;
+
+	unsigned msb = 63u - (unsigned)__builtin_clzll(v);
+	unsigned shift = msb - LAT_SUB_BITS;
+	return shift * LAT_SUB + (unsigned)(v >> shift);
+}
+
+/* Largest value that lands in bucket b */
+static uint64_t bucket_top(unsigned b) {
+	if (b < 2 * LAT_SUB)
+		return b;
+
+	unsigned shift = b / LAT_SUB - 1;
+	uint64_t mant = b - shift * LAT_SUB;
+	return ((mant + 1) << shift) - 1;
+}
+
+static lat_hist_t *attach(void) {
+	lat_hist_t *h = calloc(1, sizeof *h);
+	if (!h) {
+		mine_failed = 1; /* don't retry on every record */
+		return NULL;
+	}
+
+	h->next = atomic_load_explicit(&all, memory_order_relaxed);
+	while (!atomic_compare_exchange_weak_explicit(&all, &h->next, h,
+			memory_order_release, memory_order_relaxed)) {}
+	return mine = h;
+}
+
+static void bump(atomic_uint_fast64_t *c, uint64_t by) {
+	atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed)
+			      + by, memory_order_relaxed);
+}
+
+void lat_record(lat_phase_t phase, uint64_t ns) {
+	lat_hist_t *h = mine;
+	if (!h && (mine_failed || !(h = attach())))
+		return;
+
+	bump(&h->counts[phase][bucket_of(ns)], 1);
+	bump(&h->sum[phase], ns);
+	if (ns > atomic_load_explicit(&h->max[phase], memory_order_relaxed))
+		atomic_store_explicit(&h->max[phase], ns, memory_order_relaxed);
+}
+
+/* Bucket top at rank ceil(q * count) of the merged counts */
+static uint64_t quantile(const uint64_t *counts, uint64_t total,
+		uint64_t max, double q) {
+	uint64_t rank = (uint64_t)(q * (double)total);
+	if ((double)rank < q * (double)total) rank++;
+	if (!rank) rank = 1;
+
+	uint64_t seen = 0;
+	for (unsigned b = 0; b < LAT_BUCKETS; b++) {
+		seen += counts[b];
+		if (seen >= rank) {
+			uint64_t top = bucket_top(b);
+			return top < max ? top : max;
+		}
+	}
+	return max;
+}
+
+void lat_summary(lat_phase_t phase, lat_stats_t *st) {
+	uint64_t counts[LAT_BUCKETS] = {0};
+
+	*st = (lat_stats_t){0};
+
+	for (lat_hist_t *h = atomic_load_explicit(&all, memory_order_acquire);
+			h; h = h->next) {
+		for (unsigned b = 0; b < LAT_BUCKETS; b++) {
+			uint64_t n = atomic_load_explicit(&h->counts[phase][b],
+							  memory_order_relaxed);
+			counts[b] += n;
+			st->count += n;
+		}
+		st->sum += atomic_load_explicit(&h->sum[phase],
+						memory_order_relaxed);
+		uint64_t max = atomic_load_explicit(&h->max[phase],
+						    memory_order_relaxed);
+		if (max > st->max) st->max = max;
+	}
+
+	if (!st->count) return;
+	st->p50 = quantile(counts, st->count, st->max, 0.50);
+	st->p90 = quantile(counts, st->count, st->max, 0.90);
+	st->p99 = quantile(counts, st->count, st->max, 0.99);
+	st->p999 = quantile(counts, st->count, st->max, 0.999);
+}
+
+void lat_free_all(void) {
+	lat_hist_t *h = atomic_exchange(&all, NULL);
+	while (h) {
+		lat_hist_t *next = h->next;
+		free(h);
+		h = next;
+	}
+	mine = NULL;
+}
+
+#else /* AESD_NO_LATENCY */
+
+void lat_summary(lat_phase_t phase, lat_stats_t *st) {
+	(void)phase;
+	*st = (lat_stats_t){0};
+}
+
+void lat_free_all(void) {}
+
+#endif
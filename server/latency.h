@@ -0,0 +1,68 @@
+#ifndef __LATENCY_H__
+#define __LATENCY_H__
+
+#include <stddef.h> /* size_t */
+#include <stdint.h> /* uint64_t */
+#include <time.h>   /* clock_gettime */
+
+/*
+ * Per-phase latency histograms.
+ *
+ * Every thread records into its own log-linear (HDR-style) histogram:
+ * values below 2^LAT_SUB_BITS ns are exact, above that each power of two
+ * is split into 2^LAT_SUB_BITS linear buckets, so a bucket is within
+ * about 3% of the values it holds. Recording is a couple of plain stores
+ * into thread-local memory; lat_summary() merges all threads on demand.
+ *
+ * `make LATENCY=0` defines AESD_NO_LATENCY: lat_now() is then 0,
+ * lat_since() does nothing and no histogram memory exists.
+ */
+typedef enum {
+	LAT_ACCEPT = 0,	/* accept() until a worker picks the client up */
+	LAT_RECV,	/* one recv(); includes waiting for a blocking client */
+	LAT_APPEND,	/* queue, write and commit of one packet */
+	LAT_REPLY,	/* first to last byte of one reply */
+	LAT_PHASES,
+} lat_phase_t;
+
+/* Monotonic nanoseconds */
+typedef uint64_t lat_ts_t;
+
+typedef struct {
+	uint64_t count;
+	uint64_t sum;		/* ns */
+	uint64_t max;		/* ns */
+	uint64_t p50, p90, p99, p999;	/* ns, bucket upper bound */
+} lat_stats_t;
+
+#ifndef AESD_NO_LATENCY
+
+static inline lat_ts_t lat_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (lat_ts_t)ts.tv_sec * 1000000000u + (lat_ts_t)ts.tv_nsec;
+}
+
+void lat_record(lat_phase_t phase, uint64_t ns);
+
+static inline void lat_since(lat_phase_t phase, lat_ts_t start) {
+	lat_record(phase, lat_now() - start);
+}
+
+#else
+
+static inline lat_ts_t lat_now(void) { return 0; }
+static inline void lat_since(lat_phase_t phase, lat_ts_t start) {
+	(void)phase;
+	(void)start;
+}
+
+#endif
+
+/* Merge every thread's histogram for phase; all zero when compiled out */
+void lat_summary(lat_phase_t phase, lat_stats_t *st);
+const char *lat_phase_name(lat_phase_t phase);
+/* Free all histograms, once no thread records any more */
+void lat_free_all(void);
+
+#endif
@@ -0,0 +1,303 @@
+#define _GNU_SOURCE /* accept4, pipe2 */
+#include <stdio.h>      /* snprintf */
+#include <string.h>     /* strncmp, strchr, strstr, strerror */
+#include <errno.h>      /* errno */
+#include <fcntl.h>      /* O_NONBLOCK, O_CLOEXEC */
+#include <poll.h>       /* poll */
+#include <syslog.h>     /* syslog */
+#include <unistd.h>     /* pipe2, read, write, close */
+#include <sys/socket.h> /* accept4, send, setsockopt */
+#include <sys/time.h>   /* struct timeval */
+
+#include "metrics.h"
+#include "bgthread.h"
+#include "latency.h"
+
+/* Room for the whole exposition, error matrix included */
+#define METRICS_TEXT_MAX 8192
+
+/* How long a stats client may pause while sending its request, ms */
+#define METRICS_REQ_WAIT_MS 100
+
+metrics_t metrics;
+
+/* Self-pipe from the signal handler and metrics_srv_stop() */
+static int wake_fd[2] = { -1, -1 };
+
+static const char *const op_names[HC_OP_COUNT] = {
+	"none", "recv", "append", "send",
+};
+
+static const char *const err_names[HC_ERR_COUNT] = {
+	"none", "eintr_again", "short_write", "io", "alloc",
+};
+
+static uint64_t load(atomic_uint_fast64_t *ctr) {
+	return atomic_load_explicit(ctr, memory_order_relaxed);
+}
+
+void metrics_add_result(const hc_result_t *res, hc_result_t *seen) {
+	if (res->packets_written != seen->packets_written)
+		metrics_inc(&metrics.packets_written,
+			    res->packets_written - seen->packets_written);
+	if (res->packets_dropped_oversize != seen->packets_dropped_oversize)
+		metrics_inc(&metrics.packets_dropped_oversize,
+			    res->packets_dropped_oversize
+			    - seen->packets_dropped_oversize);
+	if (res->received != seen->received)
+		metrics_inc(&metrics.bytes_in, res->received - seen->received);
+	if (res->transferred != seen->transferred)
+		metrics_inc(&metrics.bytes_out,
+			    res->transferred - seen->transferred);
+	*seen = *res;
+}
+
+void metrics_add_error(const hc_result_t *res) {
+	if (res->op < HC_OP_COUNT && res->err < HC_ERR_COUNT)
+		metrics_inc(&metrics.errors[res->op][res->err], 1);
+}
+
+/* snprintf() that keeps appending at *len and never overruns cap */
+#define APPEND(buf, cap, len, ...) do { \
+	if (*(len) < (cap)) \
+		*(len) += (size_t)snprintf((buf) + *(len), (cap) - *(len), \
+					   __VA_ARGS__); \
+} while (0)
+
+static void counter(char *buf, size_t cap, size_t *len, const char *name,
+		const char *type, const char *help, uint64_t v) {
+	APPEND(buf, cap, len, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n",
+	       name, help, name, type, name, (unsigned long long)v);
+}
+
+size_t metrics_format(char *buf, size_t cap) {
+	size_t len = 0;
+
+	counter(buf, cap, &len, "aesd_connections_accepted_total", "counter",
+		"Client connections accepted.", load(&metrics.conns_accepted));
+	counter(buf, cap, &len, "aesd_connections_active", "gauge",
+		"Client connections being served.",
+		load(&metrics.conns_active));
+	counter(buf, cap, &len, "aesd_packets_written_total", "counter",
+		"Packets appended to the data store.",
+		load(&metrics.packets_written));
+	counter(buf, cap, &len, "aesd_packets_dropped_oversize_total",
+		"counter", "Packets dropped for exceeding the size limit.",
+		load(&metrics.packets_dropped_oversize));
+	counter(buf, cap, &len, "aesd_received_bytes_total", "counter",
+		"Bytes received from clients.", load(&metrics.bytes_in));
+	counter(buf, cap, &len, "aesd_sent_bytes_total", "counter",
+		"Reply bytes sent to clients.", load(&metrics.bytes_out));
+	counter(buf, cap, &len, "aesd_log_dropped_total", "counter",
+		"Log records dropped with the log ring full.",
+		load(&metrics.log_dropped));
+	counter(buf, cap, &len, "aesd_log_suppressed_total", "counter",
+		"Log records suppressed by the log rate limit.",
+		load(&metrics.log_suppressed));
+	counter(buf, cap, &len, "aesd_connection_buffer_bytes", "gauge",
+		"Receive and line buffer bytes held by connections.",
+		load(&metrics.conn_buf_bytes));
+	counter(buf, cap, &len, "aesd_connection_buffer_peak_bytes", "gauge",
+		"Most buffer bytes held by a single connection.",
+		load(&metrics.conn_buf_peak));
+	counter(buf, cap, &len, "aesd_memory_budget_bytes", "gauge",
+		"Connection buffer budget, 0: unlimited.",
+		load(&metrics.mem_budget));
+	counter(buf, cap, &len, "aesd_connections_throttled", "gauge",
+		"Connections not read from while over the budget.",
+		load(&metrics.conns_throttled));
+	counter(buf, cap, &len, "aesd_throttle_events_total", "counter",
+		"Times a connection was paused for the memory budget.",
+		load(&metrics.throttle_events));
+	counter(buf, cap, &len, "aesd_fdatasync_total", "counter",
+		"fdatasync calls made for durability.",
+		load(&metrics.syncs));
+	counter(buf, cap, &len, "aesd_fdatasync_errors_total", "counter",
+		"fdatasync calls that failed.",
+		load(&metrics.sync_errors));
+	counter(buf, cap, &len, "aesd_timestamps_written_total", "counter",
+		"Periodic timestamp lines appended to the data.",
+		load(&metrics.timestamps));
+
+	APPEND(buf, cap, &len, "# HELP aesd_connection_errors_total "
+	       "Connections ended by an error.\n"
+	       "# TYPE aesd_connection_errors_total counter\n");
+	for (int op = 0; op < HC_OP_COUNT; op++) {
+		for (int err = 0; err < HC_ERR_COUNT; err++) {
+			uint64_t v = load(&metrics.errors[op][err]);
+			if (!v) continue;
+			APPEND(buf, cap, &len, "aesd_connection_errors_total"
+			       "{op=\"%s\",err=\"%s\"} %llu\n", op_names[op],
+			       err_names[err], (unsigned long long)v);
+		}
+	}
+
+#ifndef AESD_NO_LATENCY
+	static const char *const quantiles[] = { "0.5", "0.9", "0.99", "0.999" };
+	lat_stats_t lat[LAT_PHASES];
+	for (int ph = 0; ph < LAT_PHASES; ph++)
+		lat_summary((lat_phase_t)ph, &lat[ph]);
+
+	APPEND(buf, cap, &len, "# HELP aesd_latency_seconds Time spent per "
+	       "phase: accept, recv, append, reply.\n"
+	       "# TYPE aesd_latency_seconds summary\n");
+	for (int ph = 0; ph < LAT_PHASES; ph++) {
+		const char *name = lat_phase_name((lat_phase_t)ph);
+		uint64_t ns[] = { lat[ph].p50, lat[ph].p90, lat[ph].p99,
+				  lat[ph].p999 };
+		for (size_t i = 0; i < sizeof ns / sizeof ns[0]; i++)
+			APPEND(buf, cap, &len, "aesd_latency_seconds{phase=\"%s\","
+			       "quantile=\"%s\"} %.9f\n", name, quantiles[i],
+			       ns[i] / 1e9);
+		APPEND(buf, cap, &len, "aesd_latency_seconds_sum{phase=\"%s\"} "
+		       "%.9f\naesd_latency_seconds_count{phase=\"%s\"} %llu\n",
+		       name, lat[ph].sum / 1e9, name,
+		       (unsigned long long)lat[ph].count);
+	}
+
+	APPEND(buf, cap, &len, "# HELP aesd_latency_max_seconds Longest time "
+	       "spent in a phase.\n# TYPE aesd_latency_max_seconds gauge\n");
+	for (int ph = 0; ph < LAT_PHASES; ph++)
+		APPEND(buf, cap, &len, "aesd_latency_max_seconds{phase=\"%s\"} "
+		       "%.9f\n", lat_phase_name((lat_phase_t)ph),
+		       lat[ph].max / 1e9);
+#endif
+
+	return len < cap ? len : (cap ? cap - 1 : 0);
+}
+
+/* Every sample line to syslog, without the comments */
+static void dump_to_syslog(void) {
+	char text[METRICS_TEXT_MAX];
+	metrics_format(text, sizeof text);
+
+	for (char *line = text, *nl; *line; line = nl + 1) {
+		if (!(nl = strchr(line, '\n')))
+			break;
+		if (*line != '#')
+			syslog(LOG_INFO, "stats: %.*s", (int)(nl - line), line);
+	}
+}
+
+static void send_all(int fd, const char *buf, size_t len) {
+	while (len) {
+		ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			return; /* slow or gone, it's only stats */
+		}
+		buf += n;
+		len -= (size_t)n;
+	}
+}
+
+/*
+ * Read what the client sends before it waits for us: an HTTP request up
+ * to its blank line, or nothing from a bare client. Unread input would
+ * make close() reset the connection under the reply.
+ */
+static size_t read_request(int fd, char *req, size_t cap) {
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	size_t len = 0;
+
+	while (len < cap - 1 && poll(&pfd, 1, METRICS_REQ_WAIT_MS) == 1) {
+		ssize_t n = recv(fd, req + len, cap - 1 - len, MSG_DONTWAIT);
+		if (n <= 0) break;
+		len += (size_t)n;
+		req[len] = '\0';
+		if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+			break;
+	}
+	req[len] = '\0';
+	return len;
+}
+
+static void serve_client(int fd) {
+	char text[METRICS_TEXT_MAX];
+	char req[1024];
+
+	struct timeval tv = { .tv_sec = 1 };
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+
+	size_t n = read_request(fd, req, sizeof req);
+	size_t len = metrics_format(text, sizeof text);
+	if (n >= 4 && !strncmp(req, "GET ", 4)) {
+		char hdr[128];
+		int hlen = snprintf(hdr, sizeof hdr, "HTTP/1.0 200 OK\r\n"
+				    "Content-Type: text/plain; version=0.0.4\r\n"
+				    "Content-Length: %zu\r\n\r\n", len);
+		send_all(fd, hdr, (size_t)hlen);
+	}
+	send_all(fd, text, len);
+}
+
+static void *srv_main(void *arg) {
+	metrics_srv_t *srv = arg;
+	struct pollfd pfd[2] = {
+		{ .fd = wake_fd[0], .events = POLLIN },
+		{ .fd = srv->listen_fd, .events = POLLIN },
+	};
+
+	for (;;) {
+		if (poll(pfd, srv->listen_fd == -1 ? 1 : 2, -1) == -1) {
+			if (errno == EINTR) continue;
+			syslog(LOG_ERR, "stats: poll failed: %s", strerror(errno));
+			return NULL;
+		}
+
+		if (pfd[0].revents) {
+			char cmd;
+			while (read(wake_fd[0], &cmd, 1) == 1) {
+				if (cmd == 'q') return NULL;
+				dump_to_syslog();
+			}
+		}
+
+		if (srv->listen_fd != -1 && pfd[1].revents) {
+			int fd = accept4(srv->listen_fd, NULL, NULL,
+					 SOCK_CLOEXEC);
+			if (fd == -1) continue;
+			serve_client(fd);
+			close(fd);
+		}
+	}
+}
+
+int metrics_srv_start(metrics_srv_t *srv, int listen_fd) {
+	srv->listen_fd = listen_fd;
+	srv->started = false;
+
+	if (pipe2(wake_fd, O_NONBLOCK | O_CLOEXEC) == -1)
+		return -1;
+
+	if (bg_spawn(&srv->tid, srv_main, srv) == -1) {
+		int err = errno;
+		close(wake_fd[0]);
+		close(wake_fd[1]);
+		wake_fd[0] = wake_fd[1] = -1;
+		errno = err;
+		return -1;
+	}
+	srv->started = true;
+	return 0;
+}
+
+void metrics_srv_stop(metrics_srv_t *srv) {
+	if (!srv->started) return;
+
+	while (write(wake_fd[1], "q", 1) == -1 && errno == EINTR) {}
+	pthread_join(srv->tid, NULL);
+	srv->started = false;
+
+	int rd = wake_fd[0], wr = wake_fd[1];
+	wake_fd[0] = wake_fd[1] = -1;
+	close(rd);
+	close(wr);
+}
+
+void metrics_request_dump(void) {
+	int saved_errno = errno;
+	if (wake_fd[1] != -1)
+		(void)!write(wake_fd[1], "d", 1);
+	errno = saved_errno;
+}
@@ -0,0 +1,77 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdbool.h>   /* bool */
+#include <stddef.h>    /* size_t */
+#include <stdint.h>    /* uint64_t */
+#include <stdatomic.h> /* atomics */
+#include <pthread.h>   /* pthread_t */
+
+#include "handleconn.h" /* hc_result_t, hc_op_t, hc_err_t */
+
+/*
+ * Process-wide counters. Every field is a relaxed atomic, so the packet
+ * path never takes a lock for them; connections add their hc_result_t
+ * deltas once per step rather than once per packet.
+ */
+typedef struct {
+	atomic_uint_fast64_t conns_accepted;
+	atomic_uint_fast64_t conns_active;
+	atomic_uint_fast64_t packets_written;
+	atomic_uint_fast64_t packets_dropped_oversize;
+	atomic_uint_fast64_t bytes_in;
+	atomic_uint_fast64_t bytes_out;
+	atomic_uint_fast64_t errors[HC_OP_COUNT][HC_ERR_COUNT];
+	atomic_uint_fast64_t log_dropped;	/* async log ring full */
+	atomic_uint_fast64_t log_suppressed;	/* async log rate limit */
+	atomic_uint_fast64_t conn_buf_bytes;	/* held by connections now */
+	atomic_uint_fast64_t conn_buf_peak;	/* most held by one connection */
+	atomic_uint_fast64_t mem_budget;	/* limit on conn_buf_bytes */
+	atomic_uint_fast64_t conns_throttled;	/* not read, over budget */
+	atomic_uint_fast64_t throttle_events;	/* times one was paused */
+	atomic_uint_fast64_t syncs;		/* fdatasync calls on the data */
+	atomic_uint_fast64_t sync_errors;	/* ones that failed */
+	atomic_uint_fast64_t timestamps;	/* "timestamp:" lines appended */
+} metrics_t;
+
+extern metrics_t metrics;
+
+static inline void metrics_inc(atomic_uint_fast64_t *ctr, uint64_t n) {
+	atomic_fetch_add_explicit(ctr, n, memory_order_relaxed);
+}
+
+static inline void metrics_max(atomic_uint_fast64_t *g, uint64_t v) {
+	uint64_t cur = atomic_load_explicit(g, memory_order_relaxed);
+	while (cur < v && !atomic_compare_exchange_weak_explicit(g, &cur, v,
+			memory_order_relaxed, memory_order_relaxed)) {}
+}
+
+/* Add what res gained since *seen, then remember res in *seen */
+void metrics_add_result(const hc_result_t *res, hc_result_t *seen);
+/* A connection that ended in error, by failed operation and kind */
+void metrics_add_error(const hc_result_t *res);
+
+/*
+ * Prometheus text exposition of the counters into buf. Returns the
+ * length, truncated to cap - 1 like snprintf().
+ */
+size_t metrics_format(char *buf, size_t cap);
+
+/*
+ * Stats thread: serves the text to every client of listen_fd (-1: none)
+ * and dumps it to syslog on metrics_request_dump(). A client that sends
+ * an HTTP GET gets an HTTP response, anything else the bare text.
+ */
+typedef struct {
+	pthread_t tid;
+	int listen_fd;
+	bool started;
+} metrics_srv_t;
+
+int metrics_srv_start(metrics_srv_t *srv, int listen_fd);
+void metrics_srv_stop(metrics_srv_t *srv);
+
+/* Async-signal-safe, for the SIGUSR1 handler */
+void metrics_request_dump(void);
+
+#endif
@@ -0,0 +1,175 @@
+#include <stdlib.h>     /* calloc, malloc, free */
+#include <string.h>     /* memcpy */
+#include <errno.h>      /* errno */
+#include <unistd.h>     /* pread */
+#include <sys/socket.h> /* sendmsg */
+#include <sys/uio.h>    /* struct iovec */
+
+#include "aesd_config.h"
+#include "mirror.h"
+
+/* iovecs per sendmsg() call when streaming a reply */
+#define MIRROR_IOV_MAX 64
+
+int mirror_init(mirror_t *m, size_t ceiling, off_t origin, off_t size) {
+	m->chunks = NULL;
+	m->nchunks = 0;
+	m->ceiling = ceiling;
+	m->origin = origin;
+	atomic_init(&m->len, 0);
+	atomic_init(&m->gen, 0);
+	atomic_init(&m->enabled, false);
+
+	if (!ceiling || (size_t)size > ceiling)
+		return 0;
+
+	/* Rounded up without overflowing near SIZE_MAX */
+	m->nchunks = ceiling / MIRROR_CHUNK_SZ + !!(ceiling % MIRROR_CHUNK_SZ);
+	m->chunks = calloc(m->nchunks, sizeof *m->chunks);
+	if (!m->chunks) return -1;
+
+	atomic_store_explicit(&m->enabled, true, memory_order_release);
+	return 0;
+}
+
+int mirror_load(mirror_t *m, int fd, off_t size) {
+	if (!atomic_load_explicit(&m->enabled, memory_order_relaxed))
+		return 0;
+
+	size_t base = atomic_load_explicit(&m->len, memory_order_relaxed);
+	if ((size_t)size > m->ceiling - base) {
+		mirror_free(m);
+		return 0;
+	}
+
+	off_t off = 0;
+	while (off < size) {
+		size_t pos = base + (size_t)off;
+		size_t idx = pos / MIRROR_CHUNK_SZ;
+		size_t in = pos % MIRROR_CHUNK_SZ;
+		size_t want = MIRROR_CHUNK_SZ - in;
+		if ((off_t)want > size - off)
+			want = (size_t)(size - off);
+
+		if (!m->chunks[idx] && !(m->chunks[idx] = malloc(MIRROR_CHUNK_SZ)))
+			goto fail;
+
+		ssize_t n = pread(fd, m->chunks[idx] + in, want, off);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			goto fail;
+		}
+		if (!n) break; /* file shrank, mirror what is there */
+		off += n;
+	}
+
+	atomic_store_explicit(&m->len, base + (size_t)off, memory_order_release);
+	return 0;
+
+fail:;
+	int saved_errno = errno;
+	mirror_free(m);
+	errno = saved_errno;
+	return -1;
+}
+
+/* Only once no reader can be left, i.e. at shutdown */
+void mirror_free(mirror_t *m) {
+	for (size_t i = 0; i < m->nchunks; i++)
+		free(m->chunks[i]);
+	free(m->chunks);
+	m->chunks = NULL;
+	m->nchunks = 0;
+	atomic_store(&m->enabled, false);
+	atomic_store(&m->len, 0);
+}
+
+/* Copy into chunks past the published length; readers never look there */
+static int copy_in(mirror_t *m, size_t off, const char *buf, size_t len) {
+	size_t done = 0;
+	while (done < len) {
+		size_t idx = (off + done) / MIRROR_CHUNK_SZ;
+		size_t in = (off + done) % MIRROR_CHUNK_SZ;
+		size_t n = MIRROR_CHUNK_SZ - in;
+		if (n > len - done)
+			n = len - done;
+
+		if (!m->chunks[idx] && !(m->chunks[idx] = malloc(MIRROR_CHUNK_SZ)))
+			return -1;
+
+		memcpy(m->chunks[idx] + in, buf + done, n);
+		done += n;
+	}
+	return 0;
+}
+
+int mirror_append(mirror_t *m, const struct iovec *iov, int iovcnt) {
+	if (!atomic_load_explicit(&m->enabled, memory_order_relaxed))
+		return 0;
+
+	size_t off = atomic_load_explicit(&m->len, memory_order_relaxed);
+	size_t len = 0;
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	if (len > m->ceiling - off)
+		goto give_up;
+
+	size_t at = off;
+	for (int i = 0; i < iovcnt; i++) {
+		if (copy_in(m, at, iov[i].iov_base, iov[i].iov_len) == -1)
+			goto give_up;
+		at += iov[i].iov_len;
+	}
+
+	atomic_store_explicit(&m->len, off + len, memory_order_release);
+	atomic_fetch_add_explicit(&m->gen, 1, memory_order_release);
+	return 0;
+
+give_up:
+	atomic_store_explicit(&m->enabled, false, memory_order_release);
+	return -1;
+}
+
+bool mirror_covers(mirror_t *m, off_t off, off_t end) {
+	return off >= m->origin && (size_t)(end - m->origin)
+		<= atomic_load_explicit(&m->len, memory_order_acquire);
+}
+
+int mirror_send(mirror_t *m, int sock, off_t *off, off_t end, size_t *sent) {
+	struct iovec iov[MIRROR_IOV_MAX];
+
+	while (*off < end) {
+		int cnt = 0;
+		size_t pos = (size_t)(*off - m->origin);
+		size_t stop = (size_t)(end - m->origin);
+		while (pos < stop && cnt < MIRROR_IOV_MAX) {
+			size_t in = pos % MIRROR_CHUNK_SZ;
+			size_t n = MIRROR_CHUNK_SZ - in;
+			if (n > stop - pos)
+				n = stop - pos;
+
+			iov[cnt].iov_base = m->chunks[pos / MIRROR_CHUNK_SZ] + in;
+			iov[cnt].iov_len = n;
+			cnt++;
+			pos += n;
+		}
+
+		struct msghdr msg = { .msg_iov = iov, .msg_iovlen = cnt };
+		ssize_t w = sendmsg(sock, &msg, MSG_NOSIGNAL);
+		if (w == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+			if (errno == EPIPE || errno == ECONNRESET) {
+				*off = end;
+				return 0;
+			}
+			return -1;
+		}
+
+		*off += w;
+		*sent += (size_t)w;
+	}
+
+	return 0;
+}
@@ -0,0 +1,61 @@
+#ifndef __MIRROR_H__
+#define __MIRROR_H__
+
+#include <stdbool.h>   /* bool */
+#include <stddef.h>    /* size_t */
+#include <stdint.h>    /* uint64_t */
+#include <stdatomic.h> /* atomics */
+#include <sys/types.h> /* off_t */
+#include <sys/uio.h>   /* struct iovec */
+
+/*
+ * Append-only in-memory copy of the data store from logical offset
+ * origin on, so replies can be sent from memory instead of going back to
+ * the files.
+ *
+ * Data lives in fixed-size chunks that never move once written; the chunk
+ * table is sized from the ceiling up front. A single writer (holding the
+ * append lock) copies a packet in, then publishes the new length and
+ * generation with release stores, so readers need no lock: any range
+ * below an acquired length is complete and immutable.
+ *
+ * When the file outgrows the ceiling the mirror stops following it for
+ * good. What it already holds stays valid, and replies that reach past it
+ * fall back to the file.
+ */
+typedef struct {
+	char **chunks;
+	size_t nchunks;		/* table size: ceiling / MIRROR_CHUNK_SZ */
+	size_t ceiling;
+	off_t origin;		/* logical offset of the first mirrored byte */
+	atomic_size_t len;	/* bytes mirrored, origin + len == store end */
+	atomic_uint_fast64_t gen; /* appends mirrored so far */
+	atomic_bool enabled;
+} mirror_t;
+
+/*
+ * Prepare to mirror from origin, where size bytes already exist (fed in
+ * with mirror_load()). ceiling == 0, or existing data larger than the
+ * ceiling, leaves the mirror disabled (not an error).
+ */
+int mirror_init(mirror_t *m, size_t ceiling, off_t origin, off_t size);
+/* Append the first size bytes of fd, before any reader exists */
+int mirror_load(mirror_t *m, int fd, off_t size);
+void mirror_free(mirror_t *m);
+
+/*
+ * Writer side, serialized by the caller. Returns 0, or -1 the first time
+ * the mirror gives up (ceiling reached or out of memory).
+ */
+int mirror_append(mirror_t *m, const struct iovec *iov, int iovcnt);
+
+/* True if [off, end) can be served from memory */
+bool mirror_covers(mirror_t *m, off_t off, off_t end);
+
+/*
+ * Same contract as reply_send(): send [*off, end) to sock, 0 when done,
+ * 1 if the socket would block, -1 on error.
+ */
+int mirror_send(mirror_t *m, int sock, off_t *off, off_t end, size_t *sent);
+
+#endif
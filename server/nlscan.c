@@ -0,0 +1,166 @@
+#include <string.h> /* memchr */
+
+#include "nlscan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define NL_HAVE_X86 1
+#include <immintrin.h> /* SSE2/AVX2 intrinsics */
+#endif
+
+/* memchr() from pos onwards, appending to offs after the n already there */
+static size_t scan_from(const char *buf, size_t len, size_t pos,
+		uint32_t *offs, size_t n, size_t max, size_t *scanned) {
+	while (n < max && pos < len) {
+		const char *nl = memchr(buf + pos, '\n', len - pos);
+		if (!nl) break;
+		pos = (size_t)(nl - buf) + 1;
+		offs[n++] = (uint32_t)(pos - 1);
+	}
+
+	*scanned = n == max ? pos : len;
+	return n;
+}
+
+static size_t scan_scalar(const char *buf, size_t len, uint32_t *offs,
+		size_t max, size_t *scanned) {
+	return scan_from(buf, len, 0, offs, 0, max, scanned);
+}
+
+#ifdef NL_HAVE_X86
+/*
+ * Record every set bit of a block's compare mask. Returns 0 once offs is
+ * full, with *scanned just past the last offset stored.
+ */
+static inline int take_mask(uint32_t mask, size_t base, uint32_t *offs,
+		size_t *n, size_t max, size_t *scanned) {
+	while (mask) {
+		size_t at = base + (size_t)__builtin_ctz(mask);
+		offs[(*n)++] = (uint32_t)at;
+		if (*n == max) {
+			*scanned = at + 1;
+			return 0;
+		}
+		mask &= mask - 1;
+	}
+	return 1;
+}
+
+/*
+ * The block at *pos of width bytes has no newline: this is a long line,
+ * and glibc's memchr() outruns a block at a time on those. Moves *pos to
+ * the next newline and returns 1, or returns 0 with *scanned = len if
+ * there is none.
+ */
+static inline int skip_line(const char *buf, size_t len, size_t *pos,
+		size_t width, size_t *scanned) {
+	const char *nl = memchr(buf + *pos + width, '\n', len - *pos - width);
+	if (!nl) {
+		*scanned = len;
+		return 0;
+	}
+	*pos = (size_t)(nl - buf);
+	return 1;
+}
+
+__attribute__((target("sse2")))
+static size_t scan_sse2(const char *buf, size_t len, uint32_t *offs,
+		size_t max, size_t *scanned) {
+	const __m128i nl = _mm_set1_epi8('\n');
+	size_t n = 0, pos = 0;
+
+	if (!max) { *scanned = 0; return 0; }
+
+	while (pos + 16 <= len) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(buf + pos));
+		uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+		if (!mask) {
+			if (!skip_line(buf, len, &pos, 16, scanned))
+				return n;
+			continue;
+		}
+		if (!take_mask(mask, pos, offs, &n, max, scanned))
+			return n;
+		pos += 16;
+	}
+
+	return scan_from(buf, len, pos, offs, n, max, scanned);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_avx2(const char *buf, size_t len, uint32_t *offs,
+		size_t max, size_t *scanned) {
+	const __m256i nl = _mm256_set1_epi8('\n');
+	size_t n = 0, pos = 0;
+
+	if (!max) { *scanned = 0; return 0; }
+
+	while (pos + 64 <= len) {
+		__m256i a = _mm256_cmpeq_epi8(nl,
+				_mm256_loadu_si256((const __m256i *)(buf + pos)));
+		__m256i b = _mm256_cmpeq_epi8(nl,
+				_mm256_loadu_si256((const __m256i *)(buf + pos + 32)));
+		if (_mm256_testz_si256(_mm256_or_si256(a, b),
+				_mm256_set1_epi8(-1))) {
+			if (!skip_line(buf, len, &pos, 64, scanned))
+				return n;
+			continue;
+		}
+
+		uint32_t lo = (uint32_t)_mm256_movemask_epi8(a);
+		uint32_t hi = (uint32_t)_mm256_movemask_epi8(b);
+		if (!take_mask(lo, pos, offs, &n, max, scanned)
+				|| !take_mask(hi, pos + 32, offs, &n, max, scanned))
+			return n;
+		pos += 64;
+	}
+
+	return scan_from(buf, len, pos, offs, n, max, scanned);
+}
+#endif
+
+static nl_isa_t best_isa = NL_ISA_SCALAR;
+static nl_scan_fn best_fn = scan_scalar;
+
+/* Runs before main(), so nl_scan() never sees a half-made choice */
+__attribute__((constructor))
+static void nl_scan_select(void) {
+	for (int isa = NL_ISA_MAX - 1; isa >= 0; isa--) {
+		nl_scan_fn fn = nl_scan_get((nl_isa_t)isa);
+		if (fn) {
+			best_isa = (nl_isa_t)isa;
+			best_fn = fn;
+			return;
+		}
+	}
+}
+
+size_t nl_scan(const char *buf, size_t len, uint32_t *offs, size_t max,
+		size_t *scanned) {
+	return best_fn(buf, len, offs, max, scanned);
+}
+
+nl_scan_fn nl_scan_get(nl_isa_t isa) {
+	switch (isa) {
+	case NL_ISA_SCALAR:
+		return scan_scalar;
+#ifdef NL_HAVE_X86
+	case NL_ISA_SSE2:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("sse2") ? scan_sse2 : NULL;
+	case NL_ISA_AVX2:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2") ? scan_avx2 : NULL;
+#endif
+	default:
+		return NULL;
+	}
+}
+
+const char *nl_isa_name(nl_isa_t isa) {
+	static const char *names[NL_ISA_MAX] = { "scalar", "sse2", "avx2" };
+	return isa < NL_ISA_MAX ? names[isa] : "unknown";
+}
+
+nl_isa_t nl_scan_isa(void) {
+	return best_isa;
+}
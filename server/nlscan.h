@@ -0,0 +1,42 @@
+#ifndef __NLSCAN_H__
+#define __NLSCAN_H__
+
+#include <stddef.h> /* size_t */
+#include <stdint.h> /* uint32_t */
+
+/*
+ * Newline indexing for the framing loop. One call records the offsets of
+ * the newlines in a buffer, so framing walks a list instead of calling
+ * memchr() once per line.
+ *
+ * The widest implementation the CPU supports (AVX2, SSE2, scalar) is
+ * picked once at startup. The SIMD ones hand a block without a newline
+ * to memchr(), which is faster on long lines; they only pay off on dense
+ * short lines (see bench/nlscan_bench).
+ */
+
+typedef enum {
+	NL_ISA_SCALAR = 0,
+	NL_ISA_SSE2,
+	NL_ISA_AVX2,
+	NL_ISA_MAX,
+} nl_isa_t;
+
+/*
+ * Store the offsets of up to max newlines in buf[0, len) into offs and
+ * return how many were stored. *scanned is how far the scan got: len if
+ * fewer than max were found, otherwise just past the last stored one.
+ */
+typedef size_t (*nl_scan_fn)(const char *buf, size_t len, uint32_t *offs,
+		size_t max, size_t *scanned);
+
+size_t nl_scan(const char *buf, size_t len, uint32_t *offs, size_t max,
+		size_t *scanned);
+
+/* A specific implementation, NULL if this CPU lacks it (benchmarks) */
+nl_scan_fn nl_scan_get(nl_isa_t isa);
+const char *nl_isa_name(nl_isa_t isa);
+/* The implementation nl_scan() uses */
+nl_isa_t nl_scan_isa(void);
+
+#endif
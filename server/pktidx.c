@@ -0,0 +1,87 @@
+#include <stdlib.h> /* malloc, realloc, free */
+#include <string.h> /* memmove */
+#include <errno.h>  /* errno */
+
+#include "aesd_config.h"
+#include "pktidx.h"
+
+struct pkt_block {
+	off_t base;
+	uint32_t delta[PKTIDX_BLOCK];
+};
+
+void pktidx_init(pktidx_t *idx) {
+	*idx = (pktidx_t){0};
+}
+
+void pktidx_free(pktidx_t *idx) {
+	for (size_t i = 0; i < idx->nblocks; i++)
+		free(idx->blocks[i]);
+	free(idx->blocks);
+	*idx = (pktidx_t){0};
+}
+
+void pktidx_reset(pktidx_t *idx, uint64_t first) {
+	pktidx_free(idx);
+	idx->first_block = first / PKTIDX_BLOCK;
+	idx->first = first;
+	idx->count = first;
+}
+
+int pktidx_push(pktidx_t *idx, off_t off) {
+	uint64_t blk = idx->count / PKTIDX_BLOCK - idx->first_block;
+	size_t slot = idx->count % PKTIDX_BLOCK;
+
+	if (blk == idx->nblocks) {
+		if (idx->nblocks == idx->cap) {
+			size_t cap = idx->cap ? idx->cap * 2 : 16;
+			pkt_block_t **tmp = realloc(idx->blocks, cap * sizeof *tmp);
+			if (!tmp) { errno = ENOMEM; return -1; }
+			idx->blocks = tmp;
+			idx->cap = cap;
+		}
+
+		pkt_block_t *b = malloc(sizeof *b);
+		if (!b) { errno = ENOMEM; return -1; }
+		/* An index reset mid-block starts with a few unused slots */
+		b->base = off;
+		idx->blocks[idx->nblocks++] = b;
+	}
+
+	pkt_block_t *b = idx->blocks[blk];
+	if (off - b->base > (off_t)UINT32_MAX) {
+		errno = EOVERFLOW; /* only a recovered file with huge lines */
+		return -1;
+	}
+	b->delta[slot] = (uint32_t)(off - b->base);
+	idx->count++;
+	return 0;
+}
+
+int pktidx_get(const pktidx_t *idx, uint64_t pkt, off_t *off) {
+	if (pkt < idx->first || pkt >= idx->count) {
+		errno = ERANGE;
+		return -1;
+	}
+
+	const pkt_block_t *b = idx->blocks[pkt / PKTIDX_BLOCK - idx->first_block];
+	*off = b->base + (off_t)b->delta[pkt % PKTIDX_BLOCK];
+	return 0;
+}
+
+void pktidx_drop_before(pktidx_t *idx, uint64_t pkt) {
+	if (pkt > idx->count) pkt = idx->count;
+	if (pkt <= idx->first) return;
+	idx->first = pkt;
+
+	/* Free whole blocks only; the current block may still be filling */
+	size_t drop = (size_t)(pkt / PKTIDX_BLOCK - idx->first_block);
+	if (!drop) return;
+
+	for (size_t i = 0; i < drop; i++)
+		free(idx->blocks[i]);
+	memmove(idx->blocks, idx->blocks + drop,
+		(idx->nblocks - drop) * sizeof *idx->blocks);
+	idx->nblocks -= drop;
+	idx->first_block += drop;
+}
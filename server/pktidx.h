@@ -0,0 +1,47 @@
+#ifndef __PKTIDX_H__
+#define __PKTIDX_H__
+
+#include <stddef.h>    /* size_t */
+#include <stdint.h>    /* uint32_t, uint64_t */
+#include <sys/types.h> /* off_t */
+
+/*
+ * Start offsets of the packets in the data store, by packet number.
+ * Packets are numbered from 0 in arrival order and never renumbered;
+ * retention drops the oldest ones from the front.
+ *
+ * Offsets are kept in blocks of PKTIDX_BLOCK: one full offset for the
+ * block plus a 32-bit delta per packet, so an entry costs 4 bytes. A
+ * block spans at most PKTIDX_BLOCK * MAX_PACKET_MAX bytes, within the
+ * delta range.
+ */
+typedef struct pkt_block pkt_block_t;
+
+typedef struct {
+	pkt_block_t **blocks;	/* blocks[0] holds packet first_block * BLOCK */
+	size_t nblocks;
+	size_t cap;
+	uint64_t first_block;
+	uint64_t first;		/* oldest packet still indexed */
+	uint64_t count;		/* packets ever indexed, next number */
+} pktidx_t;
+
+void pktidx_init(pktidx_t *idx);
+void pktidx_free(pktidx_t *idx);
+
+/* Start the index at packet number first (for an empty store) */
+void pktidx_reset(pktidx_t *idx, uint64_t first);
+
+/*
+ * Record that packet idx->count starts at off. -1 with errno ENOMEM, or
+ * EOVERFLOW if off is more than 4 GiB past the start of its block.
+ */
+int pktidx_push(pktidx_t *idx, off_t off);
+
+/* Start offset of packet pkt; -1 with errno = ERANGE if not indexed */
+int pktidx_get(const pktidx_t *idx, uint64_t pkt, off_t *off);
+
+/* Forget every packet before pkt */
+void pktidx_drop_before(pktidx_t *idx, uint64_t pkt);
+
+#endif
@@ -0,0 +1,175 @@
+#include <stdlib.h>     /* calloc, malloc, free */
+#include <string.h>     /* memcpy */
+#include <errno.h>      /* errno */
+#include <sys/socket.h> /* sendmsg */
+
+#include "pktring.h"
+
+/* iovecs per sendmsg() call when streaming a reply */
+#define RING_IOV_MAX 64
+
+static void pkt_unref(ring_pkt_t *p) {
+	if (atomic_fetch_sub_explicit(&p->refs, 1, memory_order_acq_rel) == 1)
+		free(p);
+}
+
+int pktring_init(pktring_t *r, size_t n) {
+	*r = (pktring_t){0};
+	if (!(r->slots = calloc(n, sizeof *r->slots))) {
+		errno = ENOMEM;
+		return -1;
+	}
+	r->nslots = n;
+	return 0;
+}
+
+static void drop_all(pktring_t *r) {
+	for (size_t i = 0; i < r->nslots; i++) {
+		if (r->slots[i])
+			pkt_unref(r->slots[i]);
+		r->slots[i] = NULL;
+	}
+	r->oldest = 0;
+	r->count = 0;
+}
+
+void pktring_free(pktring_t *r) {
+	if (r->slots)
+		drop_all(r);
+	free(r->slots);
+	*r = (pktring_t){0};
+}
+
+/* Copy len bytes from byte from of iov */
+static void gather(char *dst, const struct iovec *iov, int iovcnt,
+		size_t from, size_t len) {
+	for (int i = 0; i < iovcnt && len; i++) {
+		if (from >= iov[i].iov_len) {
+			from -= iov[i].iov_len;
+			continue;
+		}
+		size_t n = iov[i].iov_len - from;
+		if (n > len) n = len;
+		memcpy(dst, (const char *)iov[i].iov_base + from, n);
+		dst += n;
+		len -= n;
+		from = 0;
+	}
+}
+
+int pktring_push(pktring_t *r, off_t start, const struct iovec *iov,
+		int iovcnt, size_t from, size_t len) {
+	size_t slot = (r->oldest + r->count) % r->nslots;
+	ring_pkt_t *p = r->slots[slot];
+
+	/* Only the ring holds it and no view can pin it meanwhile: reuse */
+	if (!p || atomic_load_explicit(&p->refs, memory_order_acquire) != 1
+			|| p->cap < len) {
+		ring_pkt_t *n = malloc(sizeof *n + len);
+		if (!n) {
+			drop_all(r);
+			errno = ENOMEM;
+			return -1;
+		}
+		atomic_init(&n->refs, 1);
+		n->cap = len;
+		if (p) pkt_unref(p);
+		r->slots[slot] = p = n;
+	}
+
+	gather(p->data, iov, iovcnt, from, len);
+	p->start = start;
+	p->len = len;
+
+	if (r->count < r->nslots)
+		r->count++;
+	else
+		r->oldest = (r->oldest + 1) % r->nslots;
+	return 0;
+}
+
+off_t pktring_start(const pktring_t *r, off_t end) {
+	return r->count ? r->slots[r->oldest]->start : end;
+}
+
+const ring_pkt_t *pktring_get(const pktring_t *r, size_t pkt) {
+	return pkt < r->count ? r->slots[(r->oldest + pkt) % r->nslots] : NULL;
+}
+
+int pktring_view(pktring_t *r, size_t skip, off_t end, pktring_view_t *v,
+		off_t *start) {
+	size_t n = 0;
+	*v = (pktring_view_t){0};
+	*start = end;
+
+	while (skip + n < r->count && pktring_get(r, skip + n)->start < end)
+		n++;
+	if (!n) return 0;
+
+	if (!(v->pkts = malloc(n * sizeof *v->pkts))) {
+		errno = ENOMEM;
+		return -1;
+	}
+	for (size_t i = 0; i < n; i++) {
+		ring_pkt_t *p = r->slots[(r->oldest + skip + i) % r->nslots];
+		atomic_fetch_add_explicit(&p->refs, 1, memory_order_relaxed);
+		v->pkts[i] = p;
+	}
+	v->npkts = n;
+	*start = v->pkts[0]->start;
+	return 0;
+}
+
+void pktring_view_release(pktring_view_t *v) {
+	for (size_t i = v->cur; i < v->npkts; i++)
+		pkt_unref(v->pkts[i]);
+	free(v->pkts);
+	*v = (pktring_view_t){0};
+}
+
+int pktring_send(pktring_view_t *v, int sock, off_t *off, off_t end,
+		size_t *sent) {
+	struct iovec iov[RING_IOV_MAX];
+
+	while (*off < end && v->cur < v->npkts) {
+		int cnt = 0;
+		off_t pos = *off;
+		for (size_t i = v->cur; i < v->npkts && cnt < RING_IOV_MAX
+				&& pos < end; i++) {
+			ring_pkt_t *p = v->pkts[i];
+			off_t stop = p->start + (off_t)p->len;
+			if (stop > end) stop = end;
+			if (pos >= stop) continue;
+
+			iov[cnt].iov_base = p->data + (pos - p->start);
+			iov[cnt].iov_len = (size_t)(stop - pos);
+			cnt++;
+			pos = stop;
+		}
+		if (!cnt) break;
+
+		struct msghdr msg = { .msg_iov = iov, .msg_iovlen = cnt };
+		ssize_t w = sendmsg(sock, &msg, MSG_NOSIGNAL);
+		if (w == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+			if (errno == EPIPE || errno == ECONNRESET) break;
+			return -1;
+		}
+
+		*off += w;
+		*sent += (size_t)w;
+
+		/* Let go of the packets that are on the wire */
+		while (v->cur < v->npkts) {
+			ring_pkt_t *p = v->pkts[v->cur];
+			if (p->start + (off_t)p->len > *off) break;
+			pkt_unref(p);
+			v->cur++;
+		}
+	}
+
+	*off = end;
+	pktring_view_release(v);
+	return 0;
+}
@@ -0,0 +1,75 @@
+#ifndef __PKTRING_H__
+#define __PKTRING_H__
+
+#include <stddef.h>    /* size_t */
+#include <stdatomic.h> /* atomics */
+#include <sys/types.h> /* off_t */
+#include <sys/uio.h>   /* struct iovec */
+
+/*
+ * Circular buffer of the last N packets, kept in memory only. Pushing
+ * the N+1st packet overwrites the oldest one.
+ *
+ * Each slot owns one packet buffer. A buffer is refcounted so a reply
+ * still streaming an overwritten packet keeps it alive; once only the
+ * ring holds it, its memory is reused in place for the next packet that
+ * fits. The ring itself is not locked; the caller serializes pushes and
+ * views (the store lock).
+ */
+typedef struct ring_pkt {
+	atomic_int refs;	/* the ring's slot plus views */
+	off_t start;		/* logical offset of the first byte */
+	size_t len;
+	size_t cap;
+	char data[];
+} ring_pkt_t;
+
+typedef struct {
+	ring_pkt_t **slots;
+	size_t nslots;		/* N */
+	size_t oldest;		/* slot of the oldest packet */
+	size_t count;		/* packets held, up to nslots */
+} pktring_t;
+
+/* Pinned packets of a reply, oldest first */
+typedef struct {
+	ring_pkt_t **pkts;	/* NULL: nothing pinned */
+	size_t npkts;
+	size_t cur;		/* first packet not fully sent */
+} pktring_view_t;
+
+int pktring_init(pktring_t *r, size_t n);
+void pktring_free(pktring_t *r);
+
+/*
+ * Store the len bytes found at byte from of iov as the packet starting at
+ * logical offset start. -1 with errno = ENOMEM; the ring is emptied
+ * then, so the packets it holds stay contiguous.
+ */
+int pktring_push(pktring_t *r, off_t start, const struct iovec *iov,
+		int iovcnt, size_t from, size_t len);
+
+/* Logical offset of the oldest packet held, or end when empty */
+off_t pktring_start(const pktring_t *r, off_t end);
+
+/* Packet pkt, counted from the oldest held; NULL if there is none */
+const ring_pkt_t *pktring_get(const pktring_t *r, size_t pkt);
+
+/*
+ * Pin the packets from the skip-th oldest on that start before end.
+ * *start is where they begin (end if none). -1 with errno = ENOMEM,
+ * leaving the view empty.
+ */
+int pktring_view(pktring_t *r, size_t skip, off_t end, pktring_view_t *v,
+		off_t *start);
+void pktring_view_release(pktring_view_t *v);
+
+/*
+ * Same contract as reply_send(): send [*off, end) of the view to sock
+ * with gathered writes, 0 when done, 1 if the socket would block, -1 on
+ * error. Packets are unpinned as they are passed.
+ */
+int pktring_send(pktring_view_t *v, int sock, off_t *off, off_t end,
+		size_t *sent);
+
+#endif
@@ -0,0 +1,110 @@
+#define _GNU_SOURCE	/* splice, F_SETPIPE_SZ */
+#include <errno.h>        /* errno */
+#include <fcntl.h>        /* splice, fcntl */
+#include <unistd.h>       /* pipe2, close */
+#include <sys/sendfile.h> /* sendfile */
+
+#include "aesd_config.h"
+#include "reply.h"
+
+void reply_xfer_init(reply_xfer_t *x) {
+	x->pipe_rd = -1;
+	x->pipe_wr = -1;
+	x->piped = 0;
+	x->chunk = WRITE_CHUNK_SZ;
+	x->no_sendfile = false;
+}
+
+void reply_xfer_release(reply_xfer_t *x) {
+	if (x->pipe_rd != -1) close(x->pipe_rd);
+	if (x->pipe_wr != -1) close(x->pipe_wr);
+	x->pipe_rd = -1;
+	x->pipe_wr = -1;
+	x->piped = 0;
+}
+
+static inline size_t chunk(const reply_xfer_t *x, off_t off, off_t end) {
+	if (end - off > (off_t)x->chunk)
+		return x->chunk;
+	return (size_t)(end - off);
+}
+
+static inline bool peer_gone(int err) {
+	return err == EPIPE || err == ECONNRESET;
+}
+
+static int send_spliced(reply_xfer_t *x, int sock, int file_fd, off_t *off,
+		off_t end, size_t *sent) {
+	if (x->pipe_rd == -1) {
+		int p[2];
+		if (pipe2(p, O_CLOEXEC) == -1) return -1;
+		x->pipe_rd = p[0];
+		x->pipe_wr = p[1];
+		/* Best effort, the default 64 KiB also works */
+		fcntl(x->pipe_wr, F_SETPIPE_SZ, (int)x->chunk);
+	}
+
+	for (;;) {
+		if (!x->piped) {
+			if (*off >= end) return 0;
+
+			loff_t in_off = *off;
+			ssize_t n = splice(file_fd, &in_off, x->pipe_wr, NULL,
+					   chunk(x, *off, end), SPLICE_F_MOVE);
+			if (n == -1) {
+				if (errno == EINTR) continue;
+				return -1;
+			}
+			if (!n) { *off = end; return 0; } /* file shrank */
+			x->piped = (size_t)n;
+		}
+
+		ssize_t w = splice(x->pipe_rd, NULL, sock, NULL, x->piped,
+				   SPLICE_F_MOVE);
+		if (w == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+			if (peer_gone(errno)) {
+				/* Leftovers in the pipe are useless now */
+				reply_xfer_release(x);
+				*off = end;
+				return 0;
+			}
+			return -1;
+		}
+
+		x->piped -= (size_t)w;
+		*off += w;
+		*sent += (size_t)w;
+	}
+}
+
+int reply_send(reply_xfer_t *x, int sock, int file_fd, off_t *off,
+		off_t end, size_t *sent) {
+	/* Finish what an earlier splice parked in the pipe first */
+	if (x->no_sendfile || x->piped)
+		return send_spliced(x, sock, file_fd, off, end, sent);
+
+	while (*off < end) {
+		off_t before = *off;
+		ssize_t n = sendfile(sock, file_fd, off, chunk(x, *off, end));
+		if (n > 0) {
+			*sent += (size_t)n;
+			continue;
+		}
+		if (!n) { *off = end; return 0; } /* file shrank */
+
+		/* sendfile leaves *off alone on error, but be explicit */
+		*off = before;
+		if (errno == EINTR) continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+		if (peer_gone(errno)) { *off = end; return 0; }
+		if (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) {
+			x->no_sendfile = true;
+			return send_spliced(x, sock, file_fd, off, end, sent);
+		}
+		return -1;
+	}
+
+	return 0;
+}
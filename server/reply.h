@@ -0,0 +1,35 @@
+#ifndef __REPLY_H__
+#define __REPLY_H__
+
+#include <stdbool.h>   /* bool */
+#include <stddef.h>    /* size_t */
+#include <sys/types.h> /* off_t */
+
+/*
+ * Zero-copy transfer of a file range to a socket. sendfile(2) is tried
+ * first; if the file or socket does not support it, the data is spliced
+ * through a pipe that is created on first use and kept for the
+ * connection.
+ */
+typedef struct {
+	int pipe_rd;		/* splice fallback, -1 until first needed */
+	int pipe_wr;
+	size_t piped;		/* read from the file, not yet on the socket */
+	size_t chunk;		/* most bytes per call, WRITE_CHUNK_SZ by default */
+	bool no_sendfile;
+} reply_xfer_t;
+
+void reply_xfer_init(reply_xfer_t *x);
+/* Idempotent, drops anything still parked in the pipe */
+void reply_xfer_release(reply_xfer_t *x);
+
+/*
+ * Send [*off, end) of file_fd to sock. *off and *sent advance by the
+ * bytes that reached the socket, including on a partial send. Returns 0
+ * once the range is done, 1 if the socket would block, -1 on error.
+ * A peer that went away (EPIPE/ECONNRESET) ends the transfer quietly.
+ */
+int reply_send(reply_xfer_t *x, int sock, int file_fd, off_t *off,
+		off_t end, size_t *sent);
+
+#endif
@@ -1,27 +1,60 @@
+#include <string.h> /* memcpy */
+
+#include "aesd_config.h"
 #include "sb.h"
+#include "bufpool.h"
 
 int sb_init(StringBuilder *sb, size_t initial_cap, size_t max_cap) {
-	if (initial_cap == 0) initial_cap = 4096;
+	return sb_init_pool(sb, NULL, initial_cap, max_cap);
+}
+
+int sb_init_pool(StringBuilder *sb, struct bufpool *pool, size_t initial_cap,
+		size_t max_cap) {
+	sb->len = 0;
+	sb->pool = pool;
 	if (initial_cap > max_cap) initial_cap = max_cap;
+	if (initial_cap == 0) {
+		sb->str = NULL;
+		sb->cap = 0;
+		return 0;
+	}
 
-	sb->str = malloc(initial_cap);
+	if (pool) {
+		sb->str = bp_get(pool, initial_cap, &initial_cap);
+	} else {
+		sb->str = malloc(initial_cap);
+	}
 	if (!sb->str)
 		return -1;
 
 	sb->cap = initial_cap;
-	sb->len = 0;
 	return 0;
 }
 
 /* Idempotent free */
 void sb_free(StringBuilder *sb) {
 	if (!sb->str) return;
-	free(sb->str);
+	if (sb->pool) bp_put(sb->pool, sb->str, sb->cap);
+	else free(sb->str);
 	sb->str = NULL;
 	sb->cap = 0;
 	sb->len = 0;
 }
 
+/* Move the contents into a pool buffer of at least cap bytes */
+static int pool_move(StringBuilder *sb, size_t cap) {
+	size_t got;
+	char *buf = bp_get(sb->pool, cap, &got);
+	if (!buf) return -1;
+
+	if (sb->len)
+		memcpy(buf, sb->str, sb->len);
+	bp_put(sb->pool, sb->str, sb->cap);
+	sb->str = buf;
+	sb->cap = got;
+	return 0;
+}
+
 int sb_reserve(StringBuilder *sb, size_t need, size_t max_cap) {
 	if (!sb) { errno = EINVAL; return -1; }
 
@@ -33,10 +66,9 @@ int sb_reserve(StringBuilder *sb, size_t need, size_t max_cap) {
 	if (sb->cap >= need) return 0;
 
 	size_t new_cap = sb->cap;
-	const size_t MIN_CAP = 4096;
 	const size_t FACTOR = 2;
 
-	if (new_cap < MIN_CAP) new_cap = MIN_CAP;
+	if (new_cap < SB_MIN_CAP) new_cap = SB_MIN_CAP;
 
 	/* Safe growth to above need */
 	while (new_cap < need) {
@@ -50,6 +82,10 @@ int sb_reserve(StringBuilder *sb, size_t need, size_t max_cap) {
 
 	if (new_cap > max_cap) new_cap = max_cap;
 
+	/* The pool rounds up to its size class, so cap may exceed max_cap */
+	if (sb->pool)
+		return pool_move(sb, new_cap);
+
 	void *tmp = realloc(sb->str, new_cap);
 	if (!tmp) { errno = ENOMEM; return -1; }
 
@@ -58,6 +94,22 @@ int sb_reserve(StringBuilder *sb, size_t need, size_t max_cap) {
 	return 0;
 }
 
+void sb_trim(StringBuilder *sb, size_t cap) {
+	if (sb->cap <= cap || sb->len > cap)
+		return;
+
+	/* Best effort: on failure the larger buffer is simply kept */
+	if (sb->pool) {
+		pool_move(sb, cap);
+		return;
+	}
+
+	void *tmp = realloc(sb->str, cap);
+	if (!tmp) return;
+	sb->str = tmp;
+	sb->cap = cap;
+}
+
 void sb_clear(StringBuilder *sb) {
 	sb->len = 0;
 }
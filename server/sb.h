@@ -7,21 +7,33 @@
 
 /*
  * Invariants for all API calls:
- * Success - sb->str != NULL
+ * Success - sb->str != NULL, except for a builder with cap 0 (created
+ *	     with initial_cap 0, or after sb_free()), which allocates on
+ *	     its first sb_reserve()
  *	   - 0  <= sb->len <= sb->cap
  *	   - NOT NULL-TERMINATED
  * Failure - all fields are UNCHANGED
  * 	   - errno set to ENOMEM or EOVERFLOW accordingly
  */
+struct bufpool;
+
 typedef struct StringBuilder {
 	char *str;
 	size_t cap;
 	size_t len;
+	struct bufpool *pool;	/* NULL: plain malloc/realloc */
 } StringBuilder;
 
+/* initial_cap 0 allocates nothing until the first sb_reserve() */
 int sb_init(StringBuilder *sb, size_t initial_cap, size_t max_cap);
+/* Same, but every buffer is drawn from and returned to pool */
+int sb_init_pool(StringBuilder *sb, struct bufpool *pool, size_t initial_cap,
+		size_t max_cap);
+/* Release the buffer; the builder stays usable with cap 0 */
 void sb_free(StringBuilder *sb);
 int sb_reserve(StringBuilder *sb, size_t need, size_t max_cap);
+/* Shrink to cap (keeping the contents) if len fits; no-op otherwise */
+void sb_trim(StringBuilder *sb, size_t cap);
 void sb_clear(StringBuilder *sb);
 size_t sb_len(const StringBuilder *sb);
 size_t sb_cap(const StringBuilder *sb);
@@ -0,0 +1,686 @@
+#include <stdio.h>    /* snprintf */
+#include <stdlib.h>   /* malloc, calloc, free, qsort, strtoul */
+#include <string.h>   /* strdup, strrchr, strncmp */
+#include <errno.h>    /* errno */
+#include <limits.h>   /* PATH_MAX */
+#include <unistd.h>   /* close, unlink, pread, fdatasync, ftruncate */
+#include <fcntl.h>    /* open */
+#include <dirent.h>   /* opendir, readdir */
+#include <syslog.h>   /* syslog */
+#include <sys/stat.h> /* fstat */
+
+#include "aesd_config.h"
+#include "store.h"
+#include "gcommit.h" /* gc_writev_all */
+#include "nlscan.h"  /* nl_scan */
+
+#define SEG_OPEN_FLAGS (O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC)
+
+static void seg_path(const store_t *st, unsigned long seq, char *buf,
+		size_t size) {
+	if (st->segmented)
+		snprintf(buf, size, "%s.%06lu", st->path, seq);
+	else
+		snprintf(buf, size, "%s", st->path);
+}
+
+static store_seg_t *seg_new(int fd, unsigned long seq, off_t start,
+		off_t size) {
+	store_seg_t *seg = malloc(sizeof *seg);
+	if (!seg) { errno = ENOMEM; return NULL; }
+
+	seg->fd = fd;
+	seg->seq = seq;
+	seg->start = start;
+	seg->size = size;
+	seg->sealed_end = 0;
+	atomic_init(&seg->refs, 1);
+	atomic_init(&seg->next, NULL);
+	seg->dropped = NULL;
+	return seg;
+}
+
+static void seg_unref(store_seg_t *seg) {
+	if (atomic_fetch_sub_explicit(&seg->refs, 1, memory_order_acq_rel) != 1)
+		return;
+	close(seg->fd);
+	free(seg);
+}
+
+/* Link a new tail; readers may follow next without the lock */
+static void seg_append(store_t *st, store_seg_t *seg) {
+	if (st->tail) {
+		st->tail->sealed_end = seg->start;
+		atomic_store_explicit(&st->tail->next, seg, memory_order_release);
+	} else {
+		st->head = seg;
+	}
+	st->tail = seg;
+}
+
+/*
+ * Index the packets starting in len bytes at logical offset base: one at
+ * base if a line ends right before it, one after every newline inside.
+ */
+static void index_bytes(store_t *st, off_t base, const char *buf,
+		size_t len) {
+	uint32_t offs[NL_BATCH];
+	size_t done = 0;
+
+	if (!len) return;
+
+	if (st->line_start && !st->idx_broken
+			&& pktidx_push(&st->idx, base) == -1)
+		st->idx_broken = true;
+
+	while (done < len) {
+		size_t scanned;
+		size_t n = nl_scan(buf + done, len - done, offs, NL_BATCH,
+				   &scanned);
+		for (size_t i = 0; i < n && !st->idx_broken; i++) {
+			size_t next = done + offs[i] + 1;
+			if (next < len && pktidx_push(&st->idx,
+					base + (off_t)next) == -1)
+				st->idx_broken = true;
+		}
+		done += scanned;
+	}
+
+	st->line_start = buf[len - 1] == '\n';
+}
+
+/* Index what a recovered segment already holds */
+static int index_segment(store_t *st, store_seg_t *seg) {
+	char *buf = malloc(RECV_BUF_SZ);
+	if (!buf) { errno = ENOMEM; return -1; }
+
+	off_t off = 0;
+	while (off < seg->size) {
+		ssize_t n = pread(seg->fd, buf, RECV_BUF_SZ, off);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			free(buf);
+			return -1;
+		}
+		if (!n) break; /* shrank, keep what is there */
+		index_bytes(st, seg->start + off, buf, (size_t)n);
+		off += n;
+	}
+
+	free(buf);
+	seg->size = off;
+	return 0;
+}
+
+/* Adopt fd as the next segment and index its contents */
+static int adopt(store_t *st, int fd, unsigned long seq) {
+	struct stat sb;
+	if (fstat(fd, &sb) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	store_seg_t *seg = seg_new(fd, seq, st->end, sb.st_size);
+	if (!seg) {
+		close(fd);
+		return -1;
+	}
+
+	if (index_segment(st, seg) == -1) {
+		seg_unref(seg);
+		return -1;
+	}
+
+	seg_append(st, seg);
+	st->end += seg->size;
+	return 0;
+}
+
+static int cmp_seq(const void *a, const void *b) {
+	unsigned long x = *(const unsigned long *)a;
+	unsigned long y = *(const unsigned long *)b;
+	return (x > y) - (x < y);
+}
+
+/* Sequence numbers of the existing "<path>.NNNNNN" files, ascending */
+static int list_segments(const store_t *st, unsigned long **seqs,
+		size_t *nseqs) {
+	char dir[PATH_MAX];
+	const char *slash = strrchr(st->path, '/');
+	const char *base = slash ? slash + 1 : st->path;
+	size_t base_len = strlen(base);
+
+	if (slash)
+		snprintf(dir, sizeof dir, "%.*s", (int)(slash - st->path + 1),
+			 st->path);
+	else
+		snprintf(dir, sizeof dir, ".");
+
+	DIR *d = opendir(dir);
+	if (!d) return -1;
+
+	size_t n = 0, cap = 0;
+	unsigned long *v = NULL;
+	struct dirent *de;
+	while ((de = readdir(d))) {
+		const char *name = de->d_name;
+		if (strncmp(name, base, base_len) || name[base_len] != '.')
+			continue;
+
+		char *endp;
+		const char *num = name + base_len + 1;
+		if (*num < '0' || *num > '9') continue;
+		unsigned long seq = strtoul(num, &endp, 10);
+		if (*endp) continue;
+
+		if (n == cap) {
+			cap = cap ? cap * 2 : 16;
+			unsigned long *tmp = realloc(v, cap * sizeof *v);
+			if (!tmp) {
+				free(v);
+				closedir(d);
+				errno = ENOMEM;
+				return -1;
+			}
+			v = tmp;
+		}
+		v[n++] = seq;
+	}
+	closedir(d);
+
+	if (n) qsort(v, n, sizeof *v, cmp_seq);
+	*seqs = v;
+	*nseqs = n;
+	return 0;
+}
+
+static int open_seg_file(store_t *st, unsigned long seq, int extra) {
+	char path[PATH_MAX];
+	seg_path(st, seq, path, sizeof path);
+	return open(path, SEG_OPEN_FLAGS | extra, 0644);
+}
+
+static int recover(store_t *st) {
+	if (!st->segmented) {
+		int fd = open_seg_file(st, 0, 0);
+		return fd == -1 ? -1 : adopt(st, fd, 0);
+	}
+
+	unsigned long *seqs;
+	size_t n;
+	if (list_segments(st, &seqs, &n) == -1)
+		return -1;
+
+	for (size_t i = 0; i < n; i++) {
+		int fd = open_seg_file(st, seqs[i], 0);
+		if (fd == -1 || adopt(st, fd, seqs[i]) == -1) {
+			free(seqs);
+			return -1;
+		}
+	}
+	free(seqs);
+
+	if (st->tail)
+		return 0;
+
+	int fd = open_seg_file(st, 0, O_TRUNC);
+	return fd == -1 ? -1 : adopt(st, fd, 0);
+}
+
+/*
+ * Move the window forward to the limits and unlink the segments that
+ * fell out of it; those are handed back in *dropped for the caller to
+ * unref once it no longer holds the lock.
+ */
+static void apply_retention(store_t *st, store_seg_t **dropped) {
+	const store_opts_t *o = &st->opts;
+	*dropped = NULL;
+
+	if (!o->keep_bytes && !o->keep_packets)
+		return;
+
+	if (!st->idx_broken) {
+		pktidx_t *idx = &st->idx;
+		uint64_t first = idx->first;
+		off_t off;
+
+		/* Always keep the newest packet */
+		while (first + 1 < idx->count
+				&& pktidx_get(idx, first, &off) == 0) {
+			bool over = (o->keep_packets
+					&& idx->count - first > o->keep_packets)
+				|| (o->keep_bytes && st->end - off > o->keep_bytes);
+			if (!over) break;
+			first++;
+		}
+
+		pktidx_drop_before(idx, first);
+		if (pktidx_get(idx, first, &off) == 0)
+			st->start = off;
+	} else if (o->keep_bytes) {
+		/* No packet boundaries: whole segments only */
+		for (store_seg_t *seg = st->head; seg != st->tail;
+				seg = atomic_load_explicit(&seg->next,
+							   memory_order_relaxed)) {
+			if (st->end - seg->sealed_end < o->keep_bytes)
+				break;
+			st->start = seg->sealed_end;
+		}
+	}
+
+	/* Pinned readers keep a dropped segment's fd and next alive */
+	store_seg_t **link = dropped;
+	while (st->head != st->tail && st->head->sealed_end <= st->start) {
+		store_seg_t *seg = st->head;
+		st->head = atomic_load_explicit(&seg->next,
+						memory_order_relaxed);
+
+		char path[PATH_MAX];
+		seg_path(st, seg->seq, path, sizeof path);
+		unlink(path);
+
+		*link = seg;
+		link = &seg->dropped;
+	}
+}
+
+static void unref_dropped(store_seg_t *seg) {
+	while (seg) {
+		store_seg_t *next = seg->dropped;
+		seg_unref(seg);
+		seg = next;
+	}
+}
+
+/* Memory only: nothing to recover, the ring starts out empty */
+static int open_ring(store_t *st) {
+	const store_opts_t *o = &st->opts;
+	if (o->seg_bytes || o->keep_bytes || o->keep_packets) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (pktring_init(&st->ring, o->ring_packets) == -1)
+		return -1;
+	if ((errno = pthread_mutex_init(&st->lock, NULL)) != 0) {
+		pktring_free(&st->ring);
+		return -1;
+	}
+	return 0;
+}
+
+int store_open(store_t *st, const char *path, const store_opts_t *opts) {
+	*st = (store_t){0};
+	st->opts = *opts;
+	st->line_start = true;
+	pktidx_init(&st->idx);
+
+	if (opts->ring_packets) {
+		if (!(st->path = strdup(path))) {
+			errno = ENOMEM;
+			return -1;
+		}
+		if (open_ring(st) == -1) {
+			int saved_errno = errno;
+			free(st->path);
+			st->path = NULL;
+			errno = saved_errno;
+			return -1;
+		}
+		return 0;
+	}
+
+	/* Retention needs something to delete: default segment size */
+	if (!st->opts.seg_bytes && (opts->keep_bytes || opts->keep_packets))
+		st->opts.seg_bytes = STORE_SEG_BYTES;
+	st->segmented = st->opts.seg_bytes > 0;
+
+	if (!(st->path = strdup(path))) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if ((errno = pthread_mutex_init(&st->lock, NULL)) != 0) {
+		free(st->path);
+		return -1;
+	}
+
+	if (recover(st) == -1) {
+		int saved_errno = errno;
+		store_close(st, false);
+		errno = saved_errno;
+		return -1;
+	}
+
+	store_seg_t *dropped;
+	apply_retention(st, &dropped);
+	unref_dropped(dropped);
+	atomic_store(&st->committed, st->end);
+
+	if (st->idx_broken)
+		syslog(LOG_WARNING, "%s: lines too long to index, retention "
+		       "falls back to whole segments", st->path);
+	return 0;
+}
+
+void store_close(store_t *st, bool unlink_files) {
+	store_seg_t *seg = st->head;
+	while (seg) {
+		store_seg_t *next = atomic_load(&seg->next);
+		if (unlink_files) {
+			char path[PATH_MAX];
+			seg_path(st, seg->seq, path, sizeof path);
+			unlink(path);
+		}
+		seg_unref(seg);
+		seg = next;
+	}
+	st->head = st->tail = NULL;
+
+	pktring_free(&st->ring);
+	pktidx_free(&st->idx);
+	pthread_mutex_destroy(&st->lock);
+	free(st->path);
+	st->path = NULL;
+}
+
+/* Start a new tail segment; on failure keep appending to the old one */
+static void roll(store_t *st) {
+	/* The flusher only ever syncs the tail, so settle the old one first */
+	if (st->opts.sync_roll && fdatasync(st->tail->fd) == -1)
+		syslog(LOG_ERR, "%s: fdatasync of segment %lu: %s", st->path,
+		       st->tail->seq, strerror(errno));
+
+	unsigned long seq = st->tail->seq + 1;
+	int fd = open_seg_file(st, seq, O_TRUNC);
+	store_seg_t *seg = fd == -1 ? NULL : seg_new(fd, seq, st->end, 0);
+	if (!seg) {
+		if (fd != -1) close(fd);
+		syslog(LOG_WARNING, "%s: cannot start segment %lu: %s",
+		       st->path, seq, strerror(errno));
+		return;
+	}
+
+	pthread_mutex_lock(&st->lock);
+	seg_append(st, seg);
+	pthread_mutex_unlock(&st->lock);
+}
+
+int store_cut_back(store_t *st) {
+	if (st->opts.ring_packets)
+		return 0;
+
+	while (ftruncate(st->tail->fd, st->tail->size) == -1) {
+		if (errno == EINTR) continue;
+		syslog(LOG_CRIT, "%s: cannot drop a partial write, refusing "
+		       "further data: %s", st->path, strerror(errno));
+		st->torn = true;
+		return -1;
+	}
+	return 0;
+}
+
+int store_write(store_t *st, struct iovec *iov, int iovcnt, bool sync,
+		size_t *written) {
+	if (st->opts.ring_packets) {
+		/* The bytes are copied into the ring by store_commit() */
+		*written = 0;
+		for (int i = 0; i < iovcnt; i++)
+			*written += iov[i].iov_len;
+		return 0;
+	}
+
+	if (st->torn) {
+		*written = 0;
+		errno = EIO;
+		return -1;
+	}
+
+	if (st->segmented && st->tail->size >= st->opts.seg_bytes)
+		roll(st);
+
+	if (gc_writev_all(st->tail->fd, iov, iovcnt, written) == -1) {
+		int saved_errno = errno;
+		if (*written)
+			store_cut_back(st);
+		*written = 0;
+		errno = saved_errno;
+		return -1;
+	}
+	if (sync && fdatasync(st->tail->fd) == -1)
+		return -1;
+	return 0;
+}
+
+int store_sync(store_t *st) {
+	if (st->opts.ring_packets) return 0;
+
+	/* Pin the tail so a roll and retention cannot close it under us */
+	pthread_mutex_lock(&st->lock);
+	store_seg_t *seg = st->tail;
+	atomic_fetch_add_explicit(&seg->refs, 1, memory_order_relaxed);
+	pthread_mutex_unlock(&st->lock);
+
+	int rc = fdatasync(seg->fd);
+	int saved_errno = errno;
+	seg_unref(seg);
+	errno = saved_errno;
+	return rc;
+}
+
+/* One ring entry per line; a coalesced commit carries several */
+static void ring_commit(store_t *st, const struct iovec *iov, int iovcnt,
+		size_t len) {
+	uint32_t offs[NL_BATCH];
+	size_t pos = 0, line = 0;
+
+	for (int i = 0; i < iovcnt; i++) {
+		const char *buf = iov[i].iov_base;
+		size_t done = 0;
+		while (done < iov[i].iov_len) {
+			size_t scanned;
+			size_t n = nl_scan(buf + done, iov[i].iov_len - done,
+					   offs, NL_BATCH, &scanned);
+			for (size_t k = 0; k < n; k++) {
+				size_t stop = pos + done + offs[k] + 1;
+				if (pktring_push(&st->ring, st->end + (off_t)line,
+						iov, iovcnt, line, stop - line) == -1)
+					syslog(LOG_ERR, "packet ring: %s, dropped "
+					       "what it held", strerror(errno));
+				line = stop;
+			}
+			done += scanned;
+		}
+		pos += iov[i].iov_len;
+	}
+
+	/* Unterminated tail: keep it as a packet of its own */
+	if (line < len && pktring_push(&st->ring, st->end + (off_t)line,
+			iov, iovcnt, line, len - line) == -1)
+		syslog(LOG_ERR, "packet ring: %s, dropped what it held",
+		       strerror(errno));
+
+	st->end += (off_t)len;
+	st->start = pktring_start(&st->ring, st->end);
+	atomic_store_explicit(&st->committed, st->end, memory_order_release);
+}
+
+off_t store_commit(store_t *st, const struct iovec *iov, int iovcnt,
+		size_t len) {
+	store_seg_t *dropped;
+
+	pthread_mutex_lock(&st->lock);
+	if (st->opts.ring_packets) {
+		ring_commit(st, iov, iovcnt, len);
+		off_t end = st->end;
+		pthread_mutex_unlock(&st->lock);
+		return end;
+	}
+
+	off_t base = st->end;
+	for (int i = 0; i < iovcnt; i++) {
+		index_bytes(st, base, iov[i].iov_base, iov[i].iov_len);
+		base += (off_t)iov[i].iov_len;
+	}
+	st->tail->size += (off_t)len;
+	st->end += (off_t)len;
+	atomic_store_explicit(&st->committed, st->end, memory_order_release);
+	apply_retention(st, &dropped);
+	off_t end = st->end;
+	pthread_mutex_unlock(&st->lock);
+
+	unref_dropped(dropped);
+	return end;
+}
+
+off_t store_end(store_t *st) {
+	return atomic_load_explicit(&st->committed, memory_order_acquire);
+}
+
+int store_single_fd(store_t *st) {
+	return st->segmented || !st->tail ? -1 : st->tail->fd;
+}
+
+/* Pin the segments holding [s, end), under the lock */
+static void pin_segments(store_t *st, off_t s, off_t end, store_snap_t *snap) {
+	store_seg_t *seg = st->head, *next;
+	while ((next = atomic_load_explicit(&seg->next, memory_order_relaxed))
+			&& next->start <= s)
+		seg = next;
+
+	snap->seg = s < end ? seg : NULL;
+	snap->end = end;
+	for (store_seg_t *p = snap->seg; p && p->start < end;
+			p = atomic_load_explicit(&p->next, memory_order_relaxed))
+		atomic_fetch_add_explicit(&p->refs, 1, memory_order_relaxed);
+}
+
+void store_snapshot(store_t *st, off_t end, store_snap_t *snap,
+		off_t *start) {
+	/* The only segment is never dropped: pin it without the lock */
+	if (!st->segmented && !st->opts.ring_packets) {
+		store_seg_t *seg = st->head;
+		*start = seg->start < end ? seg->start : end;
+		snap->seg = *start < end ? seg : NULL;
+		snap->end = end;
+		if (snap->seg)
+			atomic_fetch_add_explicit(&seg->refs, 1,
+						  memory_order_relaxed);
+		return;
+	}
+
+	pthread_mutex_lock(&st->lock);
+	if (st->opts.ring_packets) {
+		snap->seg = NULL;
+		snap->end = end;
+		if (pktring_view(&st->ring, 0, end, &snap->view, start) == -1) {
+			syslog(LOG_ERR, "packet ring: no memory for a reply");
+			*start = end;
+		}
+		pthread_mutex_unlock(&st->lock);
+		return;
+	}
+
+	off_t s = st->start < end ? st->start : end;
+	pin_segments(st, s, end, snap);
+	pthread_mutex_unlock(&st->lock);
+
+	*start = s;
+}
+
+/* Start and length of packet cmd of the window, from the index */
+static int seek_packet(store_t *st, uint64_t cmd, off_t *at, off_t *len) {
+	off_t next;
+
+	if (st->opts.ring_packets) {
+		const ring_pkt_t *p = pktring_get(&st->ring, cmd);
+		if (!p) return -1;
+		*at = p->start;
+		*len = (off_t)p->len;
+		return 0;
+	}
+
+	if (st->idx_broken)
+		return -1;
+
+	uint64_t pkt = st->idx.first + cmd;
+	if (cmd >= st->idx.count - st->idx.first
+			|| pktidx_get(&st->idx, pkt, at) == -1)
+		return -1;
+	if (pktidx_get(&st->idx, pkt + 1, &next) == -1)
+		next = st->end;
+	*len = next - *at;
+	return 0;
+}
+
+int store_seek(store_t *st, uint64_t cmd, uint64_t in, store_snap_t *snap,
+		off_t *off, off_t *end) {
+	off_t at, len;
+
+	pthread_mutex_lock(&st->lock);
+	if (seek_packet(st, cmd, &at, &len) == -1 || in >= (uint64_t)len) {
+		pthread_mutex_unlock(&st->lock);
+		errno = EINVAL;
+		return -1;
+	}
+
+	*off = at + (off_t)in;
+	*end = st->end;
+	if (st->opts.ring_packets) {
+		off_t first;
+		snap->seg = NULL;
+		snap->end = *end;
+		if (pktring_view(&st->ring, (size_t)cmd, *end, &snap->view,
+				&first) == -1) {
+			pthread_mutex_unlock(&st->lock);
+			return -1;
+		}
+	} else {
+		pin_segments(st, *off, *end, snap);
+	}
+	pthread_mutex_unlock(&st->lock);
+	return 0;
+}
+
+void store_snap_release(store_snap_t *snap) {
+	store_seg_t *seg = snap->seg;
+	while (seg && seg->start < snap->end) {
+		/* Read next first: the unref may free seg */
+		store_seg_t *next = atomic_load_explicit(&seg->next,
+							 memory_order_acquire);
+		seg_unref(seg);
+		seg = next;
+	}
+	snap->seg = NULL;
+	pktring_view_release(&snap->view);
+}
+
+int store_send(store_snap_t *snap, reply_xfer_t *x, int sock, off_t *off,
+		size_t *sent) {
+	if (snap->view.pkts)
+		return pktring_send(&snap->view, sock, off, snap->end, sent);
+
+	while (*off < snap->end) {
+		store_seg_t *seg = snap->seg;
+		store_seg_t *next = atomic_load_explicit(&seg->next,
+							 memory_order_acquire);
+		off_t limit = snap->end;
+		if (next && seg->sealed_end < limit)
+			limit = seg->sealed_end;
+
+		/* reply_send() works on file offsets */
+		off_t foff = *off - seg->start;
+		int rc = reply_send(x, sock, seg->fd, &foff, limit - seg->start,
+				    sent);
+		*off = seg->start + foff;
+		if (rc) return rc;
+
+		if (*off < snap->end) {
+			snap->seg = next;
+			seg_unref(seg);
+		}
+	}
+
+	store_snap_release(snap);
+	return 0;
+}
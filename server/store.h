@@ -0,0 +1,150 @@
+#ifndef __STORE_H__
+#define __STORE_H__
+
+#include <stdbool.h>   /* bool */
+#include <stddef.h>    /* size_t */
+#include <stdint.h>    /* uint64_t */
+#include <stdatomic.h> /* atomics */
+#include <pthread.h>   /* pthread_mutex_t */
+#include <sys/types.h> /* off_t */
+#include <sys/uio.h>   /* struct iovec */
+
+#include "pktidx.h"  /* pktidx_t */
+#include "pktring.h" /* pktring_t */
+#include "reply.h"   /* reply_xfer_t */
+
+/*
+ * Storage engine for the packet log.
+ *
+ * Bytes are addressed by a logical offset that only grows. Without
+ * seg_bytes the log is the single file at the data path, exactly as
+ * before. With it, the log rolls over to a new segment file,
+ * "<path>.NNNNNN", before writing to a segment that reached seg_bytes.
+ *
+ * Retention keeps the newest keep_bytes bytes and/or keep_packets
+ * packets (0 = unlimited) as the window [start, end) that replies send;
+ * segments wholly before the window are deleted. Packet start offsets
+ * are indexed (pktidx) so the window moves on packet boundaries.
+ *
+ * With ring_packets the store is instead an in-memory ring of the last
+ * N packets (pktring): no file is touched, and the window is whatever
+ * the ring holds. Segments and retention do not apply then.
+ *
+ * Writers are serialized by the caller (the append lock). Readers take a
+ * snapshot that pins the segments it spans, so a segment deleted under a
+ * reply stays readable until the reply lets go of it.
+ *
+ * After each commit the new end is published with a release store
+ * (committed): everything below it is whole packets and never changes,
+ * so a reply fixes its range once and streams it with no lock held. In
+ * single-file mode the one segment lives as long as the store, and
+ * taking a snapshot does not touch the lock either; writers never wait
+ * for readers there.
+ */
+typedef struct {
+	off_t seg_bytes;	/* roll threshold, 0: single file */
+	off_t keep_bytes;	/* retention, 0: unlimited */
+	uint64_t keep_packets;	/* retention, 0: unlimited */
+	size_t ring_packets;	/* memory only, last N packets, 0: files */
+	bool sync_roll;		/* fdatasync a segment before leaving it */
+} store_opts_t;
+
+typedef struct store_seg {
+	int fd;			/* read/append, O_APPEND */
+	unsigned long seq;	/* file suffix in segmented mode */
+	off_t start;		/* logical offset of the first byte */
+	off_t size;		/* writer side only */
+	off_t sealed_end;	/* final end, valid once next is published */
+	atomic_int refs;	/* the list's reference plus snapshots */
+	_Atomic(struct store_seg *) next;
+	struct store_seg *dropped;	/* writer's list of retired segments */
+} store_seg_t;
+
+typedef struct {
+	char *path;
+	store_opts_t opts;
+	bool segmented;
+
+	pthread_mutex_t lock;	/* window, segment list and index */
+	store_seg_t *head;
+	store_seg_t *tail;	/* segment being appended to */
+	off_t start;		/* retained window */
+	off_t end;
+	_Atomic off_t committed; /* end, published after every commit */
+	pktidx_t idx;
+	bool line_start;	/* next byte starts a packet */
+	bool idx_broken;	/* a push failed, retention per segment only */
+	bool torn;		/* a failed write could not be cut back */
+	pktring_t ring;		/* ring_packets mode, head and tail are NULL */
+} store_t;
+
+/* Pinned read view: segments from seg on, or ring packets, up to end */
+typedef struct {
+	store_seg_t *seg;	/* NULL: nothing pinned */
+	pktring_view_t view;
+	off_t end;
+} store_snap_t;
+
+/*
+ * Open or recover the log at path. Existing data (the file, or in
+ * segmented mode every "<path>.NNNNNN") is adopted and indexed.
+ */
+int store_open(store_t *st, const char *path, const store_opts_t *opts);
+/* Close every segment, deleting the files too if unlink_files */
+void store_close(store_t *st, bool unlink_files);
+
+/*
+ * Writer side, under the caller's append lock. store_write() puts iov at
+ * the end of the tail segment, rolling first if it is full; *written
+ * counts the bytes that made it. A write that fails part way is cut back
+ * off the file and counts as nothing written, so file offsets keep
+ * matching logical ones. store_commit() then accounts for one whole
+ * packet of len bytes and returns the new end offset.
+ */
+int store_write(store_t *st, struct iovec *iov, int iovcnt, bool sync,
+		size_t *written);
+/*
+ * Drop whatever was written past the committed end of the tail, after
+ * an append that bypassed store_write() fell short. If that fails the
+ * store refuses further writes (EIO) rather than misplace them.
+ */
+int store_cut_back(store_t *st);
+off_t store_commit(store_t *st, const struct iovec *iov, int iovcnt,
+		size_t len);
+
+/*
+ * fdatasync the tail segment; safe against a concurrent writer, which is
+ * what the background flusher needs. A no-op for the memory ring.
+ */
+int store_sync(store_t *st);
+
+/* Committed end: whole packets only, safe to read without the lock */
+off_t store_end(store_t *st);
+
+/* The only segment's fd in single-file mode, -1 otherwise */
+int store_single_fd(store_t *st);
+
+/*
+ * Pin the window as of end: *start is where a reply of [start, end)
+ * begins. Release with store_snap_release().
+ */
+void store_snapshot(store_t *st, off_t end, store_snap_t *snap,
+		off_t *start);
+void store_snap_release(store_snap_t *snap);
+
+/*
+ * Pin the window from byte in of write command cmd (0: the oldest packet
+ * retained) to the current end, found with one index lookup. -1 with
+ * errno = EINVAL if there is no such command or byte.
+ */
+int store_seek(store_t *st, uint64_t cmd, uint64_t in, store_snap_t *snap,
+		off_t *off, off_t *end);
+
+/*
+ * Same contract as reply_send(), across the pinned segments: send
+ * [*off, snap->end) to sock. Segments are unpinned as they are passed.
+ */
+int store_send(store_snap_t *snap, reply_xfer_t *x, int sock, off_t *off,
+		size_t *sent);
+
+#endif
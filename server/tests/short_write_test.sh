@@ -0,0 +1,74 @@
+#!/bin/bash
+# Short appends: with the file size limited (ulimit -f, SIGXFSZ ignored so
+# the write returns short), a packet that only partly fits must leave no
+# bytes behind. The next packet that fits then lands right after the last
+# whole one, in the file and in its reply.
+#
+# Usage: tests/short_write_test.sh   (from server/, normally via make check)
+#        AESDSOCKET and SERVER_ARGS test another build in one mode only
+set -u
+
+cd "$(dirname "$0")/.."
+
+PORT=${PORT:-9323}
+LIMIT=1024	# bytes, one ulimit -f block
+AESDSOCKET=${AESDSOCKET:-./aesdsocket}
+if [ -n "${SERVER_ARGS+set}" ]; then
+	runs=("$SERVER_ARGS")
+else
+	runs=("" "-m 0" "-e")
+fi
+
+scratch=$(mktemp -d) || exit 1
+server=
+trap 'kill $server 2>/dev/null; wait $server 2>/dev/null; rm -rf "$scratch"' EXIT
+
+fail() { echo "FAIL: $*"; exit 1; }
+
+# packet N LEN: LEN bytes, newline included
+packet() { printf "p%03d-%0$(($2 - 6))d" "$1" 0; }
+
+# ask LINE BYTES: send LINE, print up to BYTES of the reply
+ask() {
+	exec 3<>"/dev/tcp/127.0.0.1/$PORT" || return
+	printf '%s\n' "$1" >&3
+	timeout 2 head -c "$2" <&3
+	exec 3>&-
+}
+
+for args in "${runs[@]}"; do
+	rm -f "$scratch/data"
+	(ulimit -f 1; trap '' XFSZ; exec "$AESDSOCKET" -p "$PORT" \
+		-D "$scratch/data" --timestamp-interval=0 $args) &
+	server=$!
+	for _ in $(seq 50); do
+		(exec 3<>"/dev/tcp/127.0.0.1/$PORT") 2>/dev/null && break
+		sleep 0.1
+	done
+
+	# Ten 100 byte packets fill all but 24 bytes of the limit
+	want=
+	for n in $(seq 10); do
+		want+=$(packet "$n" 100)$'\n'
+		got=$(ask "$(packet "$n" 100)" $((n * 100)))
+		[ "$got"$'\n' = "$want" ] || fail "[$args] packet $n: bad reply"
+	done
+
+	# The eleventh gets 24 bytes in, then EFBIG: no reply
+	got=$(ask "$(packet 11 100)" 1)
+	[ -z "$got" ] || fail "[$args] cut short packet got a reply"
+	size=$(stat -c %s "$scratch/data")
+	[ "$size" = 1000 ] || fail "[$args] $size bytes in the file, want 1000"
+
+	# Twenty bytes still fit, right after packet 10
+	want+=$(packet 12 20)$'\n'
+	got=$(ask "$(packet 12 20)" 1020)
+	[ "$got"$'\n' = "$want" ] || fail "[$args] reply after the short write"
+	[ "$(cat "$scratch/data")"$'\n' = "$want" ] \
+		|| fail "[$args] file after the short write"
+
+	kill $server
+	wait $server 2>/dev/null
+	server=
+	echo "ok: short write cut back [${args:-workers}]"
+done
@@ -0,0 +1,101 @@
+#!/bin/bash
+# Timestamp lines under load: clients stream packets (some split across
+# writes) while the server appends a timestamp every second. Every line of
+# the data file must then be either a whole timestamp or a whole client
+# packet, each client's packets in order, with at least one timestamp per
+# second of load.
+#
+# Usage: tests/timestamp_test.sh   (from server/, normally via make check)
+set -u
+
+cd "$(dirname "$0")/.."
+
+PORT=${PORT:-9321}
+CPORT=${CPORT:-9322}
+CLIENTS=${CLIENTS:-8}
+SECS=${SECS:-4}
+SERVER_ARGS=${SERVER_ARGS:-}	# e.g. -e for the event loop
+
+scratch=$(mktemp -d) || exit 1
+server=
+trap 'kill $server 2>/dev/null; wait $server 2>/dev/null; rm -rf "$scratch"' EXIT
+
+fail() { echo "FAIL: $*"; exit 1; }
+
+# Plain clients get a reply per packet, coalescing ones per batch
+./aesdsocket -p "$PORT" -c "$CPORT" -D "$scratch/data" \
+	--timestamp-interval=1 $SERVER_ARGS &
+server=$!
+
+for _ in $(seq 50); do
+	(exec 3<>"/dev/tcp/127.0.0.1/$PORT") 2>/dev/null && break
+	sleep 0.1
+done
+
+filler=abcdefghijklmnopqrstuvwxyz
+
+# client ID PORT: bursts of packets "cID-SEQ:...", ten a second, for SECS
+client() {
+	local id=$1 seq=0 end=$((SECONDS + SECS)) batch
+	exec 3<>"/dev/tcp/127.0.0.1/$2" || exit 1
+	cat <&3 >/dev/null &
+	local reader=$!
+
+	while [ $SECONDS -lt $end ]; do
+		batch=
+		for _ in 1 2 3 4 5 6 7 8 9 10; do
+			batch+="c$id-$seq:$filler"$'\n'
+			seq=$((seq + 1))
+		done
+		printf '%s' "$batch" >&3
+		# One packet in two writes, the second after the server saw the first
+		printf '%s' "c$id-$seq:first-half-" >&3
+		sleep 0.05
+		printf '%s\n' "second-half" >&3
+		seq=$((seq + 1))
+		sleep 0.05
+	done
+
+	sleep 0.5 # let the last replies arrive
+	kill $reader 2>/dev/null
+	exec 3>&-
+	echo "$seq" > "$scratch/sent.$id"
+}
+
+clients=()
+for id in $(seq "$CLIENTS"); do
+	port=$PORT
+	[ $((id % 2)) = 0 ] && port=$CPORT
+	client "$id" "$port" &
+	clients+=($!)
+done
+wait "${clients[@]}"
+
+data=$scratch/data
+[ -s "$data" ] || fail "no data written"
+[ "$(tail -c 1 "$data" | od -An -c | tr -d ' ')" = '\n' ] \
+	|| fail "data does not end with a newline"
+
+stamp='^timestamp:(Mon|Tue|Wed|Thu|Fri|Sat|Sun), [0-9]{2} [A-Z][a-z]{2} [0-9]{4} [0-9]{2}:[0-9]{2}:[0-9]{2} [+-][0-9]{4}$'
+packet="^c[0-9]+-[0-9]+:($filler|first-half-second-half)\$"
+
+bad=$(grep -Evc -e "$stamp" -e "$packet" "$data")
+[ "$bad" = 0 ] || {
+	grep -Ev -e "$stamp" -e "$packet" "$data" | head -5
+	fail "$bad lines are neither a timestamp nor a packet"
+}
+
+stamps=$(grep -Ec "$stamp" "$data")
+[ "$stamps" -ge $((SECS - 1)) ] || fail "$stamps timestamps in ${SECS}s"
+
+# Each client's packets exactly once and in order
+for id in $(seq "$CLIENTS"); do
+	sent=$(cat "$scratch/sent.$id" 2>/dev/null) || fail "client $id died"
+	got=$(grep "^c$id-" "$data" | awk -F'[-:]' -v want=0 '
+		$2 != want { print "out of order at " $2 ", want " want; exit }
+		{ want++ }
+		END { if (NR == want) print want }')
+	[ "$got" = "$sent" ] || fail "client $id: sent $sent, $got"
+done
+
+echo "ok: $(wc -l < "$data") lines, $stamps timestamps, $CLIENTS clients"
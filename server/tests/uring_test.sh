@@ -0,0 +1,76 @@
+#!/bin/bash
+# The io_uring backend: builds a copy of the tree with URING=1 and serves
+# through it (-u). The bench checks its replies against the file it
+# wrote; the server must reply with the whole data file, across several
+# linked read/send chains once that outgrows one, and cut a short append
+# back like the syscall path does. Skipped without liburing or io_uring.
+#
+# Usage: tests/uring_test.sh   (from server/, normally via make check)
+set -u
+
+cd "$(dirname "$0")/.."
+
+PORT=${PORT:-9324}
+
+scratch=$(mktemp -d) || exit 1
+server=
+trap 'kill $server 2>/dev/null; wait $server 2>/dev/null; rm -rf "$scratch"' EXIT
+
+fail() { echo "FAIL: $*"; exit 1; }
+skip() { echo "skip: $*"; exit 0; }
+
+printf '#include <liburing.h>\n' | ${CC:-cc} -E -x c - >/dev/null 2>&1 \
+	|| skip "liburing is not installed"
+
+src=$scratch/src
+mkdir -p "$src/bench"
+cp *.c *.h Makefile "$src" && cp bench/*.c "$src/bench" || exit 1
+make -s -C "$src" URING=1 aesdsocket bench/uring_bench >/dev/null \
+	|| fail "make URING=1"
+
+out=$("$src/bench/uring_bench" -n 100 -s 40000) || fail "uring_bench"
+grep -q '^io_uring .*unavailable' <<< "$out" \
+	&& skip "$(grep '^io_uring' <<< "$out")"
+grep -q FAILED <<< "$out" && { echo "$out"; fail "uring_bench replies"; }
+
+"$src/aesdsocket" -p "$PORT" -u -D "$scratch/data" --timestamp-interval=0 &
+server=$!
+for _ in $(seq 50); do
+	(exec 3<>"/dev/tcp/127.0.0.1/$PORT") 2>/dev/null && break
+	sleep 0.1
+done
+# The workers, and their rings, start after the listener
+for _ in $(seq 50); do
+	ls -l "/proc/$server/fd" | grep -q io_uring && break
+	sleep 0.1
+done
+ls -l "/proc/$server/fd" | grep -q io_uring || fail "server has no ring"
+
+# ask LINE BYTES: send LINE, save up to BYTES of the reply in $scratch/reply
+ask() {
+	exec 3<>"/dev/tcp/127.0.0.1/$PORT" || return
+	printf '%s\n' "$1" >&3
+	timeout 5 head -c "$2" <&3 > "$scratch/reply"
+	exec 3>&-
+}
+
+# Small packets, then 1 MiB ones until a reply takes more than one chain
+size=0
+for n in $(seq 10) big1 big2 big3; do
+	case $n in
+	big*) line=$(head -c $((1024 * 1024 - 1)) /dev/zero | tr '\0' "${n: -1}") ;;
+	*) line="packet $n" ;;
+	esac
+	size=$((size + ${#line} + 1))
+	ask "$line" "$size"
+	cmp -s "$scratch/reply" "$scratch/data" \
+		|| fail "reply to packet $n is not the data file"
+done
+[ "$(stat -c %s "$scratch/data")" = "$size" ] || fail "data file size"
+kill $server
+wait $server 2>/dev/null
+server=
+echo "ok: io_uring replies, $size bytes"
+
+AESDSOCKET=$src/aesdsocket SERVER_ARGS=-u PORT=$PORT \
+	tests/short_write_test.sh || exit 1
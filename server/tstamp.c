@@ -0,0 +1,96 @@
+#include <string.h>  /* strerror */
+#include <errno.h>   /* errno */
+#include <syslog.h>  /* syslog */
+#include <time.h>    /* clock_gettime, localtime_r, strftime */
+
+#include "tstamp.h"
+#include "bgthread.h"
+#include "metrics.h"
+
+/* RFC 2822 date-time, e.g. "timestamp:Sat, 17 Oct 2026 22:15:00 +0000" */
+#define TS_FORMAT "timestamp:%a, %d %b %Y %T %z\n"
+
+static size_t format_now(char *buf, size_t cap) {
+	struct timespec now;
+	struct tm tm;
+
+	clock_gettime(CLOCK_REALTIME_COARSE, &now);
+	if (!localtime_r(&now.tv_sec, &tm))
+		return 0;
+	return strftime(buf, cap, TS_FORMAT, &tm);
+}
+
+static void *ts_main(void *arg) {
+	tstamp_t *ts = arg;
+	struct timespec deadline;
+	char line[128];
+
+	/* Absolute deadlines, so a slow append does not make the period drift */
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+	pthread_mutex_lock(&ts->lock);
+	for (;;) {
+		deadline.tv_sec += ts->interval;
+		while (!ts->stop && pthread_cond_timedwait(&ts->wake, &ts->lock,
+				&deadline) != ETIMEDOUT) {}
+		if (ts->stop)
+			break;
+		pthread_mutex_unlock(&ts->lock);
+
+		size_t len = format_now(line, sizeof line);
+		struct iovec iov = { .iov_base = line, .iov_len = len };
+		off_t end;
+		if (!len)
+			syslog(LOG_ERR, "timestamp: cannot format the time");
+		else if (gc_append(ts->gc, &iov, 1, len, &end) == -1)
+			syslog(LOG_ERR, "timestamp: append failed: %s",
+			       strerror(errno));
+		else
+			metrics_inc(&metrics.timestamps, 1);
+
+		pthread_mutex_lock(&ts->lock);
+	}
+	pthread_mutex_unlock(&ts->lock);
+	return NULL;
+}
+
+int ts_start(tstamp_t *ts, gcommit_t *gc, unsigned interval) {
+	ts->gc = gc;
+	ts->interval = interval;
+	ts->stop = false;
+	ts->started = false;
+	if (!interval)
+		return 0;
+
+	if (bg_cond_init(&ts->wake) == -1)
+		return -1;
+	if ((errno = pthread_mutex_init(&ts->lock, NULL)) != 0) {
+		pthread_cond_destroy(&ts->wake);
+		return -1;
+	}
+
+	if (bg_spawn(&ts->tid, ts_main, ts) == -1) {
+		int err = errno;
+		pthread_mutex_destroy(&ts->lock);
+		pthread_cond_destroy(&ts->wake);
+		errno = err;
+		return -1;
+	}
+	ts->started = true;
+	return 0;
+}
+
+void ts_stop(tstamp_t *ts) {
+	if (!ts->started)
+		return;
+
+	pthread_mutex_lock(&ts->lock);
+	ts->stop = true;
+	pthread_cond_signal(&ts->wake);
+	pthread_mutex_unlock(&ts->lock);
+	pthread_join(ts->tid, NULL);
+	ts->started = false;
+
+	pthread_mutex_destroy(&ts->lock);
+	pthread_cond_destroy(&ts->wake);
+}
@@ -0,0 +1,32 @@
+#ifndef __TSTAMP_H__
+#define __TSTAMP_H__
+
+#include <stdbool.h> /* bool */
+#include <pthread.h> /* pthread_t, mutex, cond */
+
+#include "gcommit.h" /* gcommit_t */
+
+/*
+ * Periodic "timestamp:<RFC 2822 time>\n" records. A thread wakes every
+ * interval seconds, formats the wall clock (coarse, read once per
+ * record) and appends the line through the group committer like any
+ * client packet: it rides along in whatever batch is being formed, so
+ * it is never split by or interleaved with client lines, and writers
+ * never take an extra lock or read the clock for it.
+ */
+typedef struct {
+	gcommit_t *gc;
+	unsigned interval;	/* seconds */
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	bool stop;		/* guarded by lock */
+	bool started;
+	pthread_t tid;
+} tstamp_t;
+
+/* interval 0 leaves the writer off */
+int ts_start(tstamp_t *ts, gcommit_t *gc, unsigned interval);
+/* Safe to call when never started */
+void ts_stop(tstamp_t *ts);
+
+#endif
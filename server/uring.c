@@ -0,0 +1,380 @@
+#include <stdlib.h>  /* malloc, free */
+#include <stdbool.h> /* bool */
+#include <stdint.h>  /* uintptr_t */
+#include <errno.h>   /* errno */
+#include <sys/uio.h> /* struct iovec */
+
+#include "uring.h"
+
+#ifdef AESD_HAVE_URING
+
+#include <liburing.h>
+
+/* Registered file slots */
+enum { UR_FILE_APPEND = 0, UR_FILE_SOCK, UR_FILE_READ, UR_NFILES };
+
+/* Registered buffer slots */
+enum { UR_BUF_RECV = 0, UR_BUF_REPLY, UR_NBUFS };
+
+/* user_data: low byte is the op, the rest is the reply chunk index */
+enum { UR_TAG_APPEND = 1, UR_TAG_RECV, UR_TAG_READ, UR_TAG_SEND };
+#define UR_TAG(op, idx) ((void *)(uintptr_t)(((uintptr_t)(idx) << 8) | (op)))
+#define UR_TAG_OP(p)    ((unsigned)((uintptr_t)(p) & 0xff))
+#define UR_TAG_IDX(p)   ((size_t)((uintptr_t)(p) >> 8))
+
+/* One SQE for the append, the rest hold READ/SEND pairs */
+#define UR_PAIRS ((URING_ENTRIES - 1) / 2)
+
+struct ur_ring {
+	struct io_uring ring;
+	char *recv_buf;
+	char *reply_buf;
+	off_t chunk_off[UR_PAIRS]; /* file offset of each queued chunk */
+	bool broken;	/* a wait failed with requests possibly in flight */
+};
+
+ur_ring_t *ur_create(hc_bufs_t *bufs, hc_shared_t *shared) {
+	int rc;
+	/* Registered files cannot follow segments rolling over */
+	int data_fd = store_single_fd(shared->store);
+	if (data_fd == -1) {
+		errno = ENOTSUP;
+		return NULL;
+	}
+
+	ur_ring_t *ur = calloc(1, sizeof *ur);
+	if (!ur) return NULL;
+
+	ur->recv_buf = bufs->recv_buf;
+
+	if ((rc = io_uring_queue_init(URING_ENTRIES, &ur->ring, 0)) < 0) {
+		free(ur);
+		errno = -rc;
+		return NULL;
+	}
+
+	ur->reply_buf = malloc(URING_REPLY_BUF);
+	if (!ur->reply_buf) {
+		rc = -ENOMEM;
+		goto fail;
+	}
+
+	struct iovec iov[UR_NBUFS] = {
+		[UR_BUF_RECV]    = { ur->recv_buf, bufs->recv_cap },
+		[UR_BUF_REPLY]   = { ur->reply_buf, URING_REPLY_BUF },
+	};
+	/* Fails with ENOMEM once RLIMIT_MEMLOCK is exhausted */
+	if ((rc = io_uring_register_buffers(&ur->ring, iov, UR_NBUFS)) < 0)
+		goto fail;
+
+	int files[UR_NFILES] = {
+		[UR_FILE_APPEND] = data_fd,
+		[UR_FILE_SOCK]   = -1, /* sparse until ur_attach */
+		[UR_FILE_READ]   = data_fd,
+	};
+	if ((rc = io_uring_register_files(&ur->ring, files, UR_NFILES)) < 0)
+		goto fail;
+
+	return ur;
+
+fail:
+	ur_destroy(ur);
+	errno = -rc;
+	return NULL;
+}
+
+void ur_destroy(ur_ring_t *ur) {
+	if (!ur) return;
+	io_uring_queue_exit(&ur->ring);
+	free(ur->reply_buf);
+	free(ur);
+}
+
+int ur_attach(ur_ring_t *ur, int sock_fd) {
+	/* Stale completions may still arrive: serve with syscalls instead */
+	if (ur->broken) {
+		errno = EIO;
+		return -1;
+	}
+
+	int rc = io_uring_register_files_update(&ur->ring, UR_FILE_SOCK,
+						&sock_fd, 1);
+	if (rc < 0) { errno = -rc; return -1; }
+	return 0;
+}
+
+/*
+ * Wait for one completion, returning its result and tag. If the wait
+ * itself fails, *tag is NULL (every request carries a tag) and the ring
+ * is marked broken: what was in flight can no longer be accounted for.
+ */
+static int reap(ur_ring_t *ur, void **tag) {
+	struct io_uring_cqe *cqe;
+	int rc;
+
+	*tag = NULL;
+	while ((rc = io_uring_wait_cqe(&ur->ring, &cqe)) == -EINTR) {}
+	if (rc < 0) {
+		ur->broken = true;
+		return rc;
+	}
+
+	rc = cqe->res;
+	*tag = io_uring_cqe_get_data(cqe);
+	io_uring_cqe_seen(&ur->ring, cqe);
+	return rc;
+}
+
+ssize_t ur_recv(ur_ring_t *ur, void *buf, size_t len) {
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&ur->ring);
+	void *tag;
+
+	if (!sqe) {
+		errno = EBUSY;
+		return -1;
+	}
+	io_uring_prep_read_fixed(sqe, UR_FILE_SOCK, buf, len, 0, UR_BUF_RECV);
+	io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+	io_uring_sqe_set_data(sqe, UR_TAG(UR_TAG_RECV, 0));
+
+	int rc = io_uring_submit_and_wait(&ur->ring, 1);
+	if (rc < 0) {
+		ur->broken = true;
+		errno = -rc;
+		return -1;
+	}
+
+	rc = reap(ur, &tag);
+	if (rc < 0) { errno = -rc; return -1; }
+	return rc;
+}
+
+/*
+ * Queue linked READ_FIXED -> SEND pairs covering [off, end), as many as
+ * fit in the ring. The previously queued SQE must carry IOSQE_IO_LINK
+ * if the chain should wait for it. Returns the number of pairs queued,
+ * 0 if the submission queue has no room for a pair.
+ */
+static size_t queue_reply(ur_ring_t *ur, off_t off, off_t end) {
+	struct io_uring_sqe *last = NULL;
+	size_t pairs = 0;
+
+	/* Room for both halves first: a read must never be left unpaired */
+	while (off < end && pairs < UR_PAIRS
+			&& io_uring_sq_space_left(&ur->ring) >= 2) {
+		size_t len = URING_REPLY_BUF;
+		if ((off_t)len > end - off)
+			len = (size_t)(end - off);
+
+		struct io_uring_sqe *rd = io_uring_get_sqe(&ur->ring);
+		struct io_uring_sqe *sd = io_uring_get_sqe(&ur->ring);
+		if (!rd || !sd)
+			break;
+		io_uring_prep_read_fixed(rd, UR_FILE_READ, ur->reply_buf, len,
+					 off, UR_BUF_REPLY);
+		io_uring_sqe_set_flags(rd, IOSQE_FIXED_FILE | IOSQE_IO_LINK);
+		io_uring_sqe_set_data(rd, UR_TAG(UR_TAG_READ, pairs));
+
+		/* One reply buffer: the link keeps read/send strictly serial */
+		io_uring_prep_send(sd, UR_FILE_SOCK, ur->reply_buf, len,
+				   MSG_WAITALL | MSG_NOSIGNAL);
+		io_uring_sqe_set_flags(sd, IOSQE_FIXED_FILE | IOSQE_IO_LINK);
+		io_uring_sqe_set_data(sd, UR_TAG(UR_TAG_SEND, pairs));
+
+		ur->chunk_off[pairs] = off;
+		off += (off_t)len;
+		pairs++;
+		last = sd;
+	}
+
+	/* The chain ends with the last send */
+	if (last)
+		last->flags &= ~IOSQE_IO_LINK;
+
+	return pairs;
+}
+
+/*
+ * Reap the completions of a queued reply chain. *sent advances to the end
+ * of the last chunk confirmed in order. Returns 0 when the chain is
+ * drained (possibly short, the caller resubmits from *sent), 1 when the
+ * peer is gone, -1 with errno on failure. Every queued SQE completes,
+ * cancelled or not, so once drained nothing of the chain is in flight;
+ * a failed wait stops the drain and fails the chain.
+ */
+static int reap_reply(ur_ring_t *ur, hc_conn_t *c, size_t pairs,
+		off_t *sent) {
+	int rc = 0;
+
+	for (size_t n = 0; n < pairs * 2; n++) {
+		void *tag;
+		int res = reap(ur, &tag);
+		if (!tag) {
+			errno = -res;
+			return -1;
+		}
+		size_t idx = UR_TAG_IDX(tag);
+
+		if (res == -ECANCELED || rc)
+			continue; /* chain already broken, just drain */
+
+		if (UR_TAG_OP(tag) == UR_TAG_READ) {
+			if (res < 0) { errno = -res; rc = -1; }
+			continue; /* a short read cancels its send */
+		}
+
+		if (res == -EPIPE || res == -ECONNRESET) {
+			rc = 1;
+		} else if (res < 0) {
+			errno = -res;
+			rc = -1;
+		} else {
+			c->res.transferred += (size_t)res;
+			*sent = ur->chunk_off[idx] + res;
+		}
+	}
+
+	return rc;
+}
+
+int ur_append_and_reply(ur_ring_t *ur, hc_conn_t *c, hc_shared_t *shared,
+		const struct iovec *iov, int iovcnt, size_t len,
+		hc_op_t *failed_op) {
+	struct io_uring_sqe *sqe;
+	void *tag;
+	int rc;
+
+	pthread_mutex_lock(&shared->append_lock);
+	if (shared->store->torn) {
+		pthread_mutex_unlock(&shared->append_lock);
+		*failed_op = HC_OP_APPEND;
+		errno = EIO;
+		return -1;
+	}
+	off_t start = shared->store->start;
+	off_t end = store_end(shared->store) + (off_t)len;
+
+	/*
+	 * Prefix and segment straight from the caller's buffers; iov stays
+	 * valid until the append completes below. O_APPEND on the file
+	 * makes the offset irrelevant.
+	 */
+	sqe = io_uring_get_sqe(&ur->ring);
+	if (!sqe) {
+		pthread_mutex_unlock(&shared->append_lock);
+		*failed_op = HC_OP_APPEND;
+		errno = EBUSY;
+		return -1;
+	}
+	io_uring_prep_writev(sqe, UR_FILE_APPEND, iov, iovcnt, (uint64_t)-1);
+	io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE | IOSQE_IO_LINK);
+	io_uring_sqe_set_data(sqe, UR_TAG(UR_TAG_APPEND, 0));
+
+	/* A failed or short append cancels the whole reply chain */
+	size_t pairs = queue_reply(ur, start, end);
+	if (!pairs) sqe->flags &= ~IOSQE_IO_LINK;
+
+	rc = io_uring_submit_and_wait(&ur->ring, 1);
+	if (rc < 0) {
+		/* Whatever part of the chain went in is beyond tracking */
+		ur->broken = true;
+		store_cut_back(shared->store);
+		pthread_mutex_unlock(&shared->append_lock);
+		*failed_op = HC_OP_APPEND;
+		errno = -rc;
+		return -1;
+	}
+
+	/* Links run in order, so the first completion is the append */
+	rc = reap(ur, &tag);
+	if (rc == (int)len)
+		hc_packet_committed(shared, iov, iovcnt, len);
+	else if (rc > 0 || !tag)
+		store_cut_back(shared->store); /* keep offsets in step */
+	pthread_mutex_unlock(&shared->append_lock);
+
+	if (rc != (int)len) {
+		for (size_t n = 0; tag && n < pairs * 2; n++)
+			reap(ur, &tag);
+		*failed_op = HC_OP_APPEND;
+		errno = rc < 0 ? -rc : EIO;
+		return -1;
+	}
+
+	/* Reply chunks, resubmitting after a short chain until done */
+	off_t sent = start;
+	for (;;) {
+		off_t before = sent;
+		rc = reap_reply(ur, c, pairs, &sent);
+		if (rc == 1) return 0;
+		if (rc == -1) {
+			*failed_op = HC_OP_SEND;
+			return -1;
+		}
+		if (sent >= end) return 0;
+		if (sent == before) {
+			*failed_op = HC_OP_SEND;
+			errno = EIO;
+			return -1;
+		}
+
+		/* The last chain is fully reaped, the ring is empty again */
+		pairs = queue_reply(ur, sent, end);
+		if (!pairs) {
+			*failed_op = HC_OP_SEND;
+			errno = EBUSY;
+			return -1;
+		}
+		rc = io_uring_submit(&ur->ring);
+		if (rc < 0) {
+			ur->broken = true;
+			*failed_op = HC_OP_SEND;
+			errno = -rc;
+			return -1;
+		}
+	}
+}
+
+#else /* !AESD_HAVE_URING */
+
+ur_ring_t *ur_create(hc_bufs_t *bufs, hc_shared_t *shared) {
+	(void)bufs;
+	(void)shared;
+	errno = ENOSYS;
+	return NULL;
+}
+
+void ur_destroy(ur_ring_t *ur) {
+	(void)ur;
+}
+
+int ur_attach(ur_ring_t *ur, int sock_fd) {
+	(void)ur;
+	(void)sock_fd;
+	errno = ENOSYS;
+	return -1;
+}
+
+ssize_t ur_recv(ur_ring_t *ur, void *buf, size_t len) {
+	(void)ur;
+	(void)buf;
+	(void)len;
+	errno = ENOSYS;
+	return -1;
+}
+
+int ur_append_and_reply(ur_ring_t *ur, hc_conn_t *c, hc_shared_t *shared,
+		const struct iovec *iov, int iovcnt, size_t len,
+		hc_op_t *failed_op) {
+	(void)ur;
+	(void)c;
+	(void)shared;
+	(void)iov;
+	(void)iovcnt;
+	(void)len;
+	*failed_op = HC_OP_NONE;
+	errno = ENOSYS;
+	return -1;
+}
+
+#endif
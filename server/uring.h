@@ -0,0 +1,41 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <stddef.h>     /* size_t */
+#include <sys/types.h>  /* ssize_t */
+
+#include "handleconn.h" /* hc_conn_t, hc_shared_t, hc_bufs_t */
+
+/*
+ * Optional io_uring backend for the blocking worker path. Built only with
+ * `make URING=1` (defines AESD_HAVE_URING, links liburing); otherwise the
+ * functions below are stubs and ur_create() always fails with ENOSYS.
+ *
+ * Per worker ring with the data file (for appending and for reading) and
+ * the client socket as registered files, and the recv and reply buffers
+ * as registered buffers. A packet append and its reply are submitted as
+ * one linked chain: WRITEV -> (READ_FIXED -> SEND)*. Only a single-file
+ * store can be registered; with segments ur_create() fails (ENOTSUP).
+ */
+typedef struct ur_ring ur_ring_t;
+
+/* NULL with errno set if io_uring is unusable; use the syscall path */
+ur_ring_t *ur_create(hc_bufs_t *bufs, hc_shared_t *shared);
+void ur_destroy(ur_ring_t *ur);
+
+/* Register the client socket for the connection about to be served */
+int ur_attach(ur_ring_t *ur, int sock_fd);
+
+/* Same contract as recv(2) on a blocking socket, into bufs->recv_buf */
+ssize_t ur_recv(ur_ring_t *ur, void *buf, size_t len);
+
+/*
+ * Append the len bytes described by iov and stream the data file up to
+ * the end of that append to c->fd. Returns 0 on success, -1 with errno
+ * and *failed_op set (errno = EIO on a short append).
+ */
+int ur_append_and_reply(ur_ring_t *ur, hc_conn_t *c, hc_shared_t *shared,
+		const struct iovec *iov, int iovcnt, size_t len,
+		hc_op_t *failed_op);
+
+#endif
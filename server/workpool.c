@@ -0,0 +1,205 @@
+#include <stdlib.h>  /* calloc, free */
+#include <stdio.h>   /* snprintf */
+#include <string.h>  /* strerror */
+#include <errno.h>   /* errno */
+#include <signal.h>  /* pthread_sigmask */
+#include <time.h>    /* clock_gettime */
+#include <unistd.h>  /* close */
+#include <syslog.h>  /* syslog */
+
+#include "workpool.h"
+#include "bgthread.h"
+#include "uring.h"
+#include "alog.h"
+
+extern volatile sig_atomic_t exit_requested;
+
+/* How often a blocked submitter rechecks exit_requested */
+#define WP_SUBMIT_POLL_MS 200
+
+static void *worker_main(void *arg) {
+	wp_worker_t *w = arg;
+	workpool_t *pool = w->pool;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		while (!pool->count && !pool->closing)
+			pthread_cond_wait(&pool->not_empty, &pool->lock);
+
+		if (pool->closing) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+
+		wp_item_t item = pool->queue[pool->head];
+		pool->head = (pool->head + 1) % pool->queue_cap;
+		pool->count--;
+		w->active_fd = item.fd;
+		pthread_cond_signal(&pool->not_full);
+		pthread_mutex_unlock(&pool->lock);
+		lat_since(LAT_ACCEPT, item.accepted);
+
+		hc_result_t res;
+		handle_connection(item.fd, pool->shared, &w->bufs,
+				item.coalesce, &res);
+		hc_log_result(item.peer_ip, &res);
+
+		pthread_mutex_lock(&pool->lock);
+		w->active_fd = -1;
+		pthread_mutex_unlock(&pool->lock);
+
+		close(item.fd);
+		alog(ALOG_CLOSED, item.peer_ip, 0, 0);
+	}
+
+	return NULL;
+}
+
+int wp_init(workpool_t *pool, size_t nworkers, size_t queue_cap,
+		hc_shared_t *shared) {
+	if (!nworkers || !queue_cap) { errno = EINVAL; return -1; }
+
+	*pool = (workpool_t){0};
+	pool->queue_cap = queue_cap;
+	pool->shared = shared;
+
+	pool->queue = calloc(queue_cap, sizeof *pool->queue);
+	pool->workers = calloc(nworkers, sizeof *pool->workers);
+	if (!pool->queue || !pool->workers) {
+		errno = ENOMEM;
+		goto free_arrays;
+	}
+
+	if ((errno = pthread_mutex_init(&pool->lock, NULL)) != 0)
+		goto free_arrays;
+	if ((errno = pthread_cond_init(&pool->not_empty, NULL)) != 0)
+		goto destroy_lock;
+	/* Timed waits on the monotonic clock, see wp_submit() */
+	if (bg_cond_init(&pool->not_full) == -1)
+		goto destroy_not_empty;
+
+	/* Workers never take SIGINT/SIGTERM, the accept thread handles them */
+	sigset_t block, old;
+	sigemptyset(&block);
+	sigaddset(&block, SIGINT);
+	sigaddset(&block, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &block, &old);
+
+	for (size_t i = 0; i < nworkers; i++) {
+		wp_worker_t *w = &pool->workers[i];
+		w->pool = pool;
+		w->active_fd = -1;
+
+		if (hc_bufs_init(&w->bufs, shared) == -1)
+			break;
+
+		/* Runtime fallback: a worker without a ring uses syscalls */
+		if (shared->use_uring) {
+			w->bufs.ring = ur_create(&w->bufs, shared);
+			if (!w->bufs.ring && i == 0)
+				syslog(LOG_WARNING, "io_uring unavailable (%s), "
+				       "using plain syscalls", strerror(errno));
+		}
+
+		if ((errno = pthread_create(&w->tid, NULL, worker_main, w))) {
+			hc_bufs_free(&w->bufs);
+			break;
+		}
+
+		w->started = true;
+		pool->nworkers++;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (pool->nworkers != nworkers) {
+		int saved_errno = errno;
+		wp_shutdown(pool);
+		errno = saved_errno;
+		return -1;
+	}
+
+	return 0;
+
+destroy_not_empty:
+	pthread_cond_destroy(&pool->not_empty);
+destroy_lock:
+	pthread_mutex_destroy(&pool->lock);
+free_arrays:
+	free(pool->queue);	/* free() leaves errno alone */
+	free(pool->workers);
+	pool->queue = NULL;
+	pool->workers = NULL;
+	return -1;
+}
+
+int wp_submit(workpool_t *pool, int fd, const char *peer_ip, bool coalesce,
+		lat_ts_t accepted) {
+	pthread_mutex_lock(&pool->lock);
+	while (pool->count == pool->queue_cap && !pool->closing) {
+		if (exit_requested) break;
+
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_nsec += WP_SUBMIT_POLL_MS * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&pool->not_full, &pool->lock, &ts);
+	}
+
+	if (pool->count == pool->queue_cap || pool->closing) {
+		pthread_mutex_unlock(&pool->lock);
+		errno = ECANCELED;
+		return -1;
+	}
+
+	wp_item_t *item = &pool->queue[(pool->head + pool->count) % pool->queue_cap];
+	item->fd = fd;
+	item->coalesce = coalesce;
+	item->accepted = accepted;
+	snprintf(item->peer_ip, sizeof item->peer_ip, "%s", peer_ip);
+	pool->count++;
+
+	pthread_cond_signal(&pool->not_empty);
+	pthread_mutex_unlock(&pool->lock);
+	return 0;
+}
+
+void wp_shutdown(workpool_t *pool) {
+	if (!pool->workers) return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->closing = true;
+	/* Unblock workers sitting in recv() on a live client */
+	for (size_t i = 0; i < pool->nworkers; i++) {
+		if (pool->workers[i].active_fd != -1)
+			shutdown(pool->workers[i].active_fd, SHUT_RDWR);
+	}
+	pthread_cond_broadcast(&pool->not_empty);
+	pthread_cond_broadcast(&pool->not_full);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (size_t i = 0; i < pool->nworkers; i++) {
+		wp_worker_t *w = &pool->workers[i];
+		if (!w->started) continue;
+		pthread_join(w->tid, NULL);
+		hc_bufs_free(&w->bufs);
+	}
+
+	while (pool->count) {
+		close(pool->queue[pool->head].fd);
+		pool->head = (pool->head + 1) % pool->queue_cap;
+		pool->count--;
+	}
+
+	pthread_cond_destroy(&pool->not_full);
+	pthread_cond_destroy(&pool->not_empty);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->queue);
+	free(pool->workers);
+	pool->queue = NULL;
+	pool->workers = NULL;
+	pool->nworkers = 0;
+}
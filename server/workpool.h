@@ -0,0 +1,61 @@
+#ifndef __WORKPOOL_H__
+#define __WORKPOOL_H__
+
+#include <stdbool.h>    /* bool */
+#include <stddef.h>     /* size_t */
+#include <pthread.h>    /* pthread_t, mutex, cond */
+#include <netinet/in.h> /* INET6_ADDRSTRLEN */
+
+#include "handleconn.h" /* hc_shared_t, hc_bufs_t */
+#include "latency.h"    /* lat_ts_t */
+
+/* One accepted connection waiting for a worker */
+typedef struct {
+	int fd;
+	bool coalesce;		/* accepted on a coalescing listener */
+	lat_ts_t accepted;	/* when accept() returned it */
+	char peer_ip[INET6_ADDRSTRLEN];
+} wp_item_t;
+
+typedef struct workpool workpool_t;
+
+typedef struct {
+	pthread_t tid;
+	workpool_t *pool;
+	hc_bufs_t bufs;
+	int active_fd;		/* guarded by pool->lock */
+	bool started;
+} wp_worker_t;
+
+/*
+ * Bounded pool: the accept thread pushes fds into a fixed-size ring and
+ * blocks once it is full, leaving further clients in the listen backlog.
+ */
+struct workpool {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	wp_item_t *queue;
+	size_t queue_cap;
+	size_t head;
+	size_t count;
+	bool closing;
+
+	wp_worker_t *workers;
+	size_t nworkers;
+	hc_shared_t *shared;
+};
+
+int wp_init(workpool_t *pool, size_t nworkers, size_t queue_cap,
+		hc_shared_t *shared);
+/*
+ * Returns 0 once queued, -1 with errno = ECANCELED if shutdown was
+ * requested while waiting for room. The caller keeps ownership of the fd
+ * on failure.
+ */
+int wp_submit(workpool_t *pool, int fd, const char *peer_ip, bool coalesce,
+		lat_ts_t accepted);
+/* Wakes blocked workers, joins them and closes any fds still queued */
+void wp_shutdown(workpool_t *pool);
+
+#endif